@@ -0,0 +1,118 @@
+#!/usr/bin/env python
+#
+# Boot JOS under QEMU once per microbenchmark in user/bench*.c, collect
+# the "BENCH <name> ops=... cycles=... [bytes=...]" lines they print and
+# write the results as JSON (to bench.json, or the file named by the
+# BENCH_JSON environment variable).  Arguments filter benchmarks by name,
+# as for the grading scripts.
+
+from gradelib import *
+
+import json, os, re, socket, subprocess, threading, time
+
+BENCH_RE = re.compile(r"BENCH (\S+) ops=(\d+) cycles=(\d+)(?: bytes=(\d+))?")
+
+results = {}
+
+r = Runner(save("jos.out"))
+
+def collect():
+    for m in BENCH_RE.finditer(r.qemu.output):
+        name, ops, cycles, nbytes = m.groups()
+        ops, cycles = int(ops), int(cycles)
+        res = {"ops": ops, "cycles": cycles,
+               "cycles_per_op": cycles // max(ops, 1)}
+        if nbytes is not None:
+            res["bytes"] = int(nbytes)
+            res["bytes_per_kcycle"] = int(nbytes) * 1000 // max(cycles, 1)
+        results[name] = res
+
+def bench(binary, *monitors, **kw):
+    def do_bench():
+        r.user_test(binary, stop_on_line("BENCH done"), *monitors, **kw)
+        collect()
+        assert_lines_match(r.qemu.output, "BENCH done")
+    do_bench.__name__ = "test_" + binary
+    test(0, binary)(do_bench)
+
+bench("benchnull")
+bench("benchipc")
+bench("benchpage")
+bench("benchfork")
+bench("benchspawn")
+bench("benchcow")
+bench("benchpipe")
+bench("benchfile")
+
+#
+# Socket echo: the guest runs an echo server, we stream data through it
+# from the host once it is listening and time the transfer from here.
+#
+
+SOCK_BYTES = 256 * 1024
+SOCK_CHUNK = 1024
+
+def sock_client():
+    port = QEMU.get_gdb_port() + 1
+    payload = b"x" * SOCK_CHUNK
+    s = socket.create_connection(("localhost", port), timeout=30)
+    start = time.time()
+    sent = received = 0
+    while sent < SOCK_BYTES:
+        s.sendall(payload)
+        sent += len(payload)
+        while received < sent:
+            data = s.recv(SOCK_CHUNK)
+            if not data:
+                break
+            received += len(data)
+    elapsed = time.time() - start
+    s.close()
+    results["sock_echo_host"] = {
+        "bytes": received, "seconds": elapsed,
+        "bytes_per_sec": int(received / max(elapsed, 1e-9))}
+
+def start_sock_client(line):
+    t = threading.Thread(target=sock_client)
+    t.daemon = True
+    t.start()
+
+bench("benchsock", call_on_line("BENCH sock ready", start_sock_client),
+      make_args=["INIT_CFLAGS=-DTEST_NS"])
+
+#
+# VM-exit round trip: boot a guest with the vmm test, then run
+# benchvmcall from the guest's shell.
+#
+
+def type_in_guest(cmd):
+    def setup_type(runner):
+        state = {"sent": False}
+        def handle_output(output):
+            if not state["sent"] and "vm$ " in runner.qemu.output:
+                state["sent"] = True
+                runner.qemu.write(cmd + "\n")
+        runner.qemu.on_output.append(handle_output)
+    return setup_type
+
+def test_benchvmcall():
+    r.user_test("vmm", type_in_guest("benchvmcall"), stop_on_line("BENCH done"))
+    collect()
+    assert_lines_match(r.qemu.output, "BENCH done")
+test(0, "benchvmcall")(test_benchvmcall)
+
+def write_results():
+    try:
+        commit = subprocess.check_output(
+            ["git", "rev-parse", "HEAD"]).decode().strip()
+    except (subprocess.CalledProcessError, OSError):
+        commit = None
+    path = os.environ.get("BENCH_JSON", "bench.json")
+    with open(path, "w") as f:
+        json.dump({"commit": commit, "results": results}, f,
+                  indent=2, sort_keys=True)
+        f.write("\n")
+    print("Benchmark results written to %s" % path)
+
+run_tests()
+write_results()
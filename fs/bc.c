@@ -116,6 +116,27 @@ flush_block(void *addr)
 	sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL);
 }
 
+// Give the block cache a page of its own for the block containing
+// VA, if a client shares the page it has (see serve_map), so that the
+// block can change without changing what the client mapped.  The block
+// is flushed first, since the copy starts out clean.
+void
+bc_unshare(void *addr)
+{
+	int r;
+
+	addr = ROUNDDOWN(addr, BLKSIZE);
+	if (!va_is_mapped(addr) || pageref(addr) <= 1)
+		return;
+	flush_block(addr);
+	if ((r = sys_page_alloc(0, UTEMP, PTE_U|PTE_P|PTE_W)) < 0)
+		panic("in bc_unshare, sys_page_alloc: %e", r);
+	memmove(UTEMP, addr, BLKSIZE);
+	if ((r = sys_page_map(0, UTEMP, 0, addr, PTE_U|PTE_P|PTE_W)) < 0)
+		panic("in bc_unshare, sys_page_map: %e", r);
+	sys_page_unmap(0, UTEMP);
+}
+
 // Test that the block cache works, by smashing the superblock and
 // reading it back.
 static void
@@ -71,6 +71,9 @@ alloc_block(void)
 		if (block_is_free(j)) {
 			bitmap[j/32] &= ~(1<<(j%32));
 			flush_block(&bitmap[j/32]);
+			// A client may still map the page of the block's
+			// last contents.
+			bc_unshare(diskaddr(j));
 			lastalloc = j;
 			return j;
 		}
@@ -415,6 +418,7 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+		bc_unshare(blk);
 		memmove(blk + pos % BLKSIZE, buf, bn);
 		pos += bn;
 		buf += bn;
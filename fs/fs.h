@@ -27,6 +27,7 @@ void*  diskaddr(uint64_t blockno);
 bool   va_is_mapped(void *va);
 bool   va_is_dirty(void *va);
 void   flush_block(void *addr);
+void   bc_unshare(void *addr);
 void   bc_init(void);
 
 /* fs.c */
@@ -350,12 +350,51 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Share the block cache page holding byte req->req_offset of
+// req->req_fileid with the caller, read-only, storing it and its
+// permissions in *pg_store and *perm_store.  This saves copying pages
+// that are only read, like a guest kernel image (see user/vmm.c).  The
+// file system writes the block, or reuses it, in a copy of the page
+// (see bc_unshare), so what the caller maps doesn't change under it.
+// Returns how many bytes of the page belong to the file, or < 0 on
+// error; -E_INVAL if the file isn't a regular file.
+int
+serve_map(envid_t envid, struct Fsreq_map *req,
+	  void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	off_t start;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	// Directory blocks hold Files that change in place, so only the
+	// blocks of regular files are shared (see bc_unshare).
+	if (o->o_file->f_type != FTYPE_REG ||
+	    req->req_offset < 0 || req->req_offset >= o->o_file->f_size)
+		return -E_INVAL;
+	start = ROUNDDOWN(req->req_offset, BLKSIZE);
+	if ((r = file_get_block(o->o_file, start / BLKSIZE, &blk)) < 0)
+		return r;
+	// Fault the block in, so that there's a page to send.
+	if (!va_is_mapped(blk))
+		*(volatile char *) blk;
+
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U;
+	return MIN(BLKSIZE, o->o_file->f_size - start);
+}
+
 #line 394 "../fs/serv.c"
 
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-	// Open is handled specially because it passes pages
+	// Open and map are handled specially because they pass pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
 	[FSREQ_READ] =		serve_read,
 	[FSREQ_STAT] =		serve_stat,
@@ -392,6 +431,8 @@ serve(void)
 		pg = NULL;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+		} else if (req == FSREQ_MAP) {
+			r = serve_map(whom, (struct Fsreq_map*)fsreq, &pg, &perm);
 		} else if (req < NHANDLERS && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
@@ -7,12 +7,93 @@
 #include  <inc/vmx.h>
 #include <inc/fs.h>
 #include <inc/lib.h>
+#include <inc/vblk.h>
 
 #define HOST_FS_FILE "/vmm/fs.img"
 
 static struct Fd *host_fd;
 static union Fsipc host_fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Paravirtual block ring (see inc/vblk.h), shared with the backend in
+// our host-side parent.  vblk_state is 0 before we tried to set it up,
+// 1 if it is in use and -1 if the host has none, in which case we fall
+// back on forwarding file requests to the host FS, 1KB at a time.
+static struct VblkRing vblk_ring __attribute__((aligned(PGSIZE)));
+static int vblk_state;
+
+static void
+vblk_init(void)
+{
+	int r;
+
+	// make sure the ring page is present before reporting it
+	vblk_ring.vb_avail = vblk_ring.vb_used = 0;
+	asm volatile("vmcall"
+		     : "=a"(r)
+		     : "0"(VMX_VMCALL_VBLKSETUP),
+		       "b"(PTE_ADDR(uvpt[PGNUM(&vblk_ring)]))
+		     : "memory");
+	vblk_state = r < 0 ? -1 : 1;
+}
+
+// Tell the host about new requests and sleep until it has completed
+// everything up to vb_used == used.
+static void
+vblk_kick(uint32_t used)
+{
+	int r;
+
+	while (vblk_ring.vb_used != used) {
+		asm volatile("vmcall"
+			     : "=a"(r)
+			     : "0"(VMX_VMCALL_VBLKKICK), "b"(used)
+			     : "memory");
+		if (r < 0)
+			panic("vblk kick: %e", r);
+	}
+}
+
+// Transfer nsecs sectors at secno to or from the page-aligned buf,
+// split into as many requests as it takes, with a single kick.
+static int
+vblk_rw(uint8_t op, uint32_t secno, const void *buf, size_t nsecs)
+{
+	struct VblkReq *req;
+	uint32_t first = vblk_ring.vb_avail;
+	uint32_t idx;
+	size_t n, seg;
+	int r = 0;
+
+	assert(PGOFF(buf) == 0);
+	while (nsecs > 0) {
+		// wait for the backend if the ring is full
+		if (vblk_ring.vb_avail - vblk_ring.vb_used == VBLK_RING_SIZE)
+			vblk_kick(vblk_ring.vb_used + 1);
+
+		n = MIN(nsecs, VBLK_SEGS * PGSIZE / VBLK_SECTSIZE);
+		req = &vblk_ring.vb_req[vblk_ring.vb_avail % VBLK_RING_SIZE];
+		req->vr_op = op;
+		req->vr_nsecs = n;
+		req->vr_secno = secno;
+		req->vr_status = 0;
+		for (seg = 0; seg * PGSIZE < n * VBLK_SECTSIZE; seg++)
+			req->vr_seg[seg] = PTE_ADDR(uvpt[PGNUM(buf + seg * PGSIZE)]);
+		vblk_ring.vb_avail++;
+
+		secno += n;
+		buf += n * VBLK_SECTSIZE;
+		nsecs -= n;
+	}
+	vblk_kick(vblk_ring.vb_avail);
+
+	// completions are in order, and our requests are the last ones
+	// posted, so they are all still in the ring
+	for (idx = first; idx != vblk_ring.vb_avail; idx++)
+		if (vblk_ring.vb_req[idx % VBLK_RING_SIZE].vr_status < 0)
+			r = vblk_ring.vb_req[idx % VBLK_RING_SIZE].vr_status;
+	return r;
+}
+
 static int
 host_fsipc(unsigned type, void *dstva)
 {
@@ -32,6 +113,11 @@ host_read(uint32_t secno, void *dst, size_t nsecs)
 {
 	int r, read = 0;
 
+	if (vblk_state == 0)
+		vblk_init();
+	if (vblk_state > 0)
+		return vblk_rw(VBLK_READ, secno, dst, nsecs);
+
 	if(host_fd->fd_file.id == 0) {
 		host_ipc_init();
 	}
@@ -57,6 +143,11 @@ host_write(uint32_t secno, const void *src, size_t nsecs)
 {
 	int r, written = 0;
 
+	if (vblk_state == 0)
+		vblk_init();
+	if (vblk_state > 0)
+		return vblk_rw(VBLK_WRITE, secno, src, nsecs);
+
 	if(host_fd->fd_file.id == 0) {
 		host_ipc_init();
 	}
@@ -296,6 +296,13 @@ QEMU appears to already be running.  Please exit it if possible or use
             self.wait()
             return
 
+    def write(self, buf):
+        """Send buf to QEMU's console input."""
+        if isinstance(buf, str):
+            buf = buf.encode("utf-8")
+        self.proc.stdin.write(buf)
+        self.proc.stdin.flush()
+
     def wait(self):
         if self.proc:
             self.proc.wait()
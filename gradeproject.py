@@ -1,3 +1,4 @@
+import re, time
 from gradelib import *
 
 def addlines():
@@ -43,6 +44,68 @@ def sys_ept_map_test():
     r.match("Cheers! sys_ept_map seems to work correctly")
     dellines()
 
+def converse(*steps):
+    """Return a monitor that, for each (regexp, text) in steps in turn,
+    waits for QEMU to print something matching regexp and then types
+    text at the console.  text may also be a function, given all the
+    output so far, that returns what to type.  Prompts don't end in a
+    newline, so this watches the output as it comes rather than line by
+    line."""
+
+    def setup_converse(runner):
+        buf = bytearray()
+        pending = list(steps)
+        def handle_output(output):
+            buf.extend(output)
+            while pending:
+                m = re.search(pending[0][0].encode(), buf)
+                if not m:
+                    break
+                del buf[:m.end()]
+                text = pending.pop(0)[1]
+                if callable(text):
+                    text = text(runner.qemu.output)
+                runner.qemu.write(text)
+        runner.qemu.on_output.append(handle_output)
+    return setup_converse
+
+def guest_test(name, *steps, **kw):
+    """Boot a guest and run the test program 'name' from its shell,
+    going on with steps as for converse.  Stops once 'name' says OK.
+    Keyword arguments are as for user_test."""
+    r.user_test("vmm", converse((r"vm\$ ", name + "\n"), *steps),
+                stop_on_line(".*%s: OK" % name.split()[0]), **kw)
+
+def after(secs, text):
+    """Return a function for converse that types text secs seconds
+    later, giving the host time to work in the background."""
+    def wait(output):
+        time.sleep(secs)
+        return text
+    return wait
+
+# The host shell's prompt, not the guest's.
+HOST_PROMPT = r"(?<!vm)\$ "
+
+def host_test(stop, *steps):
+    """Boot to the host's shell and go on with steps as for converse,
+    until a line matches stop."""
+    maybe_unlink("obj/kern/init.o", "obj/kern/kernel")
+    r.run_qemu(converse(*steps), stop_on_line(stop),
+               make_args=["QEMUEXTRA+=-snapshot"])
+
+def vm_number(pattern):
+    """Return a function for converse that answers vmmanager's "select
+    a VM" with the number it listed for the guest whose id the last
+    match of pattern gave."""
+    def pick(output):
+        guest = int(re.findall(pattern, output)[-1], 16)
+        for n, id in reversed(re.findall(r"(\d+)\.\[([0-9a-f]+)\]vm", output)):
+            if int(id, 16) == guest:
+                return n + "\n"
+        return "1\n"
+    return pick
+
 def matchtest(parent, name, points, *args, **kw):
     def do_test():
         r.match(*args, **kw)
@@ -59,4 +122,95 @@ matchtest(test_vm, "Print message in VM:", 30, "What is the tortoise")
 
 matchtest(test_vm, "VM correctly started:", 10, "vm\$")
 
+@test(10, "Guest vLAPIC timer and wakeup")
+def test_vlapic():
+    guest_test("testvlapic")
+    r.match("testvlapic: OK", no=[".*panic"])
+
+@test(10, "Guest snapshot copy-on-write")
+def test_clone():
+    # A second vmm can't clone the first one's snapshot, so it loads a
+    # guest of its own; the first guest must not see its writes.
+    host_test(".*testclone: OK after waiting",
+              (HOST_PROMPT, "vmm eager\n"),
+              (r"vm\$ ", "testclone wait\n"),
+              (r"testclone: filled", "\x1b"),
+              (HOST_PROMPT, "vmm eager\n"),
+              (r"vm\$ ", "testclone\n"),
+              (r"testclone: OK", "\x1b"),
+              (HOST_PROMPT, "vmmanager\n"),
+              (r"Please select a VM to resume: ",
+               vm_number(r"Keeping snapshot \w+ of guest (\w+)"
+                         r"(?=[\s\S]*testclone: filled)")),
+              (r"Press Enter to Continue", "\n"))
+    r.match("testclone: OK$", "testclone: OK after waiting",
+            no=[".*panic", "Cloned guest"])
+
+@test(10, "Guest same-page merging")
+def test_ksm():
+    # The host only merges pages on an idle CPU, and its shell never
+    # idles the one it runs on.
+    guest_test("testksm",
+               (r"testksm: filled", "\x1b"),
+               (HOST_PROMPT, after(5, "vmmanager\n")),
+               (r"Please select a VM to resume: ", "1\n"),
+               (r"Press Enter to Continue", "\n"),
+               make_args=["CPUS=2"])
+    r.match(r"1\.\[\w+\]vm1 .*, [1-9]\d* pages shared", "testksm: OK",
+            no=[".*panic"])
+
+@test(10, "Guest memory balloon")
+def test_balloon():
+    guest_test("testballoon")
+    r.match("testballoon: OK", no=[".*panic"])
+
+@test(10, "Guest save and restore")
+def test_save():
+    guest_test("testsave",
+               (r"testsave: filled", "\x1b"),
+               (HOST_PROMPT, "vmmanager save 1 /vmm/testsave.sav\n"),
+               (r"Saved checkpoint 0 of the guest", ""),
+               (HOST_PROMPT, "vmmanager restore /vmm/testsave.sav\n"),
+               (r"Restored a guest from", after(1, "\n")))
+    r.match("Saved checkpoint 0", "Restored a guest", "testsave: OK",
+            no=[".*panic", "Error"])
+
+@test(10, "Guest incremental save of host writes")
+def test_save_incremental():
+    guest_test("testsave inc",
+               (r"testsave: filled", "\x1b"),
+               (HOST_PROMPT, "vmmanager save 1 /vmm/testsave.sav\n"),
+               (r"Saved checkpoint 0 of the guest", ""),
+               (HOST_PROMPT, "vmmanager\n"),
+               (r"Please select a VM to resume: ",
+                vm_number(r"Keeping snapshot \w+ of guest (\w+)")),
+               (r"Press Enter to Continue", "\n"),
+               (r"testsave: read", "\x1b"),
+               (HOST_PROMPT, "vmmanager save -i 1 /vmm/testsave.sav\n"),
+               (r"Saved checkpoint 1 of the guest", ""),
+               (HOST_PROMPT, "vmmanager restore /vmm/testsave.sav\n"),
+               (r"Restored a guest from", after(1, "\n")))
+    r.match("Saved checkpoint 1", "Restored a guest", "testsave: OK",
+            no=[".*panic", "Error"])
+
+@test(10, "Guest kernel file rewritten under a guest")
+def test_kernfile():
+    # The guest's kernel pages come from the file server's cache; the
+    # guest must keep what it loaded, and carry on running.
+    host_test(".*testhcall: OK",
+              (HOST_PROMPT, "vmm\n"),
+              (r"vm\$ ", "\x1b"),
+              (HOST_PROMPT, "testkernfile\n"),
+              (HOST_PROMPT, "vmmanager\n"),
+              (r"Please select a VM to resume: ", "1\n"),
+              (r"Press Enter to Continue", "\n"),
+              (r"vm\$ ", "testhcall\n"))
+    r.match("Saved checkpoint 0", "testkernfile: OK", "testhcall: OK",
+            no=[".*panic", "Error"])
+
+@test(10, "Guest hypercall table and batches")
+def test_hcall():
+    guest_test("testhcall")
+    r.match("testhcall: OK", no=[".*panic"])
+
 run_tests()
@@ -7,6 +7,7 @@
 #include <inc/types.h>
 #include <inc/trap.h>
 #include <inc/memlayout.h>
+#include <inc/syscall.h>
 #line 11 "../inc/env.h"
 #include <inc/vmx.h>
 #line 13 "../inc/env.h"
@@ -43,6 +44,15 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Names of the env_status values, as the monitor and top print them.
+static const char *const env_status_names[] = {
+	[ENV_FREE] = "free",
+	[ENV_DYING] = "dying",
+	[ENV_RUNNABLE] = "runnable",
+	[ENV_RUNNING] = "running",
+	[ENV_NOT_RUNNABLE] = "blocked",
+};
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -56,6 +66,20 @@ enum EnvType {
 #line 59 "../inc/env.h"
 };
 
+// Per-environment resource accounting.  The kernel updates these
+// counters on the run, trap, syscall and VM-exit paths; user space can
+// read them through sys_env_stat().
+struct EnvStat {
+	uint64_t es_cycles;		// TSC cycles spent running the env
+	uint64_t es_last_tsc;		// TSC when the env was last resumed
+	uint64_t es_pgfaults;		// User page faults taken
+	uint64_t es_vmexits;		// VM exits taken (guests only)
+	uint32_t es_ipc_sent;		// IPC messages delivered by the env
+	uint32_t es_ipc_recv;		// IPC messages delivered to the env
+	uint32_t es_resident;		// Resident pages, filled in on demand
+	uint32_t es_syscalls[NSYSCALLS];	// System calls, by number
+};
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;   // Free list link pointers
@@ -64,6 +88,7 @@ struct Env {
 	enum EnvType env_type;		// Indicates special system environments
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
+	struct EnvStat env_stat;	// Resource accounting
 #line 70 "../inc/env.h"
 	int env_cpunum;			// The CPU that the env is running on
 #line 72 "../inc/env.h"
@@ -78,11 +103,17 @@ struct Env {
 	void *env_pgfault_upcall;	// Page fault upcall entry point
 
 	// Lab 4 IPC
-	bool env_ipc_recving;		// Env is blocked receiving
+	uint32_t env_ipc_recving;	// Env is blocked receiving; also a
+					// futex word that ipc_send waits on
 	void *env_ipc_dstva;		// VA at which to map received page
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+
+	// Futexes
+	physaddr_t env_futex_pa;	// Word blocked on in sys_futex_wait, or 0
+	uint32_t env_futex_deadline;	// time_msec() to give up at, or 0
+	struct Env *env_futex_next;	// Next sleeper in the same hash bucket
 #line 90 "../inc/env.h"
 	uint8_t *elf;
 #line 93 "../inc/env.h"
@@ -10,6 +10,10 @@
 #define __EPTE_A	0x100
 #define __EPTE_D	0x200
 #define __EPTE_TYPE(n)	(((n) & 0x7) << 3)
+// Software bit: the page is shared copy-on-write with another guest.
+#define __EPTE_COW	(1ULL << 52)
+// Software bit: the page is a merged one (see vmm/ksm.c).
+#define __EPTE_KSM	(1ULL << 53)
 
 enum {
 	 EPTE_TYPE_UC = 0, /* uncachable */
@@ -22,4 +26,9 @@ enum {
 #define __EPTE_NONE	0
 #define __EPTE_FULL	(__EPTE_READ | __EPTE_WRITE | __EPTE_EXEC)
 
+// For sys_ept_map only: map the page copy-on-write, so that the guest
+// gets its own copy when it first writes it.  The caller's mapping of
+// the page may then be read-only.
+#define EPT_MAP_COW	0x800
+
 #endif
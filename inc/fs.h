@@ -72,8 +72,10 @@ enum {
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
 #line 78 "../inc/fs.h"
-	FSREQ_SYNC
+	FSREQ_SYNC,
 #line 80 "../inc/fs.h"
+	// Map returns a page of the file, read-only
+	FSREQ_MAP
 };
 
 union Fsipc {
@@ -111,6 +113,10 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+	} map;
 #line 129 "../inc/fs.h"
 
 	// Ensure Fsipc is one page
@@ -76,14 +76,27 @@ unsigned int sys_time_msec(void);
 #line 80 "../inc/lib.h"
 int	sys_net_transmit(const char *data, unsigned int len);
 int	sys_net_receive(char *buf, unsigned int len);
+int	sys_env_stat(envid_t envid, struct EnvStat *st);
+int	sys_env_share_pgtables(envid_t envid);
+int	sys_futex_wait(const volatile uint32_t *addr, uint32_t val, uint32_t timeout);
+int	sys_futex_wake(const volatile uint32_t *addr, int n);
 #line 85 "../inc/lib.h"
 int sys_ept_map(envid_t srcenvid, void *srcva, envid_t guest, void* guest_pa, int perm);
-envid_t sys_env_mkguest(uint64_t gphysz, uint64_t gRIP);
+int sys_ept_map_range(void *srcva, envid_t guest, void *guest_pa, size_t len, int perm);
+envid_t sys_env_mkguest(uint64_t gphysz, uint64_t gRIP, int prefault);
+envid_t sys_env_mkvcpu(envid_t guest);
 #ifndef VMM_GUEST
 void	sys_vmx_list_vms();
 int	sys_vmx_sel_resume(int i);
 int	sys_vmx_get_vmdisk_number();
 void	sys_vmx_incr_vmdisk_number();
+int	sys_guest_page_map(envid_t guest, void *guest_pa, void *dstva, int perm);
+int	sys_vmx_exit_stats(envid_t guest, struct VmxStats *st);
+envid_t	sys_vmx_snapshot(envid_t guest);
+envid_t	sys_vmx_clone(envid_t snap);
+int	sys_vmx_mem_scan(envid_t guest, uint8_t *dirty, struct VmxMemScan *st);
+int	sys_vmx_state_get(envid_t guest, struct VmxSavedState *ss);
+int	sys_vmx_state_set(envid_t guest, const struct VmxSavedState *ss);
 #endif
 #line 94 "../inc/lib.h"
 
@@ -113,9 +126,8 @@ int32_t ipc_host_recv(void *pg);
 #line 119 "../inc/lib.h"
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
-envid_t	sfork(void);	// Challenge!
+envid_t	sfork(void);
 #line 125 "../inc/lib.h"
 
 #line 127 "../inc/lib.h"
@@ -135,6 +147,7 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	file_map(int fd, off_t offset, void *dstva);
 #line 144 "../inc/lib.h"
 int	copy(char *src, char *dest);
 #line 146 "../inc/lib.h"
@@ -182,6 +195,11 @@ int	pipeisclosed(int pipefd);
 
 // wait.c
 void	wait(envid_t env);
+
+// bench.c
+void	bench_report(const char *name, uint64_t ops, uint64_t cycles,
+		     uint64_t bytes);
+void	bench_done(void);
 #line 191 "../inc/lib.h"
 
 /* File open modes */
@@ -82,6 +82,18 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// Software bits in PTE_AVAIL with a fixed meaning.  The kernel turns
+// writable private pages into PTE_COW pages when it copies a shared
+// page table, and leaves PTE_SHARE pages writable.
+#define PTE_SHARE	0x400	// Page is shared, not copied, across fork/spawn
+#define PTE_COW		0x800	// Copy-on-write page
+
+// In a page directory entry, PTE_SHPT marks a page table shared
+// copy-on-write between address spaces.  Such entries are read-only;
+// the first write fault through one gives the faulting address space
+// its own copy of the table.  Only the kernel sets this bit.
+#define PTE_SHPT	0x200
+
 // Flags in PTE_SYSCALL may be used only in system calls. (Others may not.)
 #define PTE_SYSCALL (PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -117,6 +129,14 @@
 #define CR4_PAE		0x00000020
 #define EFER_MSR	0xC0000080
 #define EFER_LME	8
+#define STAR_MSR	0xC0000081	// SYSCALL segment selectors
+#define LSTAR_MSR	0xC0000082	// 64-bit SYSCALL target
+#define CSTAR_MSR	0xC0000083	// Compatibility-mode SYSCALL target
+#define SFMASK_MSR	0xC0000084	// SYSCALL rflags mask
+#define FS_BASE_MSR	0xC0000100
+#define GS_BASE_MSR	0xC0000101
+#define KERNEL_GS_BASE_MSR	0xC0000102	// Swapped in by SWAPGS
+#define TSC_AUX_MSR	0xC0000103	// Returned by RDTSCP
 
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
@@ -26,14 +26,27 @@ enum {
 #line 28 "../inc/syscall.h"
 	SYS_net_transmit,
 	SYS_net_receive,
+	SYS_env_stat,
+	SYS_env_share_pgtables,
+	SYS_futex_wait,
+	SYS_futex_wake,
 #line 33 "../inc/syscall.h"
 	SYS_ept_map,
+	SYS_ept_map_range,
 	SYS_env_mkguest,
+	SYS_env_mkvcpu,
 #ifndef VMM_GUEST
 	SYS_vmx_list_vms,
 	SYS_vmx_sel_resume,
 	SYS_vmx_get_vmdisk_number,
 	SYS_vmx_incr_vmdisk_number,
+	SYS_guest_page_map,
+	SYS_vmx_exit_stats,
+	SYS_vmx_snapshot,
+	SYS_vmx_clone,
+	SYS_vmx_mem_scan,
+	SYS_vmx_state_get,
+	SYS_vmx_state_set,
 #endif
 #line 42 "../inc/syscall.h"
 	NSYSCALLS
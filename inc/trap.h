@@ -37,6 +37,7 @@
 #define IRQ_KBD          1
 #define IRQ_SERIAL       4
 #define IRQ_SPURIOUS     7
+#define IRQ_KICK        13	// IPI: leave the guest, flush the TLB
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
 
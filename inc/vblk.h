@@ -0,0 +1,46 @@
+#ifndef JOS_INC_VBLK_H
+#define JOS_INC_VBLK_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// Paravirtual block device.
+//
+// A guest's file server keeps its disk requests in a ring on one page of
+// its own memory.  It announces the page once with VMX_VMCALL_VBLKSETUP;
+// the host kernel passes the guest-physical address on to the guest's
+// parent (user/vmm), which maps the page and serves the requests
+// against the guest's disk image.  The guest posts any number of
+// requests, bumps vb_avail and makes one VMX_VMCALL_VBLKKICK, which
+// wakes the backend and sleeps until vb_used reaches the count in rbx.
+// The backend completes everything it finds before waking the guest.
+// Both sides sleep on the ring words as futexes.
+
+#define VBLK_SECTSIZE	512		// Bytes per sector
+#define VBLK_RING_SIZE	32		// Requests in the ring; a power of 2
+#define VBLK_SEGS	8		// Pages per request
+// Sectors in a guest's disk, the 2MB image fs/Makefrag makes.
+#define VDISK_MAXSECTS	4096
+
+enum {
+	VBLK_READ = 1,
+	VBLK_WRITE,
+};
+
+struct VblkReq {
+	uint8_t vr_op;			// VBLK_READ or VBLK_WRITE
+	uint16_t vr_nsecs;		// Sectors to transfer
+	uint32_t vr_secno;		// First sector
+	int32_t vr_status;		// 0 or -E_*, set by the backend
+	// Guest-physical address of each page of the buffer; page i
+	// holds bytes [i*PGSIZE, (i+1)*PGSIZE) of the transfer.
+	uint64_t vr_seg[VBLK_SEGS];
+};
+
+struct VblkRing {
+	volatile uint32_t vb_avail;	// Requests posted by the guest
+	volatile uint32_t vb_used;	// Requests completed by the host
+	struct VblkReq vb_req[VBLK_RING_SIZE];	// Indexed mod VBLK_RING_SIZE
+};
+
+#endif /* !JOS_INC_VBLK_H */
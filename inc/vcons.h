@@ -0,0 +1,31 @@
+#ifndef JOS_INC_VCONS_H
+#define JOS_INC_VCONS_H
+
+#include <inc/types.h>
+
+// Paravirtual console.
+//
+// A guest kernel keeps its console in a pair of rings on one page of its
+// own memory, announced once with VMX_VMCALL_VCONSSETUP (rbx holds the
+// guest-physical address).  Output is appended to vc_out and flushed
+// with one VMX_VMCALL_VCONSKICK per line, or when the ring fills or the
+// guest waits for input; the host kernel copies it to its own console.
+// Input goes the other way: the host kernel reads the keyboard and
+// serial port itself, appends to vc_in and raises the device's
+// interrupt in the guest, which then reads the ring without exiting.
+// Each index counts bytes ever added or removed, so it is taken mod
+// the ring's size.
+
+#define VCONS_OUT_SIZE	2048		// Powers of 2
+#define VCONS_IN_SIZE	1024
+
+struct VconsRing {
+	volatile uint32_t vc_out_prod;	// Output written by the guest
+	volatile uint32_t vc_out_cons;	// Output copied by the host
+	volatile uint32_t vc_in_prod;	// Input written by the host
+	volatile uint32_t vc_in_cons;	// Input read by the guest
+	volatile char vc_out[VCONS_OUT_SIZE];
+	volatile char vc_in[VCONS_IN_SIZE];
+};
+
+#endif /* !JOS_INC_VCONS_H */
@@ -0,0 +1,54 @@
+#ifndef JOS_INC_VMSAVE_H
+#define JOS_INC_VMSAVE_H
+
+#include <inc/types.h>
+#include <inc/env.h>
+#include <inc/vmx.h>
+#include <inc/fs.h>
+
+// Saved guests.
+//
+// "vmmanager save" writes a paused guest to a file as a sequence of
+// checkpoints, each a VmSaveHdr followed by vh_npages page records and
+// vh_nsects disk records.  A page record is a guest-physical address
+// and the page there, or just the address with VMSAVE_PAGE_ZERO set if
+// the page has become all zeros.  A disk record is the number of a
+// sector the guest has written to its disk and the sector.
+//
+// The first checkpoint holds every non-zero page of the guest.  Each
+// later one, appended by "vmmanager save -i", holds only the pages the
+// guest has written since the checkpoint before, going by the EPT dirty
+// bits, but the whole of its disk again.  "vmm restore" applies them
+// in order to a new guest.
+//
+// Only a guest's parent may read it, so it is the guest's vmm that
+// writes the file.  "vmmanager save" leaves a VmSaveReq in
+// /vmm/save<vdisk>.req, where vdisk is the guest's disk number; the
+// vmm looks for one about every second while its guest is paused, and
+// writes the request back with sr_result filled in once it is done.
+
+#define VMSAVE_MAGIC		0x56534d4a	// "JMSV"
+#define VMSAVE_PAGE_ZERO	0x1
+
+struct VmSaveHdr {
+	uint32_t vh_magic;
+	uint32_t vh_seq;		// Checkpoints before this one
+	// The guest saved, and when its memory was scanned for this
+	// checkpoint: the next can only be incremental if nothing has
+	// scanned it, and so cleared its dirty bits, since.
+	envid_t vh_guest;
+	uint64_t vh_scan_tsc;
+	uint32_t vh_npages;
+	uint32_t vh_nsects;
+	struct VmxSavedState vh_state;
+};
+
+#define VMSAVE_PENDING		1		// sr_result until done
+
+struct VmSaveReq {
+	int32_t sr_result;		// 0 or <0 once the vmm is done
+	int32_t sr_incremental;		// Append a checkpoint to sr_path
+	char sr_path[MAXPATHLEN];
+};
+
+#endif /* !JOS_INC_VMSAVE_H */
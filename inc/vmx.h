@@ -4,9 +4,91 @@
 
 #define GUEST_MEM_SZ 16 * 1024 * 1024
 #define MAX_MSR_COUNT ( PGSIZE / 2 ) / ( 128 / 8 )
+#define VMCS_CACHE_SIZE 16
+
+// Guest memory prefault policies, chosen at sys_env_mkguest time.
+#define VMX_PREFAULT_NONE	0	// back pages on EPT violations only
+#define VMX_PREFAULT_EAGER	1	// back all guest RAM before first launch
+#define VMX_PREFAULT_BACKGROUND	2	// back it from idle CPUs once launched
+
+// VM-exit statistics, read with sys_vmx_exit_stats.  An exit's time is
+// counted in TSC cycles from the exit until its handler is done.  If
+// the handler leaves the guest blocked (HLT, IPC receive, block ring
+// kicks), the wait until it next runs is counted apart.
+#define VMX_EXIT_NREASONS	64	// basic exit reasons tracked
+#define VMX_VMCALL_NCODES	32	// vmcall codes tracked
+#define VMX_HIST_BUCKETS	16	// see struct VmxExitStat
+#define VMX_HIST_MIN_SHIFT	9
+
+// Adaptive halt-polling window, in TSC cycles.  A guest that executes
+// HLT with interrupts enabled first polls for a pending interrupt for up
+// to halt_poll cycles, then blocks until its CPU's next timer tick.  The
+// window grows while wakeups arrive soon after the halt and shrinks
+// back to zero when the guest stays idle longer than VMX_HALT_POLL_MAX.
+#define VMX_HALT_POLL_START	(1 << 14)
+#define VMX_HALT_POLL_MAX	(1 << 19)
+
+// A guest's vCPUs beyond the first start out like APs after power-up,
+// waiting for an INIT and then a STARTUP IPI from another vCPU.
+#define VMX_VCPU_STARTED	0
+#define VMX_VCPU_WAIT_INIT	1
+#define VMX_VCPU_WAIT_SIPI	2
 
 #ifndef __ASSEMBLER__
 
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/trap.h>
+
+struct VmxExitStat {
+	uint64_t xs_count;		// Exits taken
+	uint64_t xs_cycles;		// Total cycles spent handling them
+	uint64_t xs_blocked;		// Cycles the guest then spent blocked
+	// Exits by time: bucket 0 counts those under 2^VMX_HIST_MIN_SHIFT
+	// cycles, each following bucket twice as much, the last the rest.
+	uint32_t xs_hist[VMX_HIST_BUCKETS];
+};
+
+struct VmxStats {
+	struct VmxExitStat vs_exit[VMX_EXIT_NREASONS];	// By basic exit reason
+	struct VmxExitStat vs_vmcall[VMX_VMCALL_NCODES];	// VMCALLs by code (rax)
+};
+
+// Guest memory use, from the EPT accessed and dirty bits, read with
+// sys_vmx_mem_scan: pages backed by host memory and, of those, how many
+// were accessed and written since the previous scan, ms_cycles (TSC)
+// ago.  ms_wss estimates the working set, a decaying average of the
+// pages accessed per scan.
+struct VmxMemScan {
+	uint32_t ms_resident;
+	uint32_t ms_accessed;
+	uint32_t ms_dirty;
+	uint32_t ms_wss;
+	uint64_t ms_cycles;
+};
+
+// Registers of the emulated legacy devices (see vmm/vdev.c): the
+// selected CMOS register, and each PIC's interrupt mask and which
+// initialization word it expects next (0 if none).
+struct VmxVdevState {
+	uint8_t cmos_index;
+	uint8_t pic_imr[2];
+	uint8_t pic_icw[2];
+};
+
+// Software TLB of guest-physical pages to host addresses, for the
+// hypercalls (see ept_gpa2hva_cached).  gt_tag is the page's address,
+// or'ed with VMX_GTLB_VALID and, if the page is known writable,
+// VMX_GTLB_WRITE.
+#define VMX_GTLB_SIZE	8
+#define VMX_GTLB_VALID	0x1
+#define VMX_GTLB_WRITE	0x2
+
+struct VmxGtlbEntry {
+	uint64_t gt_tag;
+	void *gt_hva;
+};
+
 struct VmxGuestInfo {
 	int64_t phys_sz;
 	uintptr_t *vmcs;
@@ -20,7 +102,130 @@ struct VmxGuestInfo {
 	int msr_count;
 	uintptr_t *msr_host_area;
 	uintptr_t *msr_guest_area;
+	// MSR bitmap: a set bit makes that RDMSR/WRMSR exit.
+	uint64_t *msr_bmap;
+	// Host CPU this vCPU runs on; a VMCS can't move between CPUs.
 	int vcpunum;
+	// Which of its guest's vCPUs this is (also its APIC ID), and
+	// whether it has been started (VMX_VCPU_*).  A guest's vCPUs are
+	// separate Envs sharing one EPT, so the same env_cr3.
+	int vcpu_id;
+	int vcpu_state;
+	// Tag for the guest's TLB entries, or 0 if VPIDs aren't in use.
+	uint16_t vpid;
+	// Set when present EPT entries change; the guest's cached
+	// guest-physical translations are flushed before it next runs.
+	bool ept_stale;
+	// Flushed along with them.
+	struct VmxGtlbEntry gtlb[VMX_GTLB_SIZE];
+	// Guest-physical address of the paravirtual block ring, or 0; kept
+	// by the guest's first vCPU.
+	uint64_t vblk_ring;
+	// Guest-physical address of the paravirtual console ring (see
+	// inc/vcons.h), or 0; kept by the first vCPU.
+	uint64_t vcons_ring;
+	// Prefault policy, and the next guest-physical address to prefault.
+	int prefault;
+	uint64_t prefault_next;
+	// Cached VMCS fields (see vmcs_cache_read), with bitmaps of which
+	// are valid and which must be written back before the next entry.
+	// The guest's live RIP and RSP are here, not in env_tf, which only
+	// supplies their values for the first launch.
+	uint64_t vmcs_cache[VMCS_CACHE_SIZE];
+	uint32_t vmcs_cache_valid;
+	uint32_t vmcs_cache_dirty;
+	// Set while the guest is blocked in HLT (see vmx_halt_wakeup), with
+	// when it halted and its current halt-polling window.
+	bool halted;
+	uint64_t halt_tsc;
+	uint64_t halt_poll;
+	// Emulated local APIC (see vmm/vlapic.c): its register page, when
+	// its timer next fires (0 if stopped), and pending ExtINT vectors.
+	// With vlapic_apicv the processor delivers its interrupts.
+	uint32_t *vlapic;
+	uint64_t vlapic_deadline;
+	uint32_t vlapic_extint[8];
+	bool vlapic_apicv;
+	// Exit statistics, and the exit being handled (exit_tsc 0 if none)
+	// or that left the guest blocked (blocked_tsc 0 if none).
+	struct VmxStats *stats;
+	uint64_t exit_tsc;
+	uint64_t blocked_tsc;
+	int exit_reason;
+	int exit_vmcall;
+	// When the guest was last entered, and what is left of its
+	// timeslice (see vmx_slice_arm).
+	uint64_t entry_tsc;
+	uint64_t slice_left;
+	// Guest state saved out of the VMCS (see vmx_state_save), and
+	// whether it is current: it is loaded into a fresh VMCS when a
+	// clone first runs.  A snapshot is a guest that is never run, only
+	// cloned (see vmx_guest_clone).
+	uint64_t *state;
+	bool state_saved;
+	bool snapshot;
+	// Same-page merging (see vmm/ksm.c), kept by the first vCPU: pages
+	// of the guest now mapped to merged pages, and how many of its
+	// pages have been merged in all.
+	uint32_t ksm_shared;
+	uint32_t ksm_merged;
+	// Memory ballooning, kept by the first vCPU: pages the guest has
+	// given back, and how many the host would like it to have given.
+	uint32_t balloon;
+	uint32_t balloon_target;
+	// When the guest's memory was last scanned (see sys_vmx_mem_scan),
+	// and its working set estimate, kept by the first vCPU.
+	uint64_t mem_scan_tsc;
+	uint32_t mem_wss;
+	// Number of the guest's disk image, /vmm/fs<vdisk>.img (see
+	// user/vmm.c), kept by the first vCPU.
+	int vdisk;
+	// Emulated legacy devices, kept by the first vCPU.
+	struct VmxVdevState vdev;
+};
+
+// Guest state fields in struct VmxSavedState, at most.
+#define VMX_STATE_MAX	64
+
+// The state of a paused guest with one vCPU, read with
+// sys_vmx_state_get and given to a new guest with sys_vmx_state_set:
+// everything but its memory and disk.  ss_state holds ss_nstate VMCS
+// guest state fields, in an order private to the kernel.  The I/O and
+// MSR bitmaps aren't included; the kernel sets them up the same way
+// for every guest.
+struct VmxSavedState {
+	struct Trapframe ss_tf;
+	int64_t ss_phys_sz;
+	int ss_prefault;
+	uint64_t ss_vblk_ring;
+	uint64_t ss_vcons_ring;
+	uint32_t ss_nstate;
+	uint64_t ss_state[VMX_STATE_MAX];
+	// MSR load/store area, emulated local APIC registers, cycles left
+	// until its timer fires (0 if stopped) and pending ExtINTs.
+	uint8_t ss_msr_area[PGSIZE / 2];
+	uint32_t ss_vlapic[PGSIZE / 4];
+	uint64_t ss_vlapic_timer;
+	uint32_t ss_vlapic_extint[8];
+	struct VmxVdevState ss_vdev;
+};
+
+// Hypercalls made with one VMX_VMCALL_BATCH, from the page at rbx: each
+// request gives a code and the rbx, rcx, rdx and rsi it takes, and gets
+// back the rax it returns.  Only hypercalls that return at once, and
+// don't give guest memory back (VMX_VMCALL_BALLOON_INFLATE), can be
+// batched.
+#define VMX_BATCH_MAX 64
+
+struct VmxBatchReq {
+	uint64_t br_code;
+	uint64_t br_args[4];
+	int64_t br_ret;
+};
+
+struct VmxBatch {
+	uint32_t hb_count;
+	struct VmxBatchReq hb_req[VMX_BATCH_MAX];
 };
 
 #endif
@@ -37,6 +242,22 @@ struct VmxGuestInfo {
 #define VMX_VMCALL_ALLOC_CPU 0x7
 #define VMX_VMCALL_GUEST_YIELD 0x8
 #define VMX_VMCALL_CPUNUM 0x9
+#define VMX_VMCALL_VBLKSETUP 0xa
+#define VMX_VMCALL_VBLKKICK 0xb
+#define VMX_VMCALL_BALLOON_TARGET 0xc
+#define VMX_VMCALL_BALLOON_INFLATE 0xd
+#define VMX_VMCALL_BALLOON_DEFLATE 0xe
+#define VMX_VMCALL_VCONSSETUP 0xf
+#define VMX_VMCALL_VCONSKICK 0x10
+#define VMX_VMCALL_VERSION 0x11
+#define VMX_VMCALL_BATCH 0x12
+
+// Hypercall ABI version, returned by VMX_VMCALL_VERSION: the major
+// version changes when existing hypercalls change, the minor one when
+// hypercalls are added.
+#define VMX_VMCALL_ABI_MAJOR 1
+#define VMX_VMCALL_ABI_MINOR 0
+#define VMX_VMCALL_ABI ((VMX_VMCALL_ABI_MAJOR << 16) | VMX_VMCALL_ABI_MINOR)
 
 #define VMX_HOST_FS_ENV 0x1
 
@@ -0,0 +1,97 @@
+// Memory balloon driver, for guests.
+//
+// Every second the host is asked how many pages it would like back
+// (VMX_VMCALL_BALLOON_TARGET).  The balloon grows by taking free pages
+// from the page allocator and handing them to the host, a page-full of
+// addresses per vmcall, and shrinks by returning pages to the
+// allocator.  The host backs those again when they are next touched.
+
+#include <inc/types.h>
+#include <inc/vmx.h>
+#include <inc/mmu.h>
+#include <inc/memlayout.h>
+#include <kern/pmap.h>
+#include <kern/balloon.h>
+
+// Timer ticks between polls of the host.
+#define BALLOON_POLL_TICKS	100
+// Free pages the balloon always leaves the guest.
+#define BALLOON_MIN_FREE	256
+#define BALLOON_BATCH		(PGSIZE / sizeof(uint64_t))
+
+// Pages given to the host, linked through pp_link.
+static struct PageInfo *balloon_pages;
+static uint32_t balloon_size;
+// Guest-physical addresses of the pages being given, for the host.
+static uint64_t balloon_list[BALLOON_BATCH] __attribute__((aligned(PGSIZE)));
+
+static int64_t
+balloon_vmcall(int num, uint64_t rbx, uint64_t rcx)
+{
+	int64_t r;
+
+	asm volatile("vmcall" : "=a" (r) : "a" (num), "b" (rbx), "c" (rcx)
+		     : "cc", "memory");
+	return r;
+}
+
+// Give up to n free pages to the host.
+static void
+balloon_inflate(uint32_t n)
+{
+	struct PageInfo *pp;
+	size_t nfree = page_free_count();
+	int64_t i, done;
+
+	if (nfree <= BALLOON_MIN_FREE)
+		return;
+	n = MIN(MIN(n, BALLOON_BATCH), nfree - BALLOON_MIN_FREE);
+	for (i = 0; i < n && (pp = page_alloc(0)); i++)
+		balloon_list[i] = page2pa(pp);
+	done = balloon_vmcall(VMX_VMCALL_BALLOON_INFLATE, PADDR(balloon_list), i);
+	if (done < 0)
+		done = 0;
+	// The host took the first done pages; the rest are still ours.
+	while (i-- > done)
+		page_free(pa2page(balloon_list[i]));
+	for (i = 0; i < done; i++) {
+		pp = pa2page(balloon_list[i]);
+		pp->pp_ref = 1;
+		pp->pp_link = balloon_pages;
+		balloon_pages = pp;
+		balloon_size++;
+	}
+}
+
+// Take back up to n pages from the host.
+static void
+balloon_deflate(uint32_t n)
+{
+	struct PageInfo *pp;
+	uint32_t i;
+
+	for (i = 0; i < n && (pp = balloon_pages); i++) {
+		balloon_pages = pp->pp_link;
+		pp->pp_link = NULL;
+		pp->pp_ref = 0;
+		page_free(pp);
+		balloon_size--;
+	}
+	balloon_vmcall(VMX_VMCALL_BALLOON_DEFLATE, i, 0);
+}
+
+// Called on the boot CPU's timer ticks.
+void
+balloon_tick(void)
+{
+	static unsigned ticks;
+	uint32_t target;
+
+	if (++ticks % BALLOON_POLL_TICKS)
+		return;
+	target = balloon_vmcall(VMX_VMCALL_BALLOON_TARGET, 0, 0);
+	if (target > balloon_size)
+		balloon_inflate(target - balloon_size);
+	else if (target < balloon_size)
+		balloon_deflate(balloon_size - target);
+}
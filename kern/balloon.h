@@ -0,0 +1,9 @@
+#ifndef JOS_KERN_BALLOON_H
+#define JOS_KERN_BALLOON_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+void balloon_tick(void);
+
+#endif // !JOS_KERN_BALLOON_H
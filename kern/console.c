@@ -12,6 +12,10 @@
 #line 14 "../kern/console.c"
 #include <inc/vmx.h>
 #include <vmm/vmx.h>
+#ifdef VMM_GUEST
+#include <inc/vcons.h>
+#include <kern/pmap.h>
+#endif
 #line 17 "../kern/console.c"
 
 static void cons_intr(int (*proc)(void));
@@ -27,6 +31,64 @@ delay(void)
 	inb(0x84);
 }
 
+#ifdef VMM_GUEST
+/***** Paravirtual console (see inc/vcons.h) *****/
+
+// Once the host has the ring, the console goes through it instead of
+// the devices.  Output is flushed a line at a time.
+static struct VconsRing vcons __attribute__((aligned(PGSIZE)));
+static bool vcons_ready;
+
+static void
+vcons_init(void)
+{
+	int r;
+
+	asm volatile("vmcall" : "=a"(r)
+		     : "0"(VMX_VMCALL_VCONSSETUP), "b"(PADDR(&vcons))
+		     : "memory");
+	vcons_ready = (r == 0);
+}
+
+// Have the host copy out everything written so far.
+static void
+vcons_flush(void)
+{
+	int r;
+
+	if (vcons.vc_out_cons != vcons.vc_out_prod)
+		asm volatile("vmcall" : "=a"(r) : "0"(VMX_VMCALL_VCONSKICK)
+			     : "memory");
+}
+
+static void
+vcons_putc(int c)
+{
+	if (vcons.vc_out_prod - vcons.vc_out_cons == VCONS_OUT_SIZE)
+		vcons_flush();
+	vcons.vc_out[vcons.vc_out_prod % VCONS_OUT_SIZE] = c;
+	vcons.vc_out_prod++;
+	if (c == '\n')
+		vcons_flush();
+}
+
+static int
+vcons_proc_data(void)
+{
+	int c, r;
+
+	if (vcons.vc_in_cons == vcons.vc_in_prod)
+		return -1;
+	c = vcons.vc_in[vcons.vc_in_cons % VCONS_IN_SIZE];
+	vcons.vc_in_cons++;
+	if (c == 0x1b) {
+		cprintf("ESC pressed\n");
+		asm("vmcall":"=a"(r): "0"(VMX_VMCALL_BACKTOHOST));
+	}
+	return c;
+}
+#endif
+
 /***** Serial I/O code *****/
 
 #define COM1		0x3F8
@@ -64,6 +126,12 @@ serial_proc_data(void)
 void
 serial_intr(void)
 {
+#ifdef VMM_GUEST
+	if (vcons_ready) {
+		cons_intr(vcons_proc_data);
+		return;
+	}
+#endif
 	if (serial_exists)
 		cons_intr(serial_proc_data);
 }
@@ -389,6 +457,12 @@ kbd_proc_data(void)
 void
 kbd_intr(void)
 {
+#ifdef VMM_GUEST
+	if (vcons_ready) {
+		cons_intr(vcons_proc_data);
+		return;
+	}
+#endif
 	cons_intr(kbd_proc_data);
 }
 
@@ -442,6 +516,11 @@ cons_getc(void)
 	// poll for any pending input characters,
 	// so that this function works even when interrupts are disabled
 	// (e.g., when called from the kernel monitor).
+#ifdef VMM_GUEST
+	// Someone waiting for input should see what was written before.
+	if (vcons_ready)
+		vcons_flush();
+#endif
 	serial_intr();
 	kbd_intr();
 
@@ -459,6 +538,12 @@ cons_getc(void)
 static void
 cons_putc(int c)
 {
+#ifdef VMM_GUEST
+	if (vcons_ready) {
+		vcons_putc(c);
+		return;
+	}
+#endif
 	serial_putc(c);
 	lpt_putc(c);
 	cga_putc(c);
@@ -471,6 +556,9 @@ cons_init(void)
 	cga_init();
 	kbd_init();
 	serial_init();
+#ifdef VMM_GUEST
+	vcons_init();
+#endif
 
 	if (!serial_exists)
 		cprintf("Serial port does not exist!\n");
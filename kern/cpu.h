@@ -30,6 +30,7 @@ struct CpuInfo {
 #line 34 "../kern/cpu.h"
     bool is_vmx_root;               // Is the CPU in VMX root mode?
     uintptr_t vmxon_region;         // KVA of vmxon region.
+    volatile bool cpu_in_guest;     // Is the CPU in VMX non-root mode?
 #line 37 "../kern/cpu.h"
 };
 
@@ -49,6 +50,8 @@ void mp_init(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
+bool lapic_intr_pending(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
 
 #endif
@@ -16,11 +16,12 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/futex.h>
 #include <vmm/vmx.h>
 #include <vmm/ept.h>
+#include <vmm/vlapic.h>
 
 extern bool bootstrapped;
-int vcpu_count = 0;
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
@@ -225,8 +226,11 @@ env_setup_vm(struct Env *e)
 }
 
 #ifndef VMM_GUEST
+// Allocate a guest environment: a new guest if guest is NULL, else
+// another vCPU of guest, which shares its memory.
 int
-env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
+env_guest_alloc(struct Env **newenv_store, envid_t parent_id,
+		struct Env *guest)
 {
 	int32_t generation;
 	struct Env *e;
@@ -239,10 +243,13 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
 	// allocate a page for the EPT PML4..
 	struct PageInfo *p = NULL;
 
-	if (!(p = page_alloc(ALLOC_ZERO)))
-		return -E_NO_MEM;
-
-	memset(p, 0, sizeof(struct PageInfo));
+	if (guest)
+		p = pa2page(guest->env_cr3);
+	else {
+		if (!(p = page_alloc(ALLOC_ZERO)))
+			return -E_NO_MEM;
+		memset(p, 0, sizeof(struct PageInfo));
+	}
 	p->pp_ref       += 1;
 	e->env_pml4e    = page2kva(p);
 	e->env_cr3      = page2pa(p);
@@ -289,6 +296,53 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
 	t->pp_ref += 1;
 	e->env_vmxinfo.io_bmap_b = page2kva(t);
 
+	// Allocate a page for the MSR bitmap.
+	struct PageInfo *m = NULL;
+	if (!(m = page_alloc(ALLOC_ZERO))) {
+		page_decref(p);
+		page_decref(q);
+		page_decref(r);
+		page_decref(s);
+		page_decref(t);
+		return -E_NO_MEM;
+	}
+	m->pp_ref += 1;
+	e->env_vmxinfo.msr_bmap = page2kva(m);
+
+	// Allocate a page for the emulated local APIC's registers.
+	struct PageInfo *a = NULL;
+	if (!(a = page_alloc(ALLOC_ZERO))) {
+		page_decref(p);
+		page_decref(q);
+		page_decref(r);
+		page_decref(s);
+		page_decref(t);
+		page_decref(m);
+		return -E_NO_MEM;
+	}
+	a->pp_ref += 1;
+	e->env_vmxinfo.vlapic = page2kva(a);
+
+	// Allocate pages for the exit statistics.  Runs come in powers of
+	// two; the fourth page goes straight back.
+	struct PageInfo *u = NULL;
+	static_assert(sizeof(struct VmxStats) <= 3 * PGSIZE);
+	if (!(u = page_alloc_npages(4, ALLOC_ZERO))) {
+		page_decref(p);
+		page_decref(q);
+		page_decref(r);
+		page_decref(s);
+		page_decref(t);
+		page_decref(m);
+		page_decref(a);
+		return -E_NO_MEM;
+	}
+	u[0].pp_ref += 1;
+	u[1].pp_ref += 1;
+	u[2].pp_ref += 1;
+	page_free(&u[3]);
+	e->env_vmxinfo.stats = page2kva(u);
+
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
 	if (generation <= 0)	// Don't create a negative env_id.
@@ -300,13 +354,26 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_type = ENV_TYPE_GUEST;
 	e->env_status = ENV_RUNNABLE;
 
-	e->env_vmxinfo.vcpunum = vcpu_count++;
+	if (guest) {
+		e->env_status = ENV_NOT_RUNNABLE;
+		e->env_vmxinfo.phys_sz = guest->env_vmxinfo.phys_sz;
+		e->env_vmxinfo.vcpu_id = vmx_vcpu_count(guest);
+		e->env_vmxinfo.vcpu_state = VMX_VCPU_WAIT_INIT;
+	}
+	e->env_vmxinfo.vcpunum = vmx_vcpu_place(e);
+	e->env_vmxinfo.vpid = vmx_vpid_alloc();
+	vlapic_init(&e->env_vmxinfo, e->env_vmxinfo.vcpu_id);
     	cprintf("VCPUNUM allocated: %d\n", e->env_vmxinfo.vcpunum);
 
 	memset(&e->env_tf, 0, sizeof(e->env_tf));
 
+	// Start accounting from scratch.
+	e->env_runs = 0;
+	memset(&e->env_stat, 0, sizeof(e->env_stat));
+
 	e->env_pgfault_upcall = 0;
 	e->env_ipc_recving = 0;
+	e->env_futex_pa = 0;
 
 	// commit the allocation
 	env_free_list = e->env_link;
@@ -323,10 +390,23 @@ void env_guest_free(struct Env *e) {
 	// Free IO bitmaps page.
 	page_decref(pa2page(PADDR(e->env_vmxinfo.io_bmap_a)));
 	page_decref(pa2page(PADDR(e->env_vmxinfo.io_bmap_b)));
+	// Free the MSR bitmap.
+	page_decref(pa2page(PADDR(e->env_vmxinfo.msr_bmap)));
+	// Free the emulated local APIC.
+	page_decref(pa2page(PADDR(e->env_vmxinfo.vlapic)));
+	vmx_vpid_free(e->env_vmxinfo.vpid);
+	// Free the exit statistics.
+	page_decref(pa2page(PADDR(e->env_vmxinfo.stats)));
+	page_decref(pa2page(PADDR(e->env_vmxinfo.stats)) + 1);
+	page_decref(pa2page(PADDR(e->env_vmxinfo.stats)) + 2);
+	// Free the saved guest state.
+	if (e->env_vmxinfo.state)
+		page_decref(pa2page(PADDR(e->env_vmxinfo.state)));
 
 	// Free the host pages that were allocated for the guest and
-	// the EPT tables itself.
-	free_guest_mem(e->env_pml4e);
+	// the EPT tables itself, once its last vCPU is gone.
+	if (pa2page(e->env_cr3)->pp_ref == 1)
+		free_guest_mem(e->env_pml4e);
 
 	// Free the EPT PML4 page.
 	page_decref(pa2page(e->env_cr3));
@@ -397,14 +477,19 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_tf.tf_cs = GD_UT | 3;
 	// You will set e->env_tf.tf_rip later.
 
+	// Start accounting from scratch.
+	e->env_runs = 0;
+	memset(&e->env_stat, 0, sizeof(e->env_stat));
+
 	// Enable interrupts while in user mode.
 	e->env_tf.tf_eflags = FL_IF; // interrupts enabled
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
 
-	// Also clear the IPC receiving flag.
+	// Also clear the IPC receiving flag and any futex wait.
 	e->env_ipc_recving = 0;
+	e->env_futex_pa = 0;
 
 	// commit the allocation
 	env_free_list = e->env_link;
@@ -542,6 +627,9 @@ env_free(struct Env *e)
 	uint64_t pdeno, pteno;
 	physaddr_t pa;
 
+	// Take it off any futex wait queue.
+	futex_cancel(e);
+
 #ifndef VMM_GUEST
 	if(e->env_type == ENV_TYPE_GUEST) {
 		env_guest_free(e);
@@ -579,6 +667,14 @@ env_free(struct Env *e)
 			pa = PTE_ADDR(env_pgdir[pdeno]);
 			pt = (pte_t*) KADDR(pa);
 
+			// a page table still shared after fork belongs to
+			// the other sharers too; just drop our reference
+			if ((env_pgdir[pdeno] & PTE_SHPT) && pa2page(pa)->pp_ref > 1) {
+				env_pgdir[pdeno] = 0;
+				page_decref(pa2page(pa));
+				continue;
+			}
+
 			// unmap all PTEs in this page table
 			for (pteno = 0; pteno < PTX(~0); pteno++) {
 				if (pt[pteno] & PTE_P){
@@ -610,6 +706,43 @@ env_free(struct Env *e)
 	env_free_list = e;
 }
 
+//
+// Return the number of pages mapped in e's address space below UTOP
+// (or, for a guest, the number of guest physical pages backed by memory).
+//
+int
+env_resident_pages(struct Env *e)
+{
+	pdpe_t *env_pdpe;
+	pde_t *env_pgdir;
+	pte_t *pt;
+	uint64_t pdpe_index, pdeno, pteno;
+	int pdeno_limit, n = 0;
+
+#ifndef VMM_GUEST
+	if (e->env_type == ENV_TYPE_GUEST)
+		return ept_resident_pages(e->env_pml4e);
+#endif
+	if (!e->env_pml4e || !(e->env_pml4e[0] & PTE_P))
+		return 0;
+	env_pdpe = KADDR(PTE_ADDR(e->env_pml4e[0]));
+	for (pdpe_index = 0; pdpe_index <= 3; pdpe_index++) {
+		if (!(env_pdpe[pdpe_index] & PTE_P))
+			continue;
+		env_pgdir = KADDR(PTE_ADDR(env_pdpe[pdpe_index]));
+		pdeno_limit = pdpe_index == 3 ? PDX(UTOP) : PDX(0xFFFFFFFF);
+		for (pdeno = 0; pdeno < pdeno_limit; pdeno++) {
+			if (!(env_pgdir[pdeno] & PTE_P))
+				continue;
+			pt = KADDR(PTE_ADDR(env_pgdir[pdeno]));
+			for (pteno = 0; pteno < NPTENTRIES; pteno++)
+				if (pt[pteno] & PTE_P)
+					n++;
+		}
+	}
+	return n;
+}
+
 //
 // Frees environment e.
 // If e was the current env, then runs a new environment (and does not return
@@ -618,6 +751,12 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e)
 {
+#ifndef VMM_GUEST
+	// A guest goes down with all of its vCPUs.
+	if (e->env_type == ENV_TYPE_GUEST)
+		vmx_vcpus_destroy(e);
+#endif
+
 	// If e is currently running on other CPUs, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
 	// it traps to the kernel.
@@ -689,6 +828,8 @@ env_run(struct Env *e)
 
 	assert(e->env_status == ENV_RUNNING);
 
+	// Charge e from here until it next traps back into the kernel.
+	e->env_stat.es_last_tsc = read_tsc();
 
 #ifndef VMM_GUEST
 	if(e->env_type == ENV_TYPE_GUEST) {
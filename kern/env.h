@@ -5,6 +5,7 @@
 #define JOS_KERN_ENV_H
 
 #include <inc/env.h>
+#include <inc/x86.h>
 #line 9 "../kern/env.h"
 #include <kern/cpu.h>
 #line 11 "../kern/env.h"
@@ -27,8 +28,18 @@ int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
 
+int	env_resident_pages(struct Env *e);
+
+// Charge the cycles since e was last resumed to e's accounting.
+static inline void
+env_charge(struct Env *e)
+{
+	e->env_stat.es_cycles += read_tsc() - e->env_stat.es_last_tsc;
+}
+
 #line 33 "../kern/env.h"
-int env_guest_alloc(struct Env **newenv_store, envid_t parent_id);
+int env_guest_alloc(struct Env **newenv_store, envid_t parent_id,
+		    struct Env *guest);
 #line 35 "../kern/env.h"
 
 // Without this extra macro, we couldn't pass macros like TEST to
@@ -0,0 +1,127 @@
+// Futex wait queues.
+//
+// Environments blocked in sys_futex_wait hang off a small hash table
+// keyed by the physical address of the word they wait on.  Waking a
+// word only looks at its own bucket, and envs that share the page at
+// different virtual addresses still find each other.  Everything here
+// runs under the big kernel lock.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+
+#include <kern/env.h>
+#include <kern/futex.h>
+#include <kern/time.h>
+
+#define FUTEX_HASH	64
+
+static struct Env *futex_hash[FUTEX_HASH];
+static uint32_t futex_ntimed;		// Sleepers with a deadline
+
+static struct Env **
+futex_bucket(physaddr_t pa)
+{
+	return &futex_hash[((pa >> 2) ^ (pa >> 12)) % FUTEX_HASH];
+}
+
+// Remove e from its bucket.  It must be asleep on a futex.
+static void
+futex_unlink(struct Env *e)
+{
+	struct Env **pp;
+
+	for (pp = futex_bucket(e->env_futex_pa); *pp != e; pp = &(*pp)->env_futex_next)
+		assert(*pp);
+	*pp = e->env_futex_next;
+	if (e->env_futex_deadline)
+		futex_ntimed--;
+	e->env_futex_next = NULL;
+	e->env_futex_pa = 0;
+	e->env_futex_deadline = 0;
+}
+
+// Wake e, which is asleep on a futex, with return value r.
+static void
+futex_wakeup(struct Env *e, int r)
+{
+	futex_unlink(e);
+	e->env_tf.tf_regs.reg_rax = r;
+	e->env_status = ENV_RUNNABLE;
+}
+
+//
+// Block e on the word at physical address pa.  If timeout is nonzero,
+// e wakes up with -E_TIMEOUT once about that many milliseconds have
+// passed without a futex_wake.  The caller has already checked the
+// word and will reschedule.
+//
+void
+futex_sleep(struct Env *e, physaddr_t pa, uint32_t timeout)
+{
+	struct Env **b = futex_bucket(pa);
+
+	e->env_futex_pa = pa;
+	e->env_futex_deadline = 0;
+	if (timeout) {
+		// deadline 0 means "none", so nudge a wrapped one.
+		e->env_futex_deadline = (time_msec() + timeout) ?: 1;
+		futex_ntimed++;
+	}
+	e->env_futex_next = *b;
+	*b = e;
+
+	e->env_tf.tf_regs.reg_rax = 0;
+	e->env_status = ENV_NOT_RUNNABLE;
+}
+
+//
+// Wake up to n environments asleep on the word at pa.
+// Returns the number woken.
+//
+int
+futex_wake(physaddr_t pa, int n)
+{
+	struct Env *e, *next;
+	int woken = 0;
+
+	for (e = *futex_bucket(pa); e && woken < n; e = next) {
+		next = e->env_futex_next;
+		if (e->env_futex_pa == pa) {
+			futex_wakeup(e, 0);
+			woken++;
+		}
+	}
+	return woken;
+}
+
+// Forget about e's futex wait, if any, because e is going away or
+// someone else has set its status.
+void
+futex_cancel(struct Env *e)
+{
+	if (e->env_futex_pa)
+		futex_unlink(e);
+}
+
+//
+// Called on every clock tick: wake the sleepers whose deadline has
+// passed.
+//
+void
+futex_tick(void)
+{
+	struct Env *e, *next;
+	uint32_t now;
+	int i;
+
+	if (!futex_ntimed)
+		return;
+	now = time_msec();
+	for (i = 0; i < FUTEX_HASH; i++)
+		for (e = futex_hash[i]; e; e = next) {
+			next = e->env_futex_next;
+			if (e->env_futex_deadline
+			    && (int32_t) (now - e->env_futex_deadline) >= 0)
+				futex_wakeup(e, -E_TIMEOUT);
+		}
+}
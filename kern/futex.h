@@ -0,0 +1,14 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+void futex_sleep(struct Env *e, physaddr_t pa, uint32_t timeout);
+int futex_wake(physaddr_t pa, int n);
+void futex_cancel(struct Env *e);
+void futex_tick(void);
+
+#endif /* JOS_KERN_FUTEX_H */
@@ -85,6 +85,17 @@ i386_init(void)
 		else
 			cprintf("VMX extension hidden from guest.\n");
 	}
+	/* The host must speak our hypercall ABI */
+	{
+		int64_t abi;
+		uint64_t codes;
+
+		asm volatile("vmcall" : "=a" (abi), "=b" (codes)
+			     : "0" (VMX_VMCALL_VERSION) : "cc", "memory");
+		if (abi < 0 || (abi >> 16) != VMX_VMCALL_ABI_MAJOR)
+			panic("host hypercall ABI %llx, need version %d.x",
+			      abi, VMX_VMCALL_ABI_MAJOR);
+	}
 #endif
 
 #ifndef VMM_GUEST
@@ -104,11 +115,9 @@ i386_init(void)
 #line 130 "../kern/init.c"
 
 #line 132 "../kern/init.c"
-#ifndef VMM_GUEST
 	// Lab 4 multiprocessor initialization functions
 	mp_init();
 	lapic_init();
-#endif
 #line 142 "../kern/init.c"
 
 	// Lab 4 multitasking initialization functions
@@ -128,10 +137,8 @@ i386_init(void)
 #line 160 "../kern/init.c"
 
 #line 162 "../kern/init.c"
-#ifndef VMM_GUEST
 	// Starting non-boot CPUs
 	boot_aps();
-#endif
 #line 170 "../kern/init.c"
 
 #line 172 "../kern/init.c"
@@ -141,6 +148,11 @@ i386_init(void)
 
 	// Start fs.
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
+
+#if defined(TEST_NS)
+	// Start the network server for tests that need it.
+	ENV_CREATE(net_ns, ENV_TYPE_NS);
+#endif
 #line 187 "../kern/init.c"
 
 #if defined(TEST)
@@ -16,6 +16,7 @@
 #define VER     (0x0030/4)   // Version
 #define TPR     (0x0080/4)   // Task Priority
 #define EOI     (0x00B0/4)   // EOI
+#define IRR     (0x0200/4)   // Interrupt Request (8 registers, 16 bytes apart)
 #define SVR     (0x00F0/4)   // Spurious Interrupt Vector
 #define ENABLE     0x00000100   // Unit Enable
 #define ESR     (0x0280/4)   // Error Status
@@ -46,6 +47,30 @@
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+#ifdef VMM_GUEST
+// A guest's local APIC is emulated by the VMM, which we reach through
+// the x2APIC MSRs: register index i is MSR 0x800 + i / 4.
+#define X2APIC_MSR(index)	(0x800 + (index) / 4)
+
+static void
+lapicw(int index, int value)
+{
+	write_msr(X2APIC_MSR(index), (uint32_t) value);
+}
+
+void
+lapic_init(void)
+{
+	// Same setup as on the host, less the parts for real hardware.
+	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
+	lapicw(TDCR, X1);
+	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 10000000);
+	lapicw(ERROR, IRQ_OFFSET + IRQ_ERROR);
+	lapicw(ESR, 0);
+	lapicw(TPR, 0);
+}
+#else
 static void
 lapicw(int index, int value)
 {
@@ -111,10 +136,16 @@ lapic_init(void)
 	// Enable interrupts on the APIC (but not on the processor).
 	lapicw(TPR, 0);
 }
+#endif
 
 int
 cpunum(void)
 {
+#ifdef VMM_GUEST
+	// Only ask the VMM once there is more than one vCPU to tell apart.
+	if (ncpu > 1)
+		return read_msr(X2APIC_MSR(ID));
+#endif
 	if (lapic)
 		return lapic[ID] >> 24;
 	return 0;
@@ -124,10 +155,60 @@ cpunum(void)
 void
 lapic_eoi(void)
 {
+#ifdef VMM_GUEST
+	lapicw(EOI, 0);
+#else
 	if (lapic)
 		lapicw(EOI, 0);
+#endif
+}
+
+// Is an interrupt waiting to be delivered to this CPU?  Lets code
+// running with interrupts disabled poll for one.
+bool
+lapic_intr_pending(void)
+{
+	int i;
+
+	if (!lapic)
+		return false;
+	for (i = 0; i < 8; i++)
+		if (lapic[IRR + 4 * i])
+			return true;
+	return false;
+}
+
+#ifdef VMM_GUEST
+// The emulated APIC is in x2APIC mode, which has one 64-bit ICR with
+// the destination in its high half, and no delivery status to wait on.
+static void
+lapic_icr(uint32_t apicid, uint32_t icr)
+{
+	write_msr(X2APIC_MSR(ICRLO), (uint64_t) apicid << 32 | icr);
+}
+
+// Start vCPU apicid running entry code at addr.  The VMM starts it
+// straight from the STARTUP IPI, so there is no warm reset vector to
+// set up and nothing to wait for.
+void
+lapic_startap(uint8_t apicid, uint32_t addr)
+{
+	lapic_icr(apicid, INIT | LEVEL | ASSERT);
+	lapic_icr(apicid, STARTUP | (addr >> 12));
 }
 
+void
+lapic_ipi(int vector)
+{
+	lapic_icr(0, OTHERS | FIXED | vector);
+}
+
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	lapic_icr(apicid, FIXED | vector);
+}
+#else
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 static void
@@ -181,3 +262,14 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send the CPU with APIC ID apicid an interrupt with this vector.
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+#endif
@@ -14,6 +14,7 @@
 #include <kern/dwarf_api.h>
 #line 16 "../kern/monitor.c"
 #include <kern/trap.h>
+#include <kern/env.h>
 #line 18 "../kern/monitor.c"
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
@@ -34,6 +35,8 @@ static struct Command commands[] = {
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
 #line 36 "../kern/monitor.c"
 	{ "backtrace", "Display a stack backtrace", mon_backtrace },
+	{ "top", "Display resource usage of all environments", mon_top },
+	{ "envstat", "Display resource usage of one environment", mon_envstat },
 #line 39 "../kern/monitor.c"
 #ifdef VMM_GUEST
 	{ "exit", "Exit VMM guest", mon_exit },
@@ -170,6 +173,71 @@ unknown_cfa:
 	return 0;
 }
 
+static uint64_t
+env_total_syscalls(struct Env *e)
+{
+	uint64_t n = 0;
+	int i;
+
+	for (i = 0; i < NSYSCALLS; i++)
+		n += e->env_stat.es_syscalls[i];
+	return n;
+}
+
+int
+mon_top(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Env *e;
+	int i;
+
+	cprintf("envid    type status       runs  Mcycles syscalls pgfaults  ipc-out   ipc-in  vmexits    pages\n");
+	for (i = 0; i < NENV; i++) {
+		e = &envs[i];
+		if (e->env_status == ENV_FREE)
+			continue;
+		cprintf("%08x %4d %-8s %8u %8llu %8llu %8llu %8u %8u %8llu %8d\n",
+			e->env_id, e->env_type, env_status_names[e->env_status],
+			e->env_runs, e->env_stat.es_cycles / 1000000,
+			env_total_syscalls(e), e->env_stat.es_pgfaults,
+			e->env_stat.es_ipc_sent, e->env_stat.es_ipc_recv,
+			e->env_stat.es_vmexits, env_resident_pages(e));
+	}
+	return 0;
+}
+
+int
+mon_envstat(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Env *e;
+	int i;
+
+	if (argc != 2) {
+		cprintf("Usage: envstat <envid>\n");
+		return 0;
+	}
+	if (envid2env(strtol(argv[1], NULL, 16), &e, 0) < 0
+	    || e->env_status == ENV_FREE) {
+		cprintf("envstat: no such environment %s\n", argv[1]);
+		return 0;
+	}
+
+	cprintf("env %08x (parent %08x) type %d status %s cpu %d\n",
+		e->env_id, e->env_parent_id, e->env_type,
+		env_status_names[e->env_status], e->env_cpunum);
+	cprintf("  runs        %u\n", e->env_runs);
+	cprintf("  cycles      %llu\n", e->env_stat.es_cycles);
+	cprintf("  page faults %llu\n", e->env_stat.es_pgfaults);
+	cprintf("  ipc sent    %u\n", e->env_stat.es_ipc_sent);
+	cprintf("  ipc recv    %u\n", e->env_stat.es_ipc_recv);
+	cprintf("  vm exits    %llu\n", e->env_stat.es_vmexits);
+	cprintf("  resident    %d pages\n", env_resident_pages(e));
+	cprintf("  syscalls    %llu\n", env_total_syscalls(e));
+	for (i = 0; i < NSYSCALLS; i++)
+		if (e->env_stat.es_syscalls[i])
+			cprintf("    #%2d       %u\n", i, e->env_stat.es_syscalls[i]);
+	return 0;
+}
+
 #line 177 "../kern/monitor.c"
 int
 mon_exit(int argc, char** argv, struct Trapframe* tf)
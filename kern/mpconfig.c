@@ -10,6 +10,7 @@
 #include <inc/env.h>
 #include <kern/cpu.h>
 #include <kern/pmap.h>
+#include <inc/vmx.h>
 
 struct CpuInfo cpus[NCPU];
 struct CpuInfo *bootcpu;
@@ -72,6 +73,25 @@ struct mpproc {         // processor table entry [MP 4.3.1]
 #define MPIOINTR  0x03  // One per bus interrupt source
 #define MPLINTR   0x04  // One per system interrupt source
 
+#ifdef VMM_GUEST
+// A guest has no MP configuration table.  The VMM says how many vCPUs
+// we have; vCPU i has APIC ID i, and vCPU 0 boots.
+void
+mp_init(void)
+{
+	int64_t n;
+	int i;
+
+	asm volatile("vmcall" : "=a" (n) : "a" (VMX_VMCALL_CPUNUM) : "cc", "memory");
+	ncpu = n < 1 ? 1 : n > NCPU ? NCPU : n;
+	for (i = 0; i < ncpu; i++)
+		cpus[i].cpu_id = i;
+	ismp = ncpu > 1;
+	bootcpu = &cpus[0];
+	bootcpu->cpu_status = CPU_STARTED;
+	cprintf("SMP: guest has %d vCPU(s)\n", ncpu);
+}
+#else
 static uint8_t
 sum(void *addr, int len)
 {
@@ -241,3 +261,4 @@ mp_init(void)
 		outb(0x23, inb(0x23) | 1);  // Mask external interrupts.
 	}
 }
+#endif
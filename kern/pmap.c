@@ -494,6 +494,57 @@ page_alloc(int alloc_flags)
 #line 552 "../kern/pmap.c"
 }
 
+//
+// Allocates n physically contiguous pages, aligned to n pages (n must be
+// a power of two), e.g. to back a 2MB large page mapping.  Like
+// page_alloc, the pages come back with pp_ref 0 and a null pp_link, and
+// are reference counted and freed one by one.
+//
+// Returns the first page of the run, or NULL if no aligned run is free.
+// Checking a candidate run costs a walk of the free list, so this gives
+// up after PAGE_ALLOC_NPAGES_TRIES candidates that turn out not to be
+// free after all.
+//
+#define PAGE_ALLOC_NPAGES_TRIES	4
+
+struct PageInfo *
+page_alloc_npages(size_t n, int alloc_flags)
+{
+	struct PageInfo **pp, *first;
+	size_t i, j, nfree;
+	int tries = 0;
+
+	assert(n > 0 && (n & (n - 1)) == 0);
+	for (i = 0; i + n <= npages && tries < PAGE_ALLOC_NPAGES_TRIES; i += n) {
+		// pp_ref is zero for every free page, which makes it a
+		// cheap filter; the free list itself is the authority.
+		for (j = 0; j < n && pages[i + j].pp_ref == 0; j++)
+			;
+		if (j < n)
+			continue;
+		first = &pages[i];
+		nfree = 0;
+		for (pp = &page_free_list; *pp; pp = &(*pp)->pp_link)
+			if (*pp >= first && *pp < first + n)
+				nfree++;
+		if (nfree < n) {
+			tries++;
+			continue;
+		}
+		for (pp = &page_free_list; *pp; )
+			if (*pp >= first && *pp < first + n) {
+				struct PageInfo *p = *pp;
+				*pp = p->pp_link;
+				p->pp_link = NULL;
+			} else
+				pp = &(*pp)->pp_link;
+		if (alloc_flags & ALLOC_ZERO)
+			memset(page2kva(first), 0, n * PGSIZE);
+		return first;
+	}
+	return NULL;
+}
+
 //
 // Initialize a Page structure.
 // The result has null links and 0 refcount.
@@ -532,6 +583,21 @@ page_decref(struct PageInfo* pp)
 	if (--pp->pp_ref == 0)
 		page_free(pp);
 }
+
+//
+// Count the free pages, for memory ballooning.  This walks the free
+// list, so it isn't for hot paths.
+//
+size_t
+page_free_count(void)
+{
+	struct PageInfo *pp;
+	size_t n = 0;
+
+	for (pp = page_free_list; pp; pp = pp->pp_link)
+		n++;
+	return n;
+}
 // Given a pml4 pointer, pml4e_walk returns a pointer
 // to the page table entry (PTE) for linear address 'va'
 // This requires walking the 4-level page table structure
@@ -711,6 +777,8 @@ page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm)
 	pdpe_t *pdpe;
 	pde_t *pde;
 	if (pml4e && pp) {
+		if (pgtable_unshare(pml4e, va) < 0)
+			return -E_NO_MEM;
 		pte_t *pte  = pml4e_walk(pml4e, va, 1);
 		if (pte != NULL) {
 			pml4e [PML4(va)] = pml4e [PML4(va)]|(perm&(~PTE_AVAIL));
@@ -778,17 +846,27 @@ page_lookup(pml4e_t *pml4e, void *va, pte_t **pte_store)
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
 //
-void
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if the page table mapping 'va' is shared and couldn't be
+//     copied; nothing is unmapped then
+//
+int
 page_remove(pml4e_t *pml4e, void *va)
 {
 #line 861 "../kern/pmap.c"
 	pte_t *pte;
-	struct PageInfo *page   = page_lookup(pml4e, va, &pte);
+	struct PageInfo *page;
+
+	if (pgtable_unshare(pml4e, va) < 0)
+		return -E_NO_MEM;
+	page = page_lookup(pml4e, va, &pte);
 	if (page != NULL) {
 		tlb_invalidate(pml4e, va);
 		page_decref(page);
 		*pte    = 0;
 	}
+	return 0;
 #line 871 "../kern/pmap.c"
 }
 
@@ -807,6 +885,141 @@ tlb_invalidate(pml4e_t *pml4e, void *va)
 #line 889 "../kern/pmap.c"
 }
 
+//
+// Return a pointer to the page directory entry for 'va', allocating
+// missing page directory pointer and page directory pages if 'create'.
+// Unlike pml4e_walk, this never allocates the page table itself.
+// Returns NULL if an intermediate level is missing or can't be allocated.
+//
+static pde_t *
+pde_walk(pml4e_t *pml4e, const void *va, int create)
+{
+	pdpe_t *pdpe;
+	pde_t *pgdir;
+	struct PageInfo *page;
+
+	if (!(pml4e[PML4(va)] & PTE_P)) {
+		if (!create || !(page = page_alloc(ALLOC_ZERO)))
+			return NULL;
+		page->pp_ref += 1;
+		pml4e[PML4(va)] = page2pa(page)|PTE_U|PTE_W|PTE_P;
+	}
+	pdpe = KADDR(PTE_ADDR(pml4e[PML4(va)]));
+	if (!(pdpe[PDPE(va)] & PTE_P)) {
+		if (!create || !(page = page_alloc(ALLOC_ZERO)))
+			return NULL;
+		page->pp_ref += 1;
+		pdpe[PDPE(va)] = page2pa(page)|PTE_U|PTE_W|PTE_P;
+	}
+	pgdir = KADDR(PTE_ADDR(pdpe[PDPE(va)]));
+	return &pgdir[PDX(va)];
+}
+
+//
+// Share the page table that maps 'va' in 'src' with 'dst', which must
+// not have a page table there yet.  Both page directory entries become
+// read-only and are marked PTE_SHPT; pgtable_unshare copies the table on
+// the first write fault through either of them.
+//
+// Returns 0 on success (including when src has no page table at va),
+// -E_INVAL if dst already has one, or -E_NO_MEM.
+//
+int
+pgtable_share(pml4e_t *src, pml4e_t *dst, const void *va)
+{
+	pde_t *spde, *dpde;
+
+	if (!(spde = pde_walk(src, va, 0)) || !(*spde & PTE_P))
+		return 0;
+	if (!(dpde = pde_walk(dst, va, 1)))
+		return -E_NO_MEM;
+	if (*dpde & PTE_P)
+		return -E_INVAL;
+
+	*spde = (*spde & ~PTE_W) | PTE_SHPT;
+	*dpde = *spde;
+	pa2page(PTE_ADDR(*spde))->pp_ref += 1;
+	return 0;
+}
+
+//
+// Flush the TLB of every CPU whose current environment uses 'pml4e', or
+// maps 'va' through the page table at physical address 'pt'.  Other
+// CPUs are kicked, and flush theirs when they take the kick (see
+// trap_dispatch); until then the big kernel lock keeps them out of the
+// kernel.
+//
+static void
+pgtable_shootdown(pml4e_t *pml4e, physaddr_t pt, const void *va)
+{
+	struct Env *e;
+	pde_t *pde;
+	int i;
+
+	for (i = 0; i < ncpu; i++) {
+		if (!(e = cpus[i].cpu_env) || e->env_type == ENV_TYPE_GUEST)
+			continue;
+		if (e->env_pml4e != pml4e &&
+		    (!(pde = pde_walk(e->env_pml4e, va, 0)) ||
+		     !(*pde & PTE_P) || PTE_ADDR(*pde) != pt))
+			continue;
+		if (&cpus[i] == thiscpu)
+			tlbflush();
+		else
+			lapic_ipi_cpu(cpus[i].cpu_id, IRQ_OFFSET + IRQ_KICK);
+	}
+	if (!curenv)
+		tlbflush();
+}
+
+//
+// If the page table mapping 'va' in 'pml4e' is shared (PTE_SHPT), give
+// this address space a private, writable copy.  Writable pages mapped
+// by the table, other than PTE_SHARE pages, become PTE_COW in every
+// copy, so the user-level fault handler then copies them as usual.
+//
+// Returns 1 if a shared table was found, 0 if not, or -E_NO_MEM.
+//
+int
+pgtable_unshare(pml4e_t *pml4e, const void *va)
+{
+	pde_t *pde;
+	pte_t *opt, *npt;
+	struct PageInfo *opp, *npp;
+	int i;
+
+	if (!(pde = pde_walk(pml4e, va, 0)) || !(*pde & PTE_SHPT))
+		return 0;
+
+	opp = pa2page(PTE_ADDR(*pde));
+	opt = page2kva(opp);
+
+	// The first sharer to get here downgrades the table in place,
+	// which every other sharer still sees through its own entry.
+	for (i = 0; i < NPTENTRIES; i++)
+		if ((opt[i] & (PTE_P|PTE_W|PTE_SHARE)) == (PTE_P|PTE_W))
+			opt[i] = (opt[i] & ~PTE_W) | PTE_COW;
+
+	if (opp->pp_ref > 1) {
+		if (!(npp = page_alloc(0)))
+			return -E_NO_MEM;
+		npt = page2kva(npp);
+		memmove(npt, opt, PGSIZE);
+		for (i = 0; i < NPTENTRIES; i++)
+			if (npt[i] & PTE_P)
+				pa2page(PTE_ADDR(npt[i]))->pp_ref += 1;
+		npp->pp_ref += 1;
+		opp->pp_ref -= 1;
+		*pde = page2pa(npp) | (*pde & 0xFFF);
+	}
+	*pde = (*pde & ~PTE_SHPT) | PTE_W;
+
+	// The whole 2MB region changed, in this address space and in every
+	// one still sharing the old table.
+	pgtable_shootdown(pml4e, page2pa(opp), va);
+	return 1;
+}
+
 #line 892 "../kern/pmap.c"
 //
 // Reserve size bytes in the MMIO region and map [pa,pa+size) at this
@@ -884,6 +1097,12 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 		return -E_FAULT;
 	}
 	while(va<endva){
+		// The kernel is about to write here: a shared page table
+		// must be copied first, since its entry is read-only.
+		if ((perm & PTE_W) && pgtable_unshare(env->env_pml4e, va) < 0) {
+			user_mem_check_addr = (uintptr_t) va;
+			return -E_FAULT;
+		}
 		ptep = pml4e_walk(env->env_pml4e,va,0);
 		if (!ptep || (*ptep & (perm | PTE_P)) != (perm | PTE_P)) {
 			user_mem_check_addr = (uintptr_t) va;
@@ -55,14 +55,19 @@ void    x64_vm_init();
 
 void	page_init(void);
 struct PageInfo * page_alloc(int alloc_flags);
+struct PageInfo * page_alloc_npages(size_t n, int alloc_flags);
 void	page_free(struct PageInfo *pp);
 int	page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm);
-void	page_remove(pml4e_t *pml4e, void *va);
+int	page_remove(pml4e_t *pml4e, void *va);
 struct PageInfo *page_lookup(pml4e_t *pml4e, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+size_t	page_free_count(void);
 
 void	tlb_invalidate(pml4e_t *pml4e, void *va);
 
+int	pgtable_share(pml4e_t *src, pml4e_t *dst, const void *va);
+int	pgtable_unshare(pml4e_t *pml4e, const void *va);
+
 #line 67 "../kern/pmap.h"
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
@@ -12,6 +12,7 @@ void sched_halt(void);
 #line 13 "../kern/sched.c"
 #ifndef VMM_GUEST
 #include <vmm/vmx.h>
+#include <vmm/ksm.h>
 static int
 vmxon() {
 	int r;
@@ -35,6 +36,12 @@ sched_yield(void)
 	struct Env *idle;
 	int i, j, k, r;
 
+#ifndef VMM_GUEST
+	// Co-schedule: first run a vCPU whose guest is running elsewhere.
+	if ((idle = vmx_gang_pick()) != NULL && vmxon() == 0)
+		env_run(idle);
+#endif
+
 	// Determine the starting point for the search.
 	if (curenv)
 		i = curenv-envs;
@@ -85,6 +92,12 @@ sched_yield(void)
 		env_run(curenv);
 	}
 
+#ifndef VMM_GUEST
+	// Nothing to run here: use the time to prefault guest memory
+	// and to merge equal guest pages.
+	vmx_prefault_idle();
+	ksm_scan_idle();
+#endif
 	// sched_halt never returns
 	sched_halt();
 }
@@ -107,6 +120,11 @@ sched_halt(void)
 		     envs[i].env_status == ENV_DYING))
 			break;
 	}
+#ifndef VMM_GUEST
+	// Guests blocked in HLT wake on this CPU's timer ticks.
+	if (i == NENV && vmx_halted_guests())
+		i = 0;
+#endif
 	if (i == NENV) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
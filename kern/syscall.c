@@ -16,6 +16,7 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/futex.h>
 #include <kern/e1000.h>
 #ifndef VMM_GUEST
 #include <vmm/ept.h>
@@ -112,6 +113,9 @@ sys_env_set_status(envid_t envid, int status)
         return r;
     if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE)
         return -E_INVAL;
+    // Whoever sets the status now decides when e runs, so a futex
+    // wait it was blocked in ends; it returns 0 like a spurious wakeup.
+    futex_cancel(e);
     e->env_status = status;
     return 0;
 }
@@ -141,6 +145,39 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
     return 0;
 }
 
+// Share all of the caller's page tables below UXSTACKTOP with the child
+// 'envid', copy-on-write (see pgtable_share).  The table holding the
+// normal and exception stacks is left out; fork copies its pages itself.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if envid is the caller, is a guest, or already has
+//		page tables in the shared range.
+//	-E_NO_MEM if there's no memory for the child's page directories.
+static int
+sys_env_share_pgtables(envid_t envid)
+{
+    int r;
+    struct Env *e;
+    uintptr_t va;
+
+    if ((r = envid2env(envid, &e, 1)) < 0)
+        return r;
+    if (e == curenv || e->env_type == ENV_TYPE_GUEST)
+        return -E_INVAL;
+
+    for (va = 0; va < UXSTACKTOP; va += PTSIZE) {
+        if (va == ROUNDDOWN(UXSTACKTOP - PGSIZE, PTSIZE))
+            continue;
+        if ((r = pgtable_share(curenv->env_pml4e, e->env_pml4e, (void *) va)) < 0)
+            return r;
+    }
+    // Our own entries just lost PTE_W.
+    tlbflush();
+    return 0;
+}
+
 // Set the page fault upcall for 'envid' by modifying the corresponding struct
 // Env's 'env_pgfault_upcall' field.  When 'envid' causes a page fault, the
 // kernel will push a fault record onto the exception stack, then branch to
@@ -234,6 +271,10 @@ sys_page_map(envid_t srcenvid, void *srcva,
         return r;
     if ((~perm & (PTE_U|PTE_P)) || (perm & ~PTE_SYSCALL))
         return -E_INVAL;
+    // A writable-looking page behind a shared page table is really
+    // copy-on-write; unsharing the table makes that visible.
+    if ((perm & PTE_W) && pgtable_unshare(es->env_pml4e, srcva) < 0)
+        return -E_NO_MEM;
     if ((pp = page_lookup(es->env_pml4e, srcva, &ppte)) == 0)
         return -E_INVAL;
     if ((perm & PTE_W) && !(*ppte & PTE_W))
@@ -250,6 +291,8 @@ sys_page_map(envid_t srcenvid, void *srcva,
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_NO_MEM if the page table mapping va is shared with another
+//		environment and there's no memory to copy it.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -260,8 +303,7 @@ sys_page_unmap(envid_t envid, void *va)
         return r;
     if (va >= (void*) UTOP || PGOFF(va))
         return -E_INVAL;
-    page_remove(e->env_pml4e, va);
-    return 0;
+    return page_remove(e->env_pml4e, va);
 }
 
 // Try to send 'value' to the target env 'envid'.
@@ -357,6 +399,8 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
             return -E_INVAL;
         }
 
+        if ((perm & PTE_W) && pgtable_unshare(curenv->env_pml4e, srcva) < 0)
+            return -E_NO_MEM;
         pp = page_lookup(curenv->env_pml4e, srcva, &ppte);
         if (pp == 0) {
             cprintf("[%08x] page_lookup %08x failed in sys_ipc_try_send\n", curenv->env_id, srcva);
@@ -382,6 +426,8 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
             return -E_INVAL;
         }
 
+        if ((perm & PTE_W) && pgtable_unshare(curenv->env_pml4e, srcva) < 0)
+            return -E_NO_MEM;
         pp = page_lookup(curenv->env_pml4e, srcva, &ppte);
         if (pp == 0) {
             cprintf("Here 3\n");
@@ -409,6 +455,8 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
     e->env_ipc_value = value;
     e->env_tf.tf_regs.reg_rax = 0;
     e->env_status = ENV_RUNNABLE;
+    curenv->env_stat.es_ipc_sent++;
+    e->env_stat.es_ipc_recv++;
 
     if(e->env_type == ENV_TYPE_GUEST)
     {
@@ -437,10 +485,71 @@ sys_ipc_recv(void *dstva)
     curenv->env_ipc_recving = 1;
     curenv->env_ipc_dstva = dstva;
     curenv->env_status = ENV_NOT_RUNNABLE;
+    // Senders that found us busy sleep on env_ipc_recving.
+    futex_wake(PADDR((void *) &curenv->env_ipc_recving), NENV);
     sched_yield();
     return 0;
 }
 
+// Translate the user address of a futex word to its physical address,
+// which is what waiters are matched on, so that envs sharing the page
+// at different addresses still meet.  Read-only words, such as fields
+// of envs[] at UENVS, are fine too.
+static int
+futex_pa(const uint32_t *addr, physaddr_t *pa)
+{
+    struct PageInfo *pp;
+    pte_t *ppte;
+
+    if ((uintptr_t) addr >= ULIM || ((uintptr_t) addr & 3))
+        return -E_INVAL;
+    if ((pp = page_lookup(curenv->env_pml4e, (void *) addr, &ppte)) == 0
+            || !(*ppte & PTE_U))
+        return -E_FAULT;
+    *pa = page2pa(pp) + PGOFF(addr);
+    return 0;
+}
+
+// Block until another environment wakes the word at 'addr', provided it
+// still holds 'val'.  Nobody can wake the word between the check and
+// the sleep, so a waker that changes the word first cannot be missed.
+// If 'timeout' is nonzero, give up after about that many milliseconds.
+//
+// Returns 0 when woken, < 0 on error.  Errors are:
+//	-E_INVAL if addr is above ULIM or not 4-byte aligned.
+//	-E_FAULT if addr is not mapped.
+//	-E_AGAIN if *addr != val.
+//	-E_TIMEOUT if the timeout expired first.
+static int
+sys_futex_wait(const uint32_t *addr, uint32_t val, uint32_t timeout)
+{
+    physaddr_t pa;
+    int r;
+
+    if ((r = futex_pa(addr, &pa)) < 0)
+        return r;
+    if (*(volatile uint32_t *) KADDR(pa) != val)
+        return -E_AGAIN;
+
+    futex_sleep(curenv, pa, timeout);
+    sched_yield();
+}
+
+// Wake up to 'n' environments blocked in sys_futex_wait on the word at
+// 'addr'.
+//
+// Returns the number woken, or < 0 on error as for sys_futex_wait.
+static int
+sys_futex_wake(const uint32_t *addr, int n)
+{
+    physaddr_t pa;
+    int r;
+
+    if ((r = futex_pa(addr, &pa)) < 0)
+        return r;
+    return futex_wake(pa, n);
+}
+
 
 // Return the current time.
 static int
@@ -456,6 +565,28 @@ sys_net_transmit(const void *data, size_t len)
     return e1000_transmit(data, len);
 }
 
+// Copy the resource accounting of environment 'envid' into 'st',
+// including a freshly computed resident page count.
+// Any environment's statistics may be read, as with envs[].
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+// Destroys the caller if 'st' is not writable.
+static int
+sys_env_stat(envid_t envid, struct EnvStat *st)
+{
+    int r;
+    struct Env *e;
+
+    if ((r = envid2env(envid, &e, 0)) < 0)
+        return r;
+    user_mem_assert(curenv, st, sizeof(struct EnvStat), PTE_U | PTE_W);
+
+    *st = e->env_stat;
+    st->es_resident = env_resident_pages(e);
+    return 0;
+}
+
 static int
 sys_net_receive(void *buf, size_t len)
 {
@@ -474,6 +605,29 @@ sys_vmx_sel_resume(int i) {
     return vmx_sel_resume(i);
 }
 
+// Copy the VM-exit statistics of guest 'guest' into 'st'.
+// Any guest's statistics may be read, as with sys_env_stat.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment guest doesn't currently exist.
+//	-E_INVAL if guest is not a guest.
+// Destroys the caller if 'st' is not writable.
+static int
+sys_vmx_exit_stats(envid_t guest, struct VmxStats *st)
+{
+    int r;
+    struct Env *e;
+
+    if ((r = envid2env(guest, &e, 0)) < 0)
+        return r;
+    if (e->env_type != ENV_TYPE_GUEST)
+        return -E_INVAL;
+    user_mem_assert(curenv, st, sizeof(struct VmxStats), PTE_U | PTE_W);
+
+    *st = *e->env_vmxinfo.stats;
+    return 0;
+}
+
 static int
 sys_vmx_get_vmdisk_number() {
     return vmx_get_vmdisk_number();
@@ -496,10 +650,15 @@ sys_vmx_incr_vmdisk_number() {
 //		or guest_pa >= guest physical size or guest_pa is not page-aligned.
 //	-E_INVAL is srcva is not mapped in srcenvid's address space.
 //	-E_INVAL if perm is inappropriate 
-//	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
-//		address space.
+//	-E_INVAL if (perm & PTE_W), but srcva is read-only or copy-on-write
+//		in srcenvid's address space, unless (perm & EPT_MAP_COW).
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables. 
 //
+// With EPT_MAP_COW in perm, the page is mapped copy-on-write: the guest
+// may write it, but gets its own copy when it first does.  This lets a
+// page the caller may only read, like one of the file server's block
+// cache, go straight into the guest.
+//
 // Hint: Use ept_map_hva2gpa().  A guest environment uses 
 //       env_pml4e to store the root of the extended page tables.
 //       This function is similar to sys_page_map(). It uses Extended Page Table 
@@ -513,6 +672,7 @@ sys_ept_map(envid_t srcenvid, void *srcva,
     struct Env *src_env, *guest_env;
     struct PageInfo *pp;
     pte_t *ppte;
+    uint64_t eperm;
 
     // check that the source virtual address is good
     if (srcva >= (void*) UTOP || srcva != ROUNDDOWN(srcva, PGSIZE)) {
@@ -529,6 +689,12 @@ sys_ept_map(envid_t srcenvid, void *srcva,
         return -E_INVAL;
     }
     
+    // A writable-looking page behind a shared page table is really
+    // copy-on-write (see sys_page_map); the guest must not write it.
+    if ((perm & __EPTE_WRITE) && !(perm & EPT_MAP_COW) &&
+        pgtable_unshare(src_env->env_pml4e, srcva) < 0)
+        return -E_NO_MEM;
+
     // check that srcva is mapped in src_env's address space 
     if ((pp = page_lookup(src_env->env_pml4e, srcva, &ppte)) == 0) {
         return -E_INVAL;
@@ -540,12 +706,16 @@ sys_ept_map(envid_t srcenvid, void *srcva,
 
     // if perm requests write permission but we don't have write access to the page,
     // return an error
-	if ((perm & __EPTE_WRITE) && ((*ppte) & PTE_W) == 0)
+	if ((perm & __EPTE_WRITE) && !(perm & EPT_MAP_COW) && ((*ppte) & PTE_W) == 0)
 		return -E_INVAL;
+    // Copy-on-write pages are writable through ept_cow_break only.
+    eperm = perm & ~EPT_MAP_COW;
+    if (perm & EPT_MAP_COW)
+        eperm = (eperm & ~__EPTE_WRITE) | __EPTE_COW;
 
     // increment the page ref count. we'll undo this later if the mapping fails
     pp->pp_ref += 1;
-    ret = ept_map_hva2gpa(guest_env->env_pml4e, page2kva(pp), guest_pa, perm, 0);
+    ret = ept_map_hva2gpa(guest_env->env_pml4e, page2kva(pp), guest_pa, eperm, 0);
     if (ret < 0) {
         pp->pp_ref -= 1;
         return ret;
@@ -554,30 +724,323 @@ sys_ept_map(envid_t srcenvid, void *srcva,
     return 0;
 }
 
+// Map the 'len' bytes of the caller's pages starting at 'srcva' into
+// 'guest' at guest physical address 'guest_pa', as sys_ept_map would one
+// page at a time, so that a guest image loads with one call per segment.
+//
+// Return 0 on success, < 0 on error.  Errors are those of sys_ept_map, and
+//	-E_INVAL if len is zero or not page-aligned, or a page of the guest
+//		range is already mapped.
+// Everything is checked before the first page is mapped, so only
+// -E_NO_MEM can leave the range partly mapped.
+static int
+sys_ept_map_range(void *srcva, envid_t guest, void *guest_pa, size_t len, int perm)
+{
+    struct Env *guest_env;
+    struct PageInfo *pp;
+    pte_t *ppte;
+    void *hva;
+    size_t off;
+    int ret;
+
+    if (len == 0 || PGOFF(len) || PGOFF(srcva) || PGOFF(guest_pa))
+        return -E_INVAL;
+    if ((uint64_t) srcva + len > UTOP || (uint64_t) srcva + len < (uint64_t) srcva)
+        return -E_INVAL;
+    if ((ret = envid2env(guest, &guest_env, 1)) < 0)
+        return ret;
+    if (guest_env->env_type != ENV_TYPE_GUEST)
+        return -E_INVAL;
+    if ((uint64_t) guest_pa + len > guest_env->env_vmxinfo.phys_sz)
+        return -E_INVAL;
+    if ((perm & __EPTE_FULL) == 0 || (perm & ~(__EPTE_FULL | EPT_MAP_COW)))
+        return -E_INVAL;
+
+    for (off = 0; off < len; off += PGSIZE) {
+        if ((perm & __EPTE_WRITE) && !(perm & EPT_MAP_COW) &&
+            pgtable_unshare(curenv->env_pml4e, srcva + off) < 0)
+            return -E_NO_MEM;
+        if ((pp = page_lookup(curenv->env_pml4e, srcva + off, &ppte)) == 0)
+            return -E_INVAL;
+        if ((perm & __EPTE_WRITE) && !(perm & EPT_MAP_COW) && ((*ppte) & PTE_W) == 0)
+            return -E_INVAL;
+        ept_gpa2hva(guest_env->env_pml4e, guest_pa + off, &hva);
+        if (hva != NULL)
+            return -E_INVAL;
+    }
+
+    for (off = 0; off < len; off += PGSIZE)
+        if ((ret = sys_ept_map(0, srcva + off, guest, guest_pa + off, perm)) < 0)
+            return ret;
+    return 0;
+}
+
+// Create a guest environment with 'gphysz' bytes of guest physical memory
+// that starts executing at 'gRIP'.  'prefault' is one of the
+// VMX_PREFAULT_* policies and says when guest RAM gets backed by host
+// memory: on demand, all before the first launch, or by idle CPUs.
+//
+// Returns the new guest's envid, or < 0 on error.  Errors are:
+//	-E_NO_VMX or -E_NO_EPT if the processor can't run guests.
+//	-E_INVAL if prefault is not a known policy.
+//	-E_NO_FREE_ENV, -E_NO_MEM as for env_alloc.
 static envid_t
-    sys_env_mkguest(uint64_t gphysz, uint64_t gRIP) {
+    sys_env_mkguest(uint64_t gphysz, uint64_t gRIP, int prefault) {
     int r;
     struct Env *e;
 
+    if (prefault < VMX_PREFAULT_NONE || prefault > VMX_PREFAULT_BACKGROUND)
+        return -E_INVAL;
+
     // Check if the processor has VMX support.
     if ( !vmx_check_support() ) {
         return -E_NO_VMX;
     } else if ( !vmx_check_ept() ) {
         return -E_NO_EPT;
     } 
-    if ((r = env_guest_alloc(&e, curenv->env_id)) < 0)
+    if ((r = env_guest_alloc(&e, curenv->env_id, NULL)) < 0)
         return r;
     e->env_status = ENV_NOT_RUNNABLE;
     e->env_vmxinfo.phys_sz = gphysz;
+    e->env_vmxinfo.prefault = prefault;
     e->env_tf.tf_rip = gRIP;
+    e->env_vmxinfo.vdisk = vmx_incr_vmdisk_number();
+    return e->env_id;
+}
+
+// Add a vCPU to 'guest', a guest made with sys_env_mkguest.  The new
+// vCPU shares the guest's memory and, like an AP after power-up, waits
+// for another vCPU to start it with INIT and STARTUP IPIs.
+//
+// Returns the new vCPU's envid, or < 0 on error.  Errors are:
+//	-E_BAD_ENV if guest doesn't exist, or the caller isn't its parent.
+//	-E_INVAL if guest isn't a guest, or already has NCPU vCPUs.
+//	-E_NO_FREE_ENV, -E_NO_MEM as for env_alloc.
+static envid_t
+sys_env_mkvcpu(envid_t guest)
+{
+    struct Env *g, *e;
+    int r;
+
+    if ((r = envid2env(guest, &g, 1)) < 0)
+        return r;
+    if (g->env_type != ENV_TYPE_GUEST || vmx_vcpu_count(g) >= NCPU)
+        return -E_INVAL;
+    if ((r = env_guest_alloc(&e, curenv->env_id, g)) < 0)
+        return r;
     return e->env_id;
 }
+
+// Look up guest 'guest' for the caller, which must be its parent: its
+// memory and state are the guest's own, so only its vmm may read or
+// change them (vmmanager has the vmm save a paused guest).
+static int
+guest_lookup(envid_t guest, struct Env **store)
+{
+    struct Env *e;
+    int r;
+
+    if ((r = envid2env(guest, &e, 1)) < 0)
+        return r;
+    if (e->env_type != ENV_TYPE_GUEST)
+        return -E_INVAL;
+    *store = e;
+    return 0;
+}
+
+// Map the page behind guest-physical address 'guest_pa' of 'guest' at
+// 'dstva' in the caller's address space, the reverse of sys_ept_map.
+// This is how a device backend in the guest's parent reaches the
+// guest's rings and buffers.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if guest doesn't exist, or the caller isn't its parent.
+//	-E_INVAL if guest isn't a guest, guest_pa is beyond its memory,
+//		not mapped or not page-aligned, dstva is above UTOP or
+//		not page-aligned, or perm is inappropriate.
+//	-E_NO_MEM if there's no memory for page tables.
+static int
+sys_guest_page_map(envid_t guest, void *guest_pa, void *dstva, int perm)
+{
+    struct Env *e;
+    void *hva;
+    int r;
+
+    if ((r = guest_lookup(guest, &e)) < 0)
+        return r;
+    if (guest_pa >= (void *) e->env_vmxinfo.phys_sz || PGOFF(guest_pa))
+        return -E_INVAL;
+    if (dstva >= (void *) UTOP || PGOFF(dstva))
+        return -E_INVAL;
+    if ((~perm & (PTE_U|PTE_P)) || (perm & ~PTE_SYSCALL))
+        return -E_INVAL;
+
+    // The caller mustn't write a page the guest shares with a snapshot.
+    if ((perm & PTE_W) && (r = ept_cow_break(e->env_pml4e, guest_pa)) < 0)
+        return r;
+    ept_gpa2hva(e->env_pml4e, guest_pa, &hva);
+    if (hva == NULL)
+        return -E_INVAL;
+    // The caller's writes don't set the EPT dirty bit; count the page
+    // as written now, so an incremental save doesn't miss it.
+    if (perm & PTE_W)
+        ept_mark_dirty(e->env_pml4e, guest_pa);
+    return page_insert(curenv->env_pml4e, pa2page(PADDR(hva)), dstva, perm);
+}
+
+// Take a snapshot of 'guest': a guest that is never run, sharing the
+// guest's memory copy-on-write, from which sys_vmx_clone makes new
+// guests quickly.  guest must have one vCPU and must not have run since
+// it was made or paused (see vmx_guest_clone).
+//
+// Returns the snapshot's envid, or < 0 on error.  Errors are:
+//	-E_BAD_ENV if guest doesn't exist, or the caller isn't its parent.
+//	-E_INVAL if guest isn't a guest, is a snapshot or can't be
+//		snapshotted now.
+//	-E_NO_FREE_ENV, -E_NO_MEM as for env_alloc.
+static envid_t
+sys_vmx_snapshot(envid_t guest)
+{
+    struct Env *g, *e;
+    int r;
+
+    if ((r = envid2env(guest, &g, 1)) < 0)
+        return r;
+    if (g->env_type != ENV_TYPE_GUEST || g->env_vmxinfo.snapshot)
+        return -E_INVAL;
+    if ((r = vmx_guest_clone(g, &e)) < 0)
+        return r;
+    e->env_vmxinfo.snapshot = true;
+    return e->env_id;
+}
+
+// Make a new guest from snapshot 'snap', as a child of the caller.  Only
+// the snapshot's parent may clone it, since the clone gets a copy of the
+// snapshotted guest's memory.  The guest is made not runnable, like one
+// from sys_env_mkguest.
+//
+// Returns the new guest's envid, or < 0 on error.  Errors are:
+//	-E_BAD_ENV if snap doesn't exist, or the caller isn't its parent.
+//	-E_INVAL if snap isn't a snapshot.
+//	-E_NO_FREE_ENV, -E_NO_MEM as for env_alloc.
+static envid_t
+sys_vmx_clone(envid_t snap)
+{
+    struct Env *s, *e;
+    int r;
+
+    if ((r = envid2env(snap, &s, 1)) < 0)
+        return r;
+    if (s->env_type != ENV_TYPE_GUEST || !s->env_vmxinfo.snapshot)
+        return -E_INVAL;
+    if ((r = vmx_guest_clone(s, &e)) < 0)
+        return r;
+    e->env_parent_id = curenv->env_id;
+    e->env_vmxinfo.vdisk = vmx_incr_vmdisk_number();
+    return e->env_id;
+}
+
+// Harvest the EPT accessed and dirty bits of 'guest', clearing them, and
+// store in 'st' how much of its memory is backed, accessed and written
+// since the last scan (see struct VmxMemScan).  If 'dirty' isn't NULL,
+// the bit for each page written is set in the bitmap there, which has
+// a bit per page of guest memory and isn't cleared first, so that
+// scans can be accumulated.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if guest doesn't exist, or the caller isn't its parent.
+//	-E_INVAL if guest isn't a guest.
+//	-E_NOT_SUPP if the processor doesn't set EPT accessed and dirty bits.
+// Destroys the caller if 'st' or 'dirty' is not writable.
+static int
+sys_vmx_mem_scan(envid_t guest, uint8_t *dirty, struct VmxMemScan *st)
+{
+    struct VmxGuestInfo *lg;
+    struct Env *e;
+    uint64_t now;
+    int r;
+
+    if ((r = guest_lookup(guest, &e)) < 0)
+        return r;
+    if (!vmx_ept_ad())
+        return -E_NOT_SUPP;
+    user_mem_assert(curenv, st, sizeof(struct VmxMemScan), PTE_U | PTE_W);
+    if (dirty)
+        user_mem_assert(curenv, dirty,
+                        (e->env_vmxinfo.phys_sz / PGSIZE + 7) / 8, PTE_U | PTE_W);
+
+    lg = &vmx_vcpu_leader(e)->env_vmxinfo;
+    ept_ad_harvest(e->env_pml4e, dirty, e->env_vmxinfo.phys_sz / PGSIZE, st);
+    now = read_tsc();
+    st->ms_cycles = now - lg->mem_scan_tsc;
+    lg->mem_scan_tsc = now;
+    lg->mem_wss = lg->mem_wss ? (3 * lg->mem_wss + st->ms_accessed) / 4
+        : st->ms_accessed;
+    st->ms_wss = lg->mem_wss;
+    return 0;
+}
+
+// Copy the state of 'guest', everything but its memory and disk, into
+// 'ss' (see struct VmxSavedState).  The guest must be paused with its
+// state saved, and have one vCPU.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if guest doesn't exist, or the caller isn't its parent.
+//	-E_INVAL if guest isn't a guest, has more than one vCPU or isn't
+//		paused.
+// Destroys the caller if 'ss' is not writable.
+static int
+sys_vmx_state_get(envid_t guest, struct VmxSavedState *ss)
+{
+    struct Env *e;
+    int r;
+
+    if ((r = guest_lookup(guest, &e)) < 0)
+        return r;
+    if (vmx_vcpu_count(e) != 1 ||
+        !e->env_vmxinfo.state_saved)
+        return -E_INVAL;
+    user_mem_assert(curenv, ss, sizeof(struct VmxSavedState), PTE_U | PTE_W);
+
+    vmx_state_get(e, ss);
+    return 0;
+}
+
+// Give 'guest', a new guest made by the caller, the state in 'ss', read
+// from another guest of the same size with sys_vmx_state_get.  Once the
+// caller has mapped the other guest's memory into it, the guest carries
+// on from where the other was paused.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if guest doesn't exist, or the caller isn't its parent.
+//	-E_INVAL if guest isn't a guest, has run or has more than one
+//		vCPU, or ss is for a guest of another size or kernel, or
+//		has rings, MSRs or device state the guest couldn't have set.
+//	-E_NO_MEM if there's no memory to keep the state in.
+// Destroys the caller if 'ss' is not readable.
+static int
+sys_vmx_state_set(envid_t guest, const struct VmxSavedState *ss)
+{
+    struct Env *e;
+    int r;
+
+    if ((r = guest_lookup(guest, &e)) < 0)
+        return r;
+    if (e->env_runs || vmx_vcpu_count(e) != 1)
+        return -E_INVAL;
+    user_mem_assert(curenv, ss, sizeof(struct VmxSavedState), PTE_U);
+
+    return vmx_state_set(e, ss);
+}
 #endif //!VMM_GUEST
 
 // Dispatches to the correct kernel function, passing the arguments.
 int64_t
 syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5)
 {
+    if (syscallno < NSYSCALLS)
+        curenv->env_stat.es_syscalls[syscallno]++;
+
     switch (syscallno) {
     case SYS_cputs:
         sys_cputs((const char*) a1, a2);
@@ -616,11 +1079,23 @@ syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
         return sys_net_transmit((const void*)a1, a2);
     case SYS_net_receive:
         return sys_net_receive((void*)a1, a2);
+    case SYS_env_stat:
+        return sys_env_stat(a1, (struct EnvStat*) a2);
+    case SYS_env_share_pgtables:
+        return sys_env_share_pgtables(a1);
+    case SYS_futex_wait:
+        return sys_futex_wait((const uint32_t *) a1, a2, a3);
+    case SYS_futex_wake:
+        return sys_futex_wake((const uint32_t *) a1, a2);
 #ifndef VMM_GUEST
     case SYS_ept_map:
         return sys_ept_map(a1, (void*) a2, a3, (void*) a4, a5);
+    case SYS_ept_map_range:
+        return sys_ept_map_range((void*) a1, a2, (void*) a3, a4, a5);
     case SYS_env_mkguest:
-        return sys_env_mkguest(a1, a2);
+        return sys_env_mkguest(a1, a2, a3);
+    case SYS_env_mkvcpu:
+        return sys_env_mkvcpu(a1);
     case SYS_vmx_list_vms:
         sys_vmx_list_vms();
         return 0;
@@ -631,6 +1106,20 @@ syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
     case SYS_vmx_incr_vmdisk_number:
         sys_vmx_incr_vmdisk_number();
         return 0;
+    case SYS_guest_page_map:
+        return sys_guest_page_map(a1, (void *) a2, (void *) a3, a4);
+    case SYS_vmx_exit_stats:
+        return sys_vmx_exit_stats(a1, (struct VmxStats *) a2);
+    case SYS_vmx_snapshot:
+        return sys_vmx_snapshot(a1);
+    case SYS_vmx_clone:
+        return sys_vmx_clone(a1);
+    case SYS_vmx_mem_scan:
+        return sys_vmx_mem_scan(a1, (uint8_t *) a2, (struct VmxMemScan *) a3);
+    case SYS_vmx_state_get:
+        return sys_vmx_state_get(a1, (struct VmxSavedState *) a2);
+    case SYS_vmx_state_set:
+        return sys_vmx_state_set(a1, (const struct VmxSavedState *) a2);
 #endif
 
     default:
@@ -12,6 +12,7 @@
 #include <kern/syscall.h>
 #line 15 "../kern/trap.c"
 #include <kern/sched.h>
+#include <kern/futex.h>
 #include <kern/kclock.h>
 #include <kern/picirq.h>
 #include <kern/cpu.h>
@@ -20,6 +21,12 @@
 #include <kern/time.h>
 #line 25 "../kern/trap.c"
 #include <inc/vmx.h>
+#ifndef VMM_GUEST
+#include <vmm/vmx.h>
+#include <vmm/vcons.h>
+#else
+#include <kern/balloon.h>
+#endif
 #line 27 "../kern/trap.c"
 
 extern uintptr_t gdtdesc_64;
@@ -251,11 +258,28 @@ print_regs(struct PushRegs *regs)
 	cprintf("  rax  0x%08x\n", regs->reg_rax);
 }
 
+// Handle a tick of this CPU's local APIC timer.  The VMM calls this
+// too, for ticks that arrive while a guest is running.
+void
+timer_intr(void)
+{
+	if (cpunum() == 0) {
+		time_tick();
+		futex_tick();
+#ifdef VMM_GUEST
+		balloon_tick();
+#endif
+	}
+	lapic_eoi();
+#ifndef VMM_GUEST
+	vmx_halt_wakeup();
+#endif
+}
+
 static void
 trap_dispatch(struct Trapframe *tf)
 {
 #line 288 "../kern/trap.c"
-	int r;
 #line 290 "../kern/trap.c"
 	// Handle processor exceptions.
 	// LAB 3: Your code here.
@@ -305,24 +329,30 @@ trap_dispatch(struct Trapframe *tf)
 #line 337 "../kern/trap.c"
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
 		// irq 0 -- clock interrupt
-#line 340 "../kern/trap.c"
-		if (cpunum() == 0)
-			time_tick();
-#line 344 "../kern/trap.c"
-		#ifndef VMM_GUEST
-		lapic_eoi();
-		#else
-		asm("vmcall":"=a"(r): "0"(VMX_VMCALL_LAPICEOI));
-		#endif
-#line 352 "../kern/trap.c"
+		timer_intr();
 		sched_yield();
 	}
+	// A kick meant to make this CPU leave a guest it has left already,
+	// or to flush its TLB after a shared page table changed (see
+	// pgtable_shootdown).
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_KICK) {
+		tlbflush();
+		lapic_eoi();
+		return;
+	}
 #line 355 "../kern/trap.c"
 
 #line 358 "../kern/trap.c"
 	// Handle keyboard and serial interrupts.
 	// LAB 5: Your code here.
 #line 361 "../kern/trap.c"
+#ifndef VMM_GUEST
+	// A guest with a paravirtual console may take the input.
+	if ((tf->tf_trapno == IRQ_OFFSET + IRQ_KBD ||
+	     tf->tf_trapno == IRQ_OFFSET + IRQ_SERIAL) &&
+	    vcons_input(tf->tf_trapno))
+		return;
+#endif
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_KBD) {
 		kbd_intr();
 		return;
@@ -371,6 +401,8 @@ trap(struct Trapframe *tf)
 #line 411 "../kern/trap.c"
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
+		// Stop charging the environment for CPU time.
+		env_charge(curenv);
 #line 414 "../kern/trap.c"
 		// Acquire the big kernel lock before doing any
 		// serious kernel work.
@@ -436,6 +468,21 @@ page_fault_handler(struct Trapframe *tf)
 #line 485 "../kern/trap.c"
 
 #line 487 "../kern/trap.c"
+	curenv->env_stat.es_pgfaults++;
+
+	// A write through a page table still shared with a fork parent or
+	// child: take a private copy of the table and retry.  Any further
+	// copy-on-write fault is the user handler's business.
+	if (tf->tf_err & FEC_WR) {
+		int r = pgtable_unshare(curenv->env_pml4e, (void *) fault_va);
+		if (r < 0) {
+			cprintf("[%08x] out of memory unsharing va %08x\n",
+				curenv->env_id, fault_va);
+			env_destroy(curenv);
+		} else if (r > 0)
+			env_run(curenv);
+	}
+
 	// See if the environment has installed a user page fault handler.
 	if (curenv->env_pgfault_upcall == 0) {
 		cprintf("[%08x] user fault va %08x ip %08x\n",
@@ -0,0 +1,23 @@
+// Result reporting for the microbenchmarks in user/bench*.c.
+// The output format is parsed by benchproject.py:
+//
+//	BENCH <name> ops=<n> cycles=<c> [bytes=<b>]
+//	BENCH done
+
+#include <inc/lib.h>
+
+void
+bench_report(const char *name, uint64_t ops, uint64_t cycles, uint64_t bytes)
+{
+	if (bytes)
+		cprintf("BENCH %s ops=%llu cycles=%llu bytes=%llu\n",
+			name, ops, cycles, bytes);
+	else
+		cprintf("BENCH %s ops=%llu cycles=%llu\n", name, ops, cycles);
+}
+
+void
+bench_done(void)
+{
+	cprintf("BENCH done\n");
+}
@@ -197,6 +197,28 @@ remove(const char *path)
 	return fsipc(FSREQ_REMOVE, NULL);
 }
 
+// Map the page of open file fdnum holding byte offset read-only at
+// dstva, straight from the file server's block cache rather than
+// copying it.  Later writes to the file don't show through: the file
+// server moves the block to a page of its own first.
+//
+// Returns how many bytes of the page belong to the file, or < 0 on
+// error.
+int
+file_map(int fdnum, off_t offset, void *dstva)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = offset;
+	return fsipc(FSREQ_MAP, dstva);
+}
+
 // Synchronize disk with buffer cache
 int
 sync(void)
@@ -8,9 +8,26 @@
 #define debug 0
 #line 10 "../lib/fork.c"
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
+//
+// Replace the page containing addr with a private, writable copy.
+//
+static void
+copypage(void *addr)
+{
+	int r;
+
+	if ((r = sys_page_alloc(0, (void*) PFTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	memmove((void*) PFTEMP, ROUNDDOWN(addr, PGSIZE), PGSIZE);
+
+	// remap over the original page
+	if ((r = sys_page_map(0, (void*) PFTEMP, 0, ROUNDDOWN(addr, PGSIZE), PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_map: %e", r);
+
+	// unmap our work space
+	if ((r = sys_page_unmap(0, (void*) PFTEMP)) < 0)
+		panic("sys_page_unmap: %e", r);
+}
 
 //
 // Custom page fault handler - if faulting page is copy-on-write,
@@ -21,7 +38,6 @@ pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t err = utf->utf_err;
-	int r;
 
 #line 27 "../lib/fork.c"
 	if (debug)
@@ -35,18 +51,7 @@ pgfault(struct UTrapframe *utf)
 #line 44 "../lib/fork.c"
 
 #line 46 "../lib/fork.c"
-	// copy page
-	if ((r = sys_page_alloc(0, (void*) PFTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-		panic("sys_page_alloc: %e", r);
-	memmove((void*) PFTEMP, ROUNDDOWN(addr, PGSIZE), PGSIZE);
-
-	// remap over faulting page
-	if ((r = sys_page_map(0, (void*) PFTEMP, 0, ROUNDDOWN(addr, PGSIZE), PTE_P|PTE_U|PTE_W)) < 0)
-		panic("sys_page_map: %e", r);
-
-	// unmap our work space
-	if ((r = sys_page_unmap(0, (void*) PFTEMP)) < 0)
-		panic("sys_page_unmap: %e", r);
+	copypage(addr);
 #line 70 "../lib/fork.c"
 }
 
@@ -138,9 +143,16 @@ fork(void)
 		return 0;
 	}
 
-	// Copy the address space.
+	// Share our page tables with the child; the kernel copies each
+	// one, and marks its writable pages copy-on-write, on the first
+	// write through it.  Only the stack's page table is left to us.
+	if ((r = sys_env_share_pgtables(envid)) < 0)
+		panic("sys_env_share_pgtables: %e", r);
+
+	// Copy what wasn't shared.
 	for (pn = 0; pn < PGNUM(UTOP); ) {
-		if (!(uvpde[pn >> 18] & PTE_P && uvpd[pn >> 9] & PTE_P)) {
+		if (!(uvpde[pn >> 18] & PTE_P && uvpd[pn >> 9] & PTE_P)
+		    || (uvpd[pn >> 9] & PTE_SHPT)) {
 			pn += NPTENTRIES;
 			continue;
 		}
@@ -170,10 +182,82 @@ fork(void)
 #line 204 "../lib/fork.c"
 }
 
-// Challenge!
-int
+//
+// Map our page pn into envid at the same address and with the same
+// permissions, so that both see each other's writes.  A page we only
+// hold copy-on-write -- including a writable page behind a page table
+// still shared by fork -- is made private first; sharing it as it is
+// would leave each side writing its own copy after the next fault.
+//
+static void
+sharepage(envid_t envid, unsigned pn)
+{
+	void *addr;
+	pte_t pte;
+	int r;
+
+	addr = (void*) (uint64_t)(pn << PGSHIFT);
+	pte = uvpt[pn];
+
+	if ((pte & PTE_COW)
+	    || ((uvpd[pn >> 9] & PTE_SHPT) && (pte & (PTE_W|PTE_SHARE)) == PTE_W)) {
+		copypage(addr);
+		pte = uvpt[pn];
+	}
+	if ((r = sys_page_map(0, addr, envid, addr, pte & PTE_SYSCALL)) < 0)
+		panic("sys_page_map: %e", r);
+}
+
+//
+// Create a thread: a child env that shares all of our memory except the
+// stack, which it gets copy-on-write like fork, the page holding
+// 'thisenv', likewise, and the exception stack, which is its own.
+// Each thread's thisenv points at its own Env.
+//
+// File descriptors live in shared memory, so a thread that calls exit()
+// closes them for every thread; a thread should end with
+// sys_env_destroy(0) instead.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	envid_t envid;
+	int pn, end_pn, r;
+
+	set_pgfault_handler(pgfault);
+
+	envid = sys_exofork();
+	if (envid < 0)
+		return envid;
+	if (envid == 0) {
+		thisenv = &envs[ENVX(sys_getenvid())];
+		return 0;
+	}
+
+	for (pn = 0; pn < PGNUM(USTACKTOP); ) {
+		if (!(uvpde[pn >> 18] & PTE_P && uvpd[pn >> 9] & PTE_P)) {
+			pn += NPTENTRIES;
+			continue;
+		}
+		for (end_pn = pn + NPTENTRIES; pn < end_pn; pn++) {
+			if ((uvpt[pn] & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+				continue;
+			if (pn >= PGNUM(ROUNDDOWN(USTACKTOP - PGSIZE, PTSIZE))
+			    || pn == PGNUM(&thisenv))
+				duppage(envid, pn);
+			else
+				sharepage(envid, pn);
+		}
+	}
+
+	if ((r = sys_page_alloc(envid, (void*) (UXSTACKTOP - PGSIZE), PTE_P|PTE_U|PTE_W)) < 0)
+		panic("allocating exception stack: %e", r);
+	if ((r = sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall)) < 0)
+		panic("sys_env_set_pgfault_upcall: %e", r);
+	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
+		panic("sys_env_set_status: %e", r);
+
+	return envid;
 }
@@ -46,12 +46,16 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	return thisenv->env_ipc_value;
 }
 
+// How long ipc_send sleeps on a busy receiver before trying again
+// anyway, in case the receiver went away instead.
+#define IPC_WAIT_MSEC 100
+
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
 // This function keeps trying until it succeeds.
 // It should panic() on any error other than -E_IPC_NOT_RECV.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
+//   Sleep on the receiver's env_ipc_recving to be CPU-friendly.
 //   If 'pg' is null, pass sys_ipc_recv a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
@@ -62,7 +66,7 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	if (!pg)
 		pg = (void*) UTOP;
 	while ((r = sys_ipc_try_send(to_env, val, pg, perm)) == -E_IPC_NOT_RECV) {
-		sys_yield();
+		sys_futex_wait(&envs[ENVX(to_env)].env_ipc_recving, 0, IPC_WAIT_MSEC);
 	}
 	if (r < 0)
 		panic("error in ipc_send: %e", r);
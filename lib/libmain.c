@@ -6,7 +6,9 @@
 
 extern void umain(int argc, char **argv);
 
-const volatile struct Env *thisenv;
+// Alone on its own page (see user/user.ld), so that sfork can give
+// every thread a private copy.
+const volatile struct Env *thisenv __attribute__((section(".data.thisenv")));
 const char *binaryname = "<unknown>";
 
 void
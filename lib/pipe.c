@@ -24,12 +24,39 @@ struct Dev devpipe =
 
 #define PIPEBUFSIZ 32		// small to provoke races
 
+// A peer that dies without closing its end never wakes us, so sleepers
+// recheck _pipeisclosed this often.
+#define PIPE_WAIT_MSEC 20
+
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	uint32_t p_rwaiting;	// a reader sleeps on p_wpos
+	uint32_t p_wwaiting;	// a writer sleeps on p_rpos
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
+// Sleep until *pos moves off old (or PIPE_WAIT_MSEC passes), having
+// told the other side to wake us.
+static void
+pipe_sleep(volatile uint32_t *waiting, volatile off_t *pos, off_t old)
+{
+	*waiting = 1;
+	__sync_synchronize();
+	sys_futex_wait((volatile uint32_t *) pos, old, PIPE_WAIT_MSEC);
+}
+
+// We moved *pos; wake whoever sleeps on it.
+static void
+pipe_wakeup(volatile uint32_t *waiting, volatile off_t *pos)
+{
+	__sync_synchronize();
+	if (*waiting) {
+		*waiting = 0;
+		sys_futex_wake((volatile uint32_t *) pos, NENV);
+	}
+}
+
 int
 pipe(int pfd[2])
 {
@@ -119,6 +146,7 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 	uint8_t *buf;
 	size_t i;
 	struct Pipe *p;
+	off_t wpos;
 
 	p = (struct Pipe*)fd2data(fd);
 	if (debug)
@@ -127,24 +155,26 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 
 	buf = vbuf;
 	for (i = 0; i < n; i++) {
-		while (p->p_rpos == p->p_wpos) {
+		while (p->p_rpos == (wpos = p->p_wpos)) {
 			// pipe is empty
 			// if we got any data, return it
 			if (i > 0)
-				return i;
+				goto out;
 			// if all the writers are gone, note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a writer moves wpos
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read sleep\n");
+			pipe_sleep(&p->p_rwaiting, &p->p_wpos, wpos);
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
 		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
 		p->p_rpos++;
 	}
+out:
+	pipe_wakeup(&p->p_wwaiting, &p->p_rpos);
 	return i;
 #line 178 "../lib/pipe.c"
 }
@@ -156,6 +186,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 	const uint8_t *buf;
 	size_t i;
 	struct Pipe *p;
+	off_t rpos;
 
 	p = (struct Pipe*) fd2data(fd);
 	if (debug)
@@ -164,17 +195,19 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 
 	buf = vbuf;
 	for (i = 0; i < n; i++) {
-		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
+		while (p->p_wpos >= (rpos = p->p_rpos) + sizeof(p->p_buf)) {
 			// pipe is full
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let readers at what we wrote, then sleep
+			// until one of them moves rpos
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write sleep\n");
+			pipe_wakeup(&p->p_rwaiting, &p->p_wpos);
+			pipe_sleep(&p->p_wwaiting, &p->p_rpos, rpos);
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
@@ -182,6 +215,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 		p->p_wpos++;
 	}
 
+	pipe_wakeup(&p->p_rwaiting, &p->p_wpos);
 	return i;
 #line 226 "../lib/pipe.c"
 }
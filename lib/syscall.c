@@ -140,6 +140,30 @@ sys_net_receive(char *buf, unsigned int len)
 {
 	return syscall(SYS_net_receive, 0, (uint64_t)buf, len, 0, 0, 0);
 }
+
+int
+sys_env_stat(envid_t envid, struct EnvStat *st)
+{
+	return syscall(SYS_env_stat, 0, envid, (uint64_t)st, 0, 0, 0);
+}
+
+int
+sys_env_share_pgtables(envid_t envid)
+{
+	return syscall(SYS_env_share_pgtables, 1, envid, 0, 0, 0, 0);
+}
+
+int
+sys_futex_wait(const volatile uint32_t *addr, uint32_t val, uint32_t timeout)
+{
+	return syscall(SYS_futex_wait, 0, (uint64_t)addr, val, timeout, 0, 0);
+}
+
+int
+sys_futex_wake(const volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint64_t)addr, n, 0, 0, 0);
+}
 #line 144 "../lib/syscall.c"
 
 #line 146 "../lib/syscall.c"
@@ -151,9 +175,21 @@ sys_ept_map(envid_t srcenvid, void *srcva, envid_t guest, void* guest_pa, int pe
 		       (uint64_t)srcva, guest, (uint64_t)guest_pa, perm);
 }
 
+int
+sys_ept_map_range(void *srcva, envid_t guest, void *guest_pa, size_t len, int perm)
+{
+	return syscall(SYS_ept_map_range, 0, (uint64_t)srcva, guest,
+		       (uint64_t)guest_pa, len, perm);
+}
+
 envid_t
-sys_env_mkguest(uint64_t gphysz, uint64_t gRIP) {
-	return (envid_t) syscall(SYS_env_mkguest, 0, gphysz, gRIP, 0, 0, 0);
+sys_env_mkguest(uint64_t gphysz, uint64_t gRIP, int prefault) {
+	return (envid_t) syscall(SYS_env_mkguest, 0, gphysz, gRIP, prefault, 0, 0);
+}
+
+envid_t
+sys_env_mkvcpu(envid_t guest) {
+	return (envid_t) syscall(SYS_env_mkvcpu, 0, guest, 0, 0, 0, 0);
 }
 #ifndef VMM_GUEST
 void
@@ -175,5 +211,49 @@ void
 sys_vmx_incr_vmdisk_number() {
 	syscall(SYS_vmx_incr_vmdisk_number, 0, 0, 0, 0, 0, 0);
 }
+
+int
+sys_guest_page_map(envid_t guest, void *guest_pa, void *dstva, int perm)
+{
+	return syscall(SYS_guest_page_map, 0, guest, (uint64_t)guest_pa,
+		       (uint64_t)dstva, perm, 0);
+}
+
+int
+sys_vmx_exit_stats(envid_t guest, struct VmxStats *st)
+{
+	return syscall(SYS_vmx_exit_stats, 0, guest, (uint64_t)st, 0, 0, 0);
+}
+
+envid_t
+sys_vmx_snapshot(envid_t guest)
+{
+	return syscall(SYS_vmx_snapshot, 0, guest, 0, 0, 0, 0);
+}
+
+envid_t
+sys_vmx_clone(envid_t snap)
+{
+	return syscall(SYS_vmx_clone, 0, snap, 0, 0, 0, 0);
+}
+
+int
+sys_vmx_mem_scan(envid_t guest, uint8_t *dirty, struct VmxMemScan *st)
+{
+	return syscall(SYS_vmx_mem_scan, 0, guest, (uint64_t)dirty,
+		       (uint64_t)st, 0, 0);
+}
+
+int
+sys_vmx_state_get(envid_t guest, struct VmxSavedState *ss)
+{
+	return syscall(SYS_vmx_state_get, 0, guest, (uint64_t)ss, 0, 0, 0);
+}
+
+int
+sys_vmx_state_set(envid_t guest, const struct VmxSavedState *ss)
+{
+	return syscall(SYS_vmx_state_set, 0, guest, (uint64_t)ss, 0, 0, 0);
+}
 #endif
 
@@ -32,12 +32,36 @@ thread_wakeup(volatile uint32_t *addr) {
     }
 }
 
+// If every other thread is also stuck in thread_wait, none of them can
+// wake us, and yielding to them would just spin.  Returns the earliest
+// time any of them (or 'msec') gives up in that case, 0 otherwise.
+static uint32_t
+thread_all_waiting(uint32_t msec) {
+    struct thread_context *tc = thread_queue.tq_first;
+    uint32_t until = msec;
+
+    while (tc) {
+	if (!tc->tc_wait_until || tc->tc_wakeup)
+	    return 0;
+	if (tc->tc_wait_addr && *tc->tc_wait_addr != tc->tc_wait_val)
+	    return 0;
+	if (tc->tc_wait_until < until)
+	    until = tc->tc_wait_until;
+	tc = tc->tc_queue_link;
+    }
+    return until;
+}
+
 void
 thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
+    static volatile uint32_t nowhere;
     uint32_t s = sys_time_msec();
     uint32_t p = s;
+    uint32_t until;
 
     cur_tc->tc_wait_addr = addr;
+    cur_tc->tc_wait_val = val;
+    cur_tc->tc_wait_until = msec;
     cur_tc->tc_wakeup = 0;
 
     while (p < msec) {
@@ -48,11 +72,20 @@ thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
 	if (cur_tc->tc_wakeup)
 	    break;
 
-	thread_yield();
+	// Nobody here can run, so let the kernel put the whole env
+	// to sleep on our word until the first deadline.
+	if ((until = thread_all_waiting(msec)) > p) {
+	    if (addr)
+		sys_futex_wait(addr, val, until == ~0U ? 0 : until - p);
+	    else
+		sys_futex_wait(&nowhere, 0, until == ~0U ? 0 : until - p);
+	} else
+	    thread_yield();
 	p = sys_time_msec();
     }
 
     cur_tc->tc_wait_addr = 0;
+    cur_tc->tc_wait_until = 0;
     cur_tc->tc_wakeup = 0;
 }
 
@@ -0,0 +1,32 @@
+// Benchmark the cost of a copy-on-write fault after fork.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES	256
+
+static char buf[NPAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	envid_t who;
+	int i;
+
+	// Make sure every page is present before forking.
+	for (i = 0; i < NPAGES; i++)
+		buf[i * PGSIZE] = 1;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		start = read_tsc();
+		for (i = 0; i < NPAGES; i++)
+			buf[i * PGSIZE] = 2;
+		bench_report("cow_fault", NPAGES, read_tsc() - start, 0);
+		return;
+	}
+	wait(who);
+	bench_done();
+}
@@ -0,0 +1,37 @@
+// Benchmark sequential file write and read throughput through the
+// file system server.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NBYTES	(256 * 1024)
+#define CHUNK	4096
+
+static char buf[CHUNK];
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	int fd, n, r;
+
+	if ((fd = open("/benchfile", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /benchfile: %e", fd);
+
+	memset(buf, 'b', sizeof(buf));
+	start = read_tsc();
+	for (n = 0; n < NBYTES; n += CHUNK)
+		if ((r = write(fd, buf, CHUNK)) != CHUNK)
+			panic("write: %e", r);
+	bench_report("file_write", NBYTES / CHUNK, read_tsc() - start, NBYTES);
+
+	seek(fd, 0);
+	start = read_tsc();
+	for (n = 0; (r = read(fd, buf, CHUNK)) > 0; n += r)
+		;
+	bench_report("file_read", NBYTES / CHUNK, read_tsc() - start, n);
+
+	close(fd);
+	remove("/benchfile");
+	bench_done();
+}
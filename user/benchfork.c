@@ -0,0 +1,25 @@
+// Benchmark fork latency: fork a child that exits at once and wait for it.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NITER	100
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	envid_t who;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NITER; i++) {
+		if ((who = fork()) < 0)
+			panic("fork: %e", who);
+		if (who == 0)
+			exit();
+		wait(who);
+	}
+	bench_report("fork", NITER, read_tsc() - start, 0);
+	bench_done();
+}
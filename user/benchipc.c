@@ -0,0 +1,33 @@
+// Benchmark an ipc_send/ipc_recv round trip between two environments.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NITER	10000
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint64_t start;
+	int i;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		for (i = 0; i < NITER; i++) {
+			ipc_recv(&who, 0, 0);
+			ipc_send(who, i, 0, 0);
+		}
+		return;
+	}
+
+	start = read_tsc();
+	for (i = 0; i < NITER; i++) {
+		ipc_send(who, i, 0, 0);
+		ipc_recv(0, 0, 0);
+	}
+	bench_report("ipc_roundtrip", NITER, read_tsc() - start, 0);
+	wait(who);
+	bench_done();
+}
@@ -0,0 +1,19 @@
+// Benchmark the cost of a null system call.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NITER	100000
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NITER; i++)
+		sys_getenvid();
+	bench_report("null_syscall", NITER, read_tsc() - start, 0);
+	bench_done();
+}
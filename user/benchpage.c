@@ -0,0 +1,35 @@
+// Benchmark sys_page_alloc, sys_page_map and sys_page_unmap.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NITER	10000
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t t0, t1, t2, t3;
+	uint64_t alloc = 0, map = 0, unmap = 0;
+	int i, r;
+
+	for (i = 0; i < NITER; i++) {
+		t0 = read_tsc();
+		if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		t1 = read_tsc();
+		if ((r = sys_page_map(0, UTEMP, 0, UTEMP + PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_map: %e", r);
+		t2 = read_tsc();
+		sys_page_unmap(0, UTEMP + PGSIZE);
+		sys_page_unmap(0, UTEMP);
+		t3 = read_tsc();
+
+		alloc += t1 - t0;
+		map += t2 - t1;
+		unmap += t3 - t2;
+	}
+	bench_report("page_alloc", NITER, alloc, 0);
+	bench_report("page_map", NITER, map, 0);
+	bench_report("page_unmap", 2 * NITER, unmap, 0);
+	bench_done();
+}
@@ -0,0 +1,41 @@
+// Benchmark pipe throughput between two environments.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NBYTES	(64 * 1024)
+#define CHUNK	4096
+
+static char buf[CHUNK];
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start, total = 0, nreads = 0;
+	int p[2], r;
+	envid_t who;
+
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		close(p[0]);
+		for (total = 0; total < NBYTES; total += CHUNK)
+			if ((r = write(p[1], buf, CHUNK)) != CHUNK)
+				panic("write: %e", r);
+		close(p[1]);
+		return;
+	}
+
+	close(p[1]);
+	start = read_tsc();
+	while ((r = read(p[0], buf, CHUNK)) > 0) {
+		total += r;
+		nreads++;
+	}
+	bench_report("pipe", nreads, read_tsc() - start, total);
+	close(p[0]);
+	wait(who);
+	bench_done();
+}
@@ -0,0 +1,54 @@
+// Socket echo throughput.  This is an echo server on port 7; the
+// benchmark driver connects from the host, streams data through it and
+// times the transfer from its side.  We report the in-guest time spent
+// serving the connection.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+#include <lwip/sockets.h>
+#include <lwip/inet.h>
+
+#define PORT	7
+#define CHUNK	1024
+
+static char buf[CHUNK];
+
+void
+umain(int argc, char **argv)
+{
+	int serversock, clientsock, r;
+	struct sockaddr_in addr;
+	unsigned int addrlen;
+	uint64_t start, total = 0, nreads = 0;
+
+	if ((serversock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+		panic("socket: %e", serversock);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(PORT);
+	if ((r = bind(serversock, (struct sockaddr *) &addr, sizeof(addr))) < 0)
+		panic("bind: %e", r);
+	if ((r = listen(serversock, 1)) < 0)
+		panic("listen: %e", r);
+
+	cprintf("BENCH sock ready\n");
+
+	addrlen = sizeof(addr);
+	if ((clientsock = accept(serversock, (struct sockaddr *) &addr, &addrlen)) < 0)
+		panic("accept: %e", clientsock);
+
+	start = read_tsc();
+	while ((r = read(clientsock, buf, CHUNK)) > 0) {
+		if (write(clientsock, buf, r) != r)
+			break;
+		total += r;
+		nreads++;
+	}
+	bench_report("sock_echo", nreads, read_tsc() - start, total);
+
+	close(clientsock);
+	close(serversock);
+	bench_done();
+}
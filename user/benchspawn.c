@@ -0,0 +1,27 @@
+// Benchmark spawn latency: spawn a copy of ourselves that exits at once
+// and wait for it.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NITER	50
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	envid_t who;
+	int i;
+
+	if (argc > 1)
+		return;
+
+	start = read_tsc();
+	for (i = 0; i < NITER; i++) {
+		if ((who = spawnl("/benchspawn", "benchspawn", "child", (char*)0)) < 0)
+			panic("spawn: %e", who);
+		wait(who);
+	}
+	bench_report("spawn", NITER, read_tsc() - start, 0);
+	bench_done();
+}
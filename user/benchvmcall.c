@@ -0,0 +1,45 @@
+// Benchmark a VM exit round trip, and the same hypercalls made in
+// batches of VMX_BATCH_MAX per exit.  Only meaningful inside a guest,
+// where vmcall traps to the host VMM.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+#include <inc/vmx.h>
+
+#define NITER	10000
+
+#ifdef VMM_GUEST
+static struct VmxBatch batch __attribute__((aligned(PGSIZE)));
+#endif
+
+void
+umain(int argc, char **argv)
+{
+#ifdef VMM_GUEST
+	uint64_t start, pa;
+	int i, r;
+
+	start = read_tsc();
+	for (i = 0; i < NITER; i++)
+		asm volatile("vmcall" : "=a"(r) : "0"(VMX_VMCALL_GETDISKIMGNUM));
+	bench_report("vmcall_roundtrip", NITER, read_tsc() - start, 0);
+
+	for (i = 0; i < VMX_BATCH_MAX; i++)
+		batch.hb_req[i].br_code = VMX_VMCALL_GETDISKIMGNUM;
+	batch.hb_count = VMX_BATCH_MAX;
+	pa = PTE_ADDR(uvpt[PGNUM(&batch)]);
+	start = read_tsc();
+	for (i = 0; i < NITER; i += VMX_BATCH_MAX) {
+		asm volatile("vmcall" : "=a"(r)
+			     : "0"(VMX_VMCALL_BATCH), "b"(pa) : "memory");
+		if (r != VMX_BATCH_MAX)
+			panic("batch hypercall: %d", r);
+	}
+	bench_report("vmcall_batched", ROUNDUP(NITER, VMX_BATCH_MAX),
+		     read_tsc() - start, 0);
+#else
+	cprintf("BENCH vmcall_roundtrip skipped: not running in a guest\n");
+	cprintf("BENCH vmcall_batched skipped: not running in a guest\n");
+#endif
+	bench_done();
+}
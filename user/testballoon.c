@@ -0,0 +1,71 @@
+// Test the memory balloon hypercalls, from inside a guest: give some of
+// this program's pages to the host, check that they come back zeroed
+// when touched again, and take them out of the balloon.  Bad page lists
+// must be refused, and the host must stop at a bad entry.
+
+#include <inc/lib.h>
+#include <inc/vmx.h>
+
+#define NPAGES	8
+#define BUF	((uint64_t *) 0x10000000)
+#define NWORDS	(PGSIZE / sizeof(uint64_t))
+
+static uint64_t list[PGSIZE / sizeof(uint64_t)] __attribute__((aligned(PGSIZE)));
+
+static int64_t
+balloon(int code, uint64_t rbx, uint64_t rcx)
+{
+	int64_t r;
+
+	asm volatile("vmcall" : "=a"(r) : "0"(code), "b"(rbx), "c"(rcx)
+		     : "memory");
+	return r;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t pa;
+	int64_t r;
+	int i, j;
+
+	if ((r = balloon(VMX_VMCALL_BALLOON_TARGET, 0, 0)) < 0)
+		panic("balloon target: %lld", r);
+	for (i = 0; i < NPAGES; i++) {
+		if ((r = sys_page_alloc(0, BUF + i * NWORDS, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		for (j = 0; j < NWORDS; j++)
+			BUF[i * NWORDS + j] = ~0ULL;
+		list[i] = PTE_ADDR(uvpt[PGNUM(BUF + i * NWORDS)]);
+	}
+	pa = PTE_ADDR(uvpt[PGNUM(list)]);
+
+	if ((r = balloon(VMX_VMCALL_BALLOON_INFLATE, pa + 8, 1)) != -E_INVAL)
+		panic("inflating from an unaligned list: %lld", r);
+	if ((r = balloon(VMX_VMCALL_BALLOON_INFLATE, pa, PGSIZE)) != -E_INVAL)
+		panic("inflating too many pages: %lld", r);
+	// The list page itself can't be given back.
+	list[NPAGES] = pa;
+	if ((r = balloon(VMX_VMCALL_BALLOON_INFLATE, pa, NPAGES + 1)) != NPAGES)
+		panic("inflating %d pages: %lld", NPAGES, r);
+
+	// The host took the pages away; touching them gets new, zeroed
+	// ones.
+	for (i = 0; i < NPAGES; i++)
+		for (j = 0; j < NWORDS; j++)
+			if (BUF[i * NWORDS + j] != 0)
+				panic("page %d word %d is %llx, not 0, when refaulted",
+				      i, j, BUF[i * NWORDS + j]);
+	for (i = 0; i < NPAGES; i++)
+		for (j = 0; j < NWORDS; j++)
+			BUF[i * NWORDS + j] = i ^ j;
+	for (i = 0; i < NPAGES; i++)
+		for (j = 0; j < NWORDS; j++)
+			if (BUF[i * NWORDS + j] != (i ^ j))
+				panic("page %d word %d is %llx after the balloon",
+				      i, j, BUF[i * NWORDS + j]);
+
+	if ((r = balloon(VMX_VMCALL_BALLOON_DEFLATE, NPAGES, 0)) != 0)
+		panic("deflating %d pages: %lld", NPAGES, r);
+	cprintf("testballoon: OK\n");
+}
@@ -0,0 +1,46 @@
+// Test sfork and futexes: two threads take turns incrementing a shared
+// counter, sleeping on the turn word while waiting for the other.
+
+#include <inc/lib.h>
+
+#define ROUNDS 100
+
+volatile uint32_t turn;
+volatile uint32_t counter;
+
+static void
+play(uint32_t me)
+{
+	int i;
+
+	for (i = 0; i < ROUNDS; i++) {
+		while (turn != me)
+			sys_futex_wait(&turn, !me, 0);
+		counter++;
+		turn = !me;
+		sys_futex_wake(&turn, 1);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+
+	if ((child = sfork()) < 0)
+		panic("sfork: %e", child);
+	if (thisenv->env_id != sys_getenvid())
+		panic("thisenv is %08x, not %08x", thisenv->env_id, sys_getenvid());
+
+	if (child == 0) {
+		play(1);
+		sys_env_destroy(0);
+	}
+
+	play(0);
+	while (turn != 0)
+		sys_futex_wait(&turn, 1, 0);
+	if (counter != 2 * ROUNDS)
+		panic("counter is %d, not %d", counter, 2 * ROUNDS);
+	cprintf("testfutex: OK\n");
+}
@@ -0,0 +1,83 @@
+// Test the hypercall table and batched hypercalls, from inside a guest:
+// the version call, unknown codes, and batches that run to the end,
+// stop at a code that can't be batched, or are longer than allowed.
+
+#include <inc/lib.h>
+#include <inc/vmx.h>
+
+#define UNUSED	0x7ead		// A br_ret no hypercall returns
+
+static struct VmxBatch batch __attribute__((aligned(PGSIZE)));
+
+static int64_t
+hcall(uint64_t code, uint64_t rbx, uint64_t *rbx_store)
+{
+	int64_t r;
+
+	asm volatile("vmcall" : "=a"(r), "=b"(rbx) : "0"(code), "1"(rbx)
+		     : "memory");
+	if (rbx_store)
+		*rbx_store = rbx;
+	return r;
+}
+
+static void
+fill(int n, uint64_t code)
+{
+	int i;
+
+	for (i = 0; i < VMX_BATCH_MAX; i++) {
+		batch.hb_req[i].br_code = code;
+		batch.hb_req[i].br_ret = UNUSED;
+	}
+	batch.hb_count = n;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t codes, pa;
+	int64_t disk, r;
+	int i;
+
+	if ((r = hcall(VMX_VMCALL_VERSION, 0, &codes)) != VMX_VMCALL_ABI)
+		panic("hypercall ABI is %llx, not %x", r, VMX_VMCALL_ABI);
+	if (!(codes & (1ULL << VMX_VMCALL_BATCH)) ||
+	    !(codes & (1ULL << VMX_VMCALL_GETDISKIMGNUM)))
+		panic("hypercalls %llx don't include batching", codes);
+	if ((r = hcall(VMX_VMCALL_NCODES - 1, 0, NULL)) != -E_NO_SYS)
+		panic("unknown hypercall returned %lld", r);
+	disk = hcall(VMX_VMCALL_GETDISKIMGNUM, 0, NULL);
+
+	// Fault the batch page in; the host only takes pages it maps.
+	fill(0, 0);
+	pa = PTE_ADDR(uvpt[PGNUM(&batch)]);
+	if ((r = hcall(VMX_VMCALL_BATCH, pa + 8, NULL)) != -E_INVAL)
+		panic("batch at an unaligned address returned %lld", r);
+
+	// A whole batch, and one claiming more than fits.
+	fill(VMX_BATCH_MAX, VMX_VMCALL_GETDISKIMGNUM);
+	if ((r = hcall(VMX_VMCALL_BATCH, pa, NULL)) != VMX_BATCH_MAX)
+		panic("full batch made %lld hypercalls", r);
+	for (i = 0; i < VMX_BATCH_MAX; i++)
+		if (batch.hb_req[i].br_ret != disk)
+			panic("batched hypercall %d returned %lld, not %lld",
+			      i, batch.hb_req[i].br_ret, disk);
+	fill(VMX_BATCH_MAX + 1, VMX_VMCALL_GETDISKIMGNUM);
+	if ((r = hcall(VMX_VMCALL_BATCH, pa, NULL)) != VMX_BATCH_MAX)
+		panic("oversized batch made %lld hypercalls", r);
+
+	// Batching stops at a code that can't be batched, or isn't one.
+	fill(3, VMX_VMCALL_VERSION);
+	batch.hb_req[1].br_code = VMX_VMCALL_BALLOON_INFLATE;
+	if ((r = hcall(VMX_VMCALL_BATCH, pa, NULL)) != 1 ||
+	    batch.hb_req[0].br_ret != VMX_VMCALL_ABI ||
+	    batch.hb_req[1].br_ret != UNUSED || batch.hb_req[2].br_ret != UNUSED)
+		panic("batch with a balloon inflate made %lld hypercalls", r);
+	fill(2, VMX_VMCALL_VERSION);
+	batch.hb_req[0].br_code = VMX_VMCALL_NCODES;
+	if ((r = hcall(VMX_VMCALL_BATCH, pa, NULL)) != 0 ||
+	    batch.hb_req[1].br_ret != UNUSED)
+		panic("batch with a bad code made %lld hypercalls", r);
+	cprintf("testhcall: OK\n");
+}
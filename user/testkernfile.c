@@ -0,0 +1,128 @@
+// Test that a guest's kernel doesn't change when the file it was loaded
+// from does, from the host: with a guest paused, overwrite every page
+// of text in the kernel file, have vmmanager save the guest, and check
+// that the saved guest's text still reads as the file did before.  The
+// guest maps those pages straight from the file server's block cache
+// (see map_in_guest in user/vmm.c).
+
+#include <inc/lib.h>
+#include <inc/elf.h>
+#include <inc/vmsave.h>
+
+#define KERNFILE	"/vmm/kernel"	// As user/vmm.c loads it
+#define SAVEFILE	"/vmm/testkernfile.sav"
+#define MAXPAGES	1024
+
+static struct {
+	uint64_t gpa;
+	uint32_t sum;
+	bool seen;
+} text[MAXPAGES];
+static int ntext;
+
+static uint8_t page[PGSIZE];
+
+static uint32_t
+sum(const uint8_t *p)
+{
+	uint32_t h = 0;
+	int i;
+
+	for (i = 0; i < PGSIZE; i++)
+		h = h * 31 + p[i];
+	return h;
+}
+
+// Note the sum of each whole page of the text segment ph of the kernel
+// in fd, and overwrite it in the file with its complement.
+static void
+rewrite(int fd, struct Proghdr *ph)
+{
+	off_t off;
+	uint64_t gpa;
+	int i, r;
+
+	// The file offset and the address agree modulo PGSIZE.
+	off = ph->p_offset - PGOFF(ph->p_pa);
+	gpa = ph->p_pa - PGOFF(ph->p_pa);
+	if (PGOFF(off))
+		return;
+	for (; off + PGSIZE <= ph->p_offset + ph->p_filesz && ntext < MAXPAGES;
+	     off += PGSIZE, gpa += PGSIZE) {
+		if ((r = seek(fd, off)) < 0 || (r = readn(fd, page, PGSIZE)) != PGSIZE)
+			panic("read %s: %e", KERNFILE, r);
+		text[ntext].gpa = gpa;
+		text[ntext++].sum = sum(page);
+		for (i = 0; i < PGSIZE; i++)
+			page[i] = ~page[i];
+		if ((r = seek(fd, off)) < 0 || (r = write(fd, page, PGSIZE)) != PGSIZE)
+			panic("write %s: %e", KERNFILE, r);
+	}
+}
+
+// Check the first checkpoint in SAVEFILE against the sums of the text
+// pages.
+static void
+check(void)
+{
+	struct VmSaveHdr hdr;
+	uint64_t gpa;
+	int fd, i, j, r;
+
+	if ((fd = open(SAVEFILE, O_RDONLY)) < 0)
+		panic("open %s: %e", SAVEFILE, fd);
+	if ((r = readn(fd, &hdr, sizeof(hdr))) != sizeof(hdr) ||
+	    hdr.vh_magic != VMSAVE_MAGIC)
+		panic("%s isn't a saved guest", SAVEFILE);
+	for (i = 0; i < hdr.vh_npages; i++) {
+		if ((r = readn(fd, &gpa, sizeof(gpa))) != sizeof(gpa))
+			panic("read %s: %e", SAVEFILE, r);
+		if (gpa & VMSAVE_PAGE_ZERO)
+			continue;
+		if ((r = readn(fd, page, PGSIZE)) != PGSIZE)
+			panic("read %s: %e", SAVEFILE, r);
+		for (j = 0; j < ntext; j++)
+			if (text[j].gpa == gpa) {
+				if (sum(page) != text[j].sum)
+					panic("guest page %llx changed with %s",
+					      gpa, KERNFILE);
+				text[j].seen = true;
+			}
+	}
+	close(fd);
+	for (j = 0; j < ntext; j++)
+		if (!text[j].seen)
+			panic("guest page %llx wasn't saved", text[j].gpa);
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned char elf_buf[512];
+	struct Elf *elf = (struct Elf *) elf_buf;
+	struct Proghdr *ph;
+	envid_t env;
+	int fd, i, r;
+
+	if ((fd = open(KERNFILE, O_RDWR)) < 0)
+		panic("open %s: %e", KERNFILE, fd);
+	if (readn(fd, elf_buf, sizeof(elf_buf)) != sizeof(elf_buf) ||
+	    elf->e_magic != ELF_MAGIC)
+		panic("%s isn't an ELF file", KERNFILE);
+	ph = (struct Proghdr *) (elf_buf + elf->e_phoff);
+	for (i = 0; i < elf->e_phnum; i++, ph++)
+		if (ph->p_type == ELF_PROG_LOAD &&
+		    !(ph->p_flags & ELF_PROG_FLAG_WRITE))
+			rewrite(fd, ph);
+	close(fd);
+	if (ntext == 0)
+		panic("%s has no whole pages of text", KERNFILE);
+	cprintf("testkernfile: rewrote %d pages of %s\n", ntext, KERNFILE);
+
+	if ((env = spawnl("/bin/vmmanager", "vmmanager", "save", "1",
+			  SAVEFILE, (char *) 0)) < 0)
+		panic("spawn vmmanager: %e", env);
+	wait(env);
+	check();
+	cprintf("testkernfile: OK\n");
+}
@@ -0,0 +1,46 @@
+// Test same-page merging, from inside a guest: fill pages with the same
+// contents and wait for a key, while the guest is paused and the host
+// merges them; then each page must still read the same, and a write to
+// one must only change that one.
+
+#include <inc/lib.h>
+
+#define NPAGES	64
+#define BUF	((uint64_t *) 0x10000000)
+#define NWORDS	(PGSIZE / sizeof(uint64_t))
+#define FILL	0x6b736d2074657374ULL
+
+static void
+check(bool written)
+{
+	uint64_t want;
+	int i, j;
+
+	for (i = 0; i < NPAGES; i++)
+		for (j = 0; j < NWORDS; j++) {
+			want = written && j == 0 ? i : FILL ^ j;
+			if (BUF[i * NWORDS + j] != want)
+				panic("page %d word %d is %llx, not %llx", i, j,
+				      BUF[i * NWORDS + j], want);
+		}
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, j, r;
+
+	for (i = 0; i < NPAGES; i++) {
+		if ((r = sys_page_alloc(0, BUF + i * NWORDS, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		for (j = 0; j < NWORDS; j++)
+			BUF[i * NWORDS + j] = FILL ^ j;
+	}
+	cprintf("testksm: filled %d pages, waiting\n", NPAGES);
+	getchar();
+	check(false);
+	for (i = 0; i < NPAGES; i++)
+		BUF[i * NWORDS] = i;
+	check(true);
+	cprintf("testksm: OK\n");
+}
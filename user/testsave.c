@@ -0,0 +1,114 @@
+// Test saving a guest and restoring it, from inside the guest: fill
+// memory and a file, and wait for a key, while the guest is paused,
+// saved and restored by the host.  Afterwards the memory and the file
+// must read the same, and time, timer and disk must still work.
+//
+// "testsave inc" reads another file between a full checkpoint and an
+// incremental one, and waits again.  The host writes that file's block
+// into guest memory itself, so only the host can mark the page written;
+// after the restore the file must still read the same.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES	64
+#define BUF	((uint64_t *) 0x10000000)
+#define NWORDS	(PGSIZE / sizeof(uint64_t))
+#define SAVEFILE	"/testsave"
+#define READFILE	"/lorem"
+#define SLEEP_MSEC	100
+
+static char msg[64];
+
+static void
+check(uint64_t seed)
+{
+	char buf[64];
+	int fd, i, j, n;
+
+	for (i = 0; i < NPAGES; i++)
+		for (j = 0; j < NWORDS; j++)
+			if (BUF[i * NWORDS + j] != (seed ^ (i * NWORDS + j)))
+				panic("page %d word %d is %llx, not %llx", i, j,
+				      BUF[i * NWORDS + j], seed ^ (i * NWORDS + j));
+	if ((fd = open(SAVEFILE, O_RDONLY)) < 0)
+		panic("open %s: %e", SAVEFILE, fd);
+	if ((n = readn(fd, buf, sizeof(buf))) != strlen(msg) ||
+	    memcmp(buf, msg, n) != 0)
+		panic("%s doesn't hold what was written to it", SAVEFILE);
+	close(fd);
+}
+
+static void
+put(void)
+{
+	int fd, r;
+
+	if ((fd = open(SAVEFILE, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", SAVEFILE, fd);
+	if ((r = write(fd, msg, strlen(msg))) != strlen(msg))
+		panic("write %s: %e", SAVEFILE, r);
+	close(fd);
+}
+
+// A checksum of READFILE's contents.
+static uint32_t
+sum(void)
+{
+	char buf[128];
+	uint32_t h = 0;
+	int fd, i, n;
+
+	if ((fd = open(READFILE, O_RDONLY)) < 0)
+		panic("open %s: %e", READFILE, fd);
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		for (i = 0; i < n; i++)
+			h = h * 31 + (uint8_t) buf[i];
+	if (n < 0)
+		panic("read %s: %e", READFILE, n);
+	close(fd);
+	return h;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t seed = read_tsc();
+	uint32_t before, start, h;
+	volatile uint32_t word = 0;
+	int i, j, r;
+
+	for (i = 0; i < NPAGES; i++) {
+		if ((r = sys_page_alloc(0, BUF + i * NWORDS, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		for (j = 0; j < NWORDS; j++)
+			BUF[i * NWORDS + j] = seed ^ (i * NWORDS + j);
+	}
+	snprintf(msg, sizeof(msg), "testsave %llx\n", seed);
+	put();
+	check(seed);
+	before = sys_time_msec();
+	cprintf("testsave: filled %d pages and %s, waiting\n", NPAGES, SAVEFILE);
+	getchar();
+	if (argc > 1 && strcmp(argv[1], "inc") == 0) {
+		h = sum();
+		cprintf("testsave: read %s, waiting\n", READFILE);
+		getchar();
+		if (sum() != h)
+			panic("%s doesn't read the same after the restore",
+			      READFILE);
+	}
+
+	check(seed);
+	if (sys_time_msec() < before)
+		panic("time went back from %u to %u", before, sys_time_msec());
+	start = sys_time_msec();
+	if ((r = sys_futex_wait(&word, 0, SLEEP_MSEC)) != -E_TIMEOUT)
+		panic("sleeping with a timeout: %e", r);
+	if (sys_time_msec() - start < SLEEP_MSEC)
+		panic("the timer woke us early");
+	snprintf(msg, sizeof(msg), "testsave %llx again\n", seed);
+	put();
+	check(seed);
+	cprintf("testsave: OK\n");
+}
@@ -0,0 +1,48 @@
+// Test a guest's emulated local APIC, from inside the guest: its timer
+// must preempt a thread that never yields, keep time, and wake a
+// thread sleeping with a timeout.  Run it from the guest's shell.
+
+#include <inc/lib.h>
+
+#define SLEEP_MSEC	200
+#define LIMIT_MSEC	5000
+
+volatile uint32_t spins;
+volatile uint32_t stop;
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t seen, start, waited;
+	envid_t child;
+	int r;
+
+	if ((child = sfork()) < 0)
+		panic("sfork: %e", child);
+	if (child == 0) {
+		// Never yields: with one vCPU, only a timer interrupt lets
+		// the parent run again.
+		while (!stop)
+			spins++;
+		sys_env_destroy(0);
+	}
+
+	// Neither does the parent, so the child only runs if the timer
+	// takes the CPU away from it.
+	seen = spins;
+	start = sys_time_msec();
+	while (spins == seen)
+		if (sys_time_msec() - start > LIMIT_MSEC)
+			panic("the timer never preempted the parent");
+	stop = 1;
+	wait(child);
+
+	// Sleep on a word nobody changes; only the timer ends the wait.
+	start = sys_time_msec();
+	if ((r = sys_futex_wait(&stop, 1, SLEEP_MSEC)) != -E_TIMEOUT)
+		panic("sleeping with a timeout: %e", r);
+	waited = sys_time_msec() - start;
+	if (waited < SLEEP_MSEC || waited > LIMIT_MSEC)
+		panic("slept %u ms, not %u", waited, SLEEP_MSEC);
+	cprintf("testvlapic: OK\n");
+}
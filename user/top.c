@@ -0,0 +1,25 @@
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	struct EnvStat st;
+	uint64_t nsys;
+	int i, j;
+
+	printf("envid    type status       runs  Mcycles syscalls pgfaults  ipc-out   ipc-in  vmexits    pages\n");
+	for (i = 0; i < NENV; i++) {
+		if (envs[i].env_status == ENV_FREE)
+			continue;
+		if (sys_env_stat(envs[i].env_id, &st) < 0)
+			continue;
+		nsys = 0;
+		for (j = 0; j < NSYSCALLS; j++)
+			nsys += st.es_syscalls[j];
+		printf("%08x %4d %-8s %8u %8llu %8llu %8llu %8u %8u %8llu %8u\n",
+		       envs[i].env_id, envs[i].env_type, env_status_names[envs[i].env_status],
+		       envs[i].env_runs, st.es_cycles / 1000000, nsys,
+		       st.es_pgfaults, st.es_ipc_sent, st.es_ipc_recv,
+		       st.es_vmexits, st.es_resident);
+	}
+}
@@ -3,23 +3,56 @@
 #include <inc/elf.h>
 #include <inc/ept.h>
 #include <inc/stdio.h>
+#include <inc/vblk.h>
+#include <inc/vmsave.h>
 
 #define GUEST_KERN "/vmm/kernel"
 #define GUEST_BOOT "/vmm/boot"
 
 #define JOS_ENTRY 0x7000
 
+// Where the block backend maps the guest's ring and, one page at a
+// time, its buffers.
+#define VBLK_RING_VA (UTEMP + PGSIZE)
+#define VBLK_BUF_VA (UTEMP + 2 * PGSIZE)
+// How often the backend checks whether its guest is still alive, and
+// for a request to save it.
+#define VBLK_POLL_MSEC 1000
+// Where vm_save maps the guest's pages to read them.
+#define VMSAVE_VA (UTEMP + 3 * PGSIZE)
+// Pages map_in_guest stages at UTEMP per sys_ept_map_range call.
+#define MAP_BATCH 32
+
+#ifndef VMM_GUEST
+// The guest's disk: the clean image, read-only, under an overlay file
+// holding the sectors the guest has written, so that starting a guest
+// doesn't mean copying the whole image first.  The bitmap of written
+// sectors is kept in a map file too.
+struct Vdisk {
+	int vd_base;
+	int vd_over;
+	int vd_map;
+	uint8_t vd_written[VDISK_MAXSECTS / 8];
+};
+
+static struct Vdisk vdisk;
+#endif
+
 // Map a region of file fd into the guest at guest physical address gpa.
 // The file region to map should start at fileoffset and be length filesz.
 // The region to map in the guest should be memsz.  The region can span multiple pages.
 //
 // Return 0 on success, <0 on failure.
 //
-// Hint: Call sys_ept_map() for mapping page. 
+// Whole pages of the file that start at a page boundary of it go into
+// the guest straight from the file server's block cache, copy-on-write,
+// with one IPC and no copy each.  The rest is staged MAP_BATCH pages
+// at a time at UTEMP and handed to the guest with one
+// sys_ept_map_range() per batch.
 static int
 map_in_guest( envid_t guest, uintptr_t gpa, size_t memsz, 
 	      int fd, size_t filesz, off_t fileoffset ) {
-	int i, ret;
+	int i, j, n, ret;
 
 	i = PGOFF(gpa);
 	// if the provided guest physical address is not page-aligned, 
@@ -31,34 +64,49 @@ map_in_guest( envid_t guest, uintptr_t gpa, size_t memsz,
 		fileoffset -= i;
 	}
 
-	// walk through the provided region page by page and copy in the file contents
-	// the the physical memory region of the guest
-	for (i = 0; i < memsz; i += PGSIZE) {
-		// allocate a temporary page
-		ret = sys_page_alloc(0, UTEMP, PTE_P | PTE_U | PTE_W);
-		if (ret < 0) {
-			sys_page_unmap(0, UTEMP);
-			return ret;
-		}
-		// seek to the location to write the file contents at
-		ret = seek(fd, fileoffset + i);
-		if (ret < 0) {
-			sys_page_unmap(0, UTEMP);
-			return ret;
+	// Only pages all of file data can be shared; the rest of a page
+	// partly past filesz, or past the end of the file, must be zeros.
+	while (PGOFF(fileoffset) == 0 && filesz >= PGSIZE) {
+		if ((ret = file_map(fd, fileoffset, UTEMP)) < PGSIZE) {
+			if (ret >= 0)
+				sys_page_unmap(0, UTEMP);
+			break;
 		}
-		// read file contents into the mapped page
-		ret = readn(fd, UTEMP, MIN(PGSIZE, filesz-i));
-		if (ret < 0) {
-			sys_page_unmap(0, UTEMP);
+		ret = sys_ept_map(0, UTEMP, guest, (void *) gpa,
+				  __EPTE_FULL | EPT_MAP_COW);
+		sys_page_unmap(0, UTEMP);
+		if (ret < 0)
 			return ret;
+		gpa += PGSIZE;
+		memsz -= PGSIZE;
+		filesz -= PGSIZE;
+		fileoffset += PGSIZE;
+	}
+
+	// walk through the provided region a batch at a time and copy in
+	// the file contents to the physical memory region of the guest
+	for (i = 0; i < memsz; i += n * PGSIZE) {
+		n = MIN(MAP_BATCH, ROUNDUP(memsz - i, PGSIZE) / PGSIZE);
+		// allocate temporary pages
+		for (j = 0; j < n; j++)
+			if ((ret = sys_page_alloc(0, UTEMP + j * PGSIZE,
+						  PTE_P | PTE_U | PTE_W)) < 0)
+				goto out;
+		// read file contents into the mapped pages
+		if (i < filesz) {
+			if ((ret = seek(fd, fileoffset + i)) < 0)
+				goto out;
+			if ((ret = readn(fd, UTEMP, MIN(n * PGSIZE, filesz - i))) < 0)
+				goto out;
 		}
-		// map the page in the EPT
-		ret = sys_ept_map(0, UTEMP, guest, (void*) (gpa + i), __EPTE_FULL);
-		if (ret < 0) {
-			sys_page_unmap(0, UTEMP);
+		// map the pages in the EPT
+		ret = sys_ept_map_range(UTEMP, guest, (void*) (gpa + i),
+					n * PGSIZE, __EPTE_FULL);
+	out:
+		for (j = 0; j < n; j++)
+			sys_page_unmap(0, UTEMP + j * PGSIZE);
+		if (ret < 0)
 			return ret;
-		}
-		sys_page_unmap(0, UTEMP);
 	}
 
 	return 0;
@@ -120,56 +168,567 @@ copy_guest_kern_gpa( envid_t guest, char* fname ) {
 	return 0;
 }
 
-void
-umain(int argc, char **argv) {
-	int ret;
+// Make a guest and load its kernel and boot loader.
+//
+// Return the guest's envid, or <0 on error.
+static envid_t
+make_guest(int prefault) {
 	envid_t guest;
-	char filename_buffer[50];	//buffer to save the path 
-	int vmdisk_number;
-	int r;
-	if ((ret = sys_env_mkguest( GUEST_MEM_SZ, JOS_ENTRY )) < 0) {
+	int fd, ret;
+
+	if ((ret = sys_env_mkguest( GUEST_MEM_SZ, JOS_ENTRY, prefault )) < 0) {
 		cprintf("Error creating a guest OS env: %e\n", ret );
-		exit();
+		return ret;
 	}
 	guest = ret;
 
 	// Copy the guest kernel code into guest phys mem.
 	if((ret = copy_guest_kern_gpa(guest, GUEST_KERN)) < 0) {
 		cprintf("Error copying page into the guest - %d\n.", ret);
-		exit();
+		return ret;
 	}
 
 	// Now copy the bootloader.
-	int fd;
 	if ((fd = open( GUEST_BOOT, O_RDONLY)) < 0 ) {
 		cprintf("open %s for read: %e\n", GUEST_BOOT, fd );
-		exit();
+		return fd;
 	}
 
 	// sizeof(bootloader) < 512.
-	if ((ret = map_in_guest(guest, JOS_ENTRY, 512, fd, 512, 0)) < 0) {
+	ret = map_in_guest(guest, JOS_ENTRY, 512, fd, 512, 0);
+	close(fd);
+	if (ret < 0) {
 		cprintf("Error mapping bootloader into the guest - %d\n.", ret);
+		return ret;
+	}
+	return guest;
+}
+
+#ifndef VMM_GUEST
+// A snapshot of a freshly loaded guest with the given prefault policy
+// that this vmm may clone, or 0.  Only a snapshot's parent may clone it,
+// so one left by another vmm doesn't count.
+static envid_t
+find_snapshot(int prefault) {
+	int i;
+
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_type == ENV_TYPE_GUEST &&
+		    envs[i].env_status != ENV_FREE &&
+		    envs[i].env_parent_id == thisenv->env_id &&
+		    envs[i].env_vmxinfo.snapshot &&
+		    envs[i].env_vmxinfo.prefault == prefault)
+			return envs[i].env_id;
+	return 0;
+}
+
+static bool
+vdisk_written(struct Vdisk *d, uint32_t secno)
+{
+	return secno < VDISK_MAXSECTS &&
+		(d->vd_written[secno / 8] & (1 << (secno % 8)));
+}
+
+// Read nsecs sectors from secno of disk d into buf, each from the
+// overlay if the guest has written it and otherwise from the base
+// image, in runs from the same file.
+static int
+vdisk_read(struct Vdisk *d, uint32_t secno, uint32_t nsecs, char *buf)
+{
+	uint32_t i, j;
+	bool over;
+	int fd, r;
+
+	for (i = 0; i < nsecs; i = j) {
+		over = vdisk_written(d, secno + i);
+		for (j = i + 1; j < nsecs && vdisk_written(d, secno + j) == over; j++)
+			;
+		fd = over ? d->vd_over : d->vd_base;
+		if ((r = seek(fd, (secno + i) * VBLK_SECTSIZE)) < 0)
+			return r;
+		if ((r = readn(fd, buf + i * VBLK_SECTSIZE,
+			       (j - i) * VBLK_SECTSIZE)) < 0)
+			return r;
+		if (r != (j - i) * VBLK_SECTSIZE)
+			return -E_EOF;
+	}
+	return 0;
+}
+
+// Write nsecs sectors from buf at secno of disk d, to its overlay.
+static int
+vdisk_write(struct Vdisk *d, uint32_t secno, uint32_t nsecs, char *buf)
+{
+	size_t len = nsecs * VBLK_SECTSIZE;
+	uint32_t i, first, last;
+	bool grown = false;
+	int r, w;
+
+	if (secno + nsecs > VDISK_MAXSECTS || nsecs == 0)
+		return -E_INVAL;
+	if ((r = seek(d->vd_over, secno * VBLK_SECTSIZE)) < 0)
+		return r;
+	for (r = 0; r < len; r += w)
+		if ((w = write(d->vd_over, buf + r, len - r)) <= 0)
+			return w < 0 ? w : -E_EOF;
+	for (i = secno; i < secno + nsecs; i++) {
+		grown |= !vdisk_written(d, i);
+		d->vd_written[i / 8] |= 1 << (i % 8);
+	}
+	if (!grown)
+		return 0;
+	first = secno / 8;
+	last = (secno + nsecs - 1) / 8;
+	if ((r = seek(d->vd_map, first)) < 0)
+		return r;
+	if ((r = write(d->vd_map, &d->vd_written[first], last - first + 1)) < 0)
+		return r;
+	return 0;
+}
+
+// Open disk number n for a new guest, with nothing written yet.
+static int
+vdisk_open(struct Vdisk *d, int n)
+{
+	char path[50];
+
+	memset(d->vd_written, 0, sizeof(d->vd_written));
+	if ((d->vd_base = open("vmm/clean-fs.img", O_RDONLY)) < 0)
+		return d->vd_base;
+	snprintf(path, sizeof(path), "/vmm/fs%d.img", n);
+	if ((d->vd_over = open(path, O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		return d->vd_over;
+	snprintf(path, sizeof(path), "/vmm/fs%d.map", n);
+	if ((d->vd_map = open(path, O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		return d->vd_map;
+	return 0;
+}
+
+// Carry out one block request from the guest against disk d.
+static int
+vblk_do(envid_t guest, struct Vdisk *d, struct VblkReq *req)
+{
+	size_t len, off, n = req->vr_nsecs * VBLK_SECTSIZE;
+	uint32_t secno;
+	int i, r;
+
+	if ((req->vr_op != VBLK_READ && req->vr_op != VBLK_WRITE)
+	    || n > VBLK_SEGS * PGSIZE)
+		return -E_INVAL;
+	for (i = 0, off = 0; off < n; i++, off += PGSIZE) {
+		len = MIN(PGSIZE, n - off);
+		secno = req->vr_secno + off / VBLK_SECTSIZE;
+		// Only a read writes guest memory, and marks it written.
+		if ((r = sys_guest_page_map(guest, (void *) req->vr_seg[i],
+					    VBLK_BUF_VA, PTE_P|PTE_U|
+					    (req->vr_op == VBLK_READ ? PTE_W : 0))) < 0)
+			return r;
+		if (req->vr_op == VBLK_READ)
+			r = vdisk_read(d, secno, len / VBLK_SECTSIZE, VBLK_BUF_VA);
+		else
+			r = vdisk_write(d, secno, len / VBLK_SECTSIZE, VBLK_BUF_VA);
+		sys_page_unmap(0, VBLK_BUF_VA);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+static int
+save_write(int fd, const void *buf, size_t n)
+{
+	size_t off;
+	int w;
+
+	for (off = 0; off < n; off += w)
+		if ((w = write(fd, (const char *) buf + off, n - off)) <= 0)
+			return w < 0 ? w : -E_NO_DISK;
+	return 0;
+}
+
+// Find the end of the checkpoints in save file fd, leaving the last
+// one's header in *hdr.  Return the offset, or <0 on error.
+static off_t
+save_end(int fd, struct VmSaveHdr *hdr)
+{
+	off_t pos = 0;
+	uint32_t seq;
+	int r;
+
+	for (seq = 0; ; seq++) {
+		if ((r = seek(fd, pos)) < 0)
+			return r;
+		if ((r = readn(fd, hdr, sizeof(*hdr))) == 0 && seq > 0)
+			return pos;
+		if (r != sizeof(*hdr) || hdr->vh_magic != VMSAVE_MAGIC ||
+		    hdr->vh_seq != seq)
+			return r < 0 ? r : -E_INVAL;
+		pos += sizeof(*hdr) +
+			hdr->vh_npages * (sizeof(uint64_t) + PGSIZE) +
+			hdr->vh_nsects * (sizeof(uint32_t) + VBLK_SECTSIZE);
+	}
+}
+
+// Append the sectors the guest has written to disk d to save file fd,
+// counting them in hdr.
+static int
+save_disk(int fd, struct Vdisk *d, struct VmSaveHdr *hdr)
+{
+	char sect[VBLK_SECTSIZE];
+	uint32_t secno;
+	int r;
+
+	for (secno = 0; secno < VDISK_MAXSECTS; secno++) {
+		if (!vdisk_written(d, secno))
+			continue;
+		if ((r = vdisk_read(d, secno, 1, sect)) < 0 ||
+		    (r = save_write(fd, &secno, sizeof(secno))) < 0 ||
+		    (r = save_write(fd, sect, sizeof(sect))) < 0)
+			return r;
+		hdr->vh_nsects++;
+	}
+	return 0;
+}
+
+// Save guest, paused, with its disk in d to the file at path (see
+// inc/vmsave.h): all of it, or, if incremental, only what changed since
+// the last checkpoint in the file.
+static int
+vm_save(envid_t guest, struct Vdisk *d, const char *path, bool incremental)
+{
+	static struct VmSaveHdr hdr;
+	static uint8_t dirty[GUEST_MEM_SZ / PGSIZE / 8];
+	const volatile struct Env *e;
+	struct VmxMemScan ms;
+	uint64_t gpa, rec;
+	off_t start = 0;
+	bool scanned;
+	int fd, i, j, r;
+
+	e = &envs[ENVX(guest)];
+	if ((fd = open(path, incremental ? O_RDWR : O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		return fd;
+	if (incremental) {
+		if ((r = start = save_end(fd, &hdr)) < 0)
+			goto out;
+		// The dirty bits must go back to the last checkpoint.
+		if (hdr.vh_guest != guest || !hdr.vh_scan_tsc ||
+		    hdr.vh_scan_tsc != e->env_vmxinfo.mem_scan_tsc) {
+			r = -E_INVAL;
+			goto out;
+		}
+		hdr.vh_seq++;
+	} else
+		hdr.vh_seq = 0;
+	hdr.vh_magic = VMSAVE_MAGIC;
+	hdr.vh_guest = guest;
+	hdr.vh_npages = hdr.vh_nsects = 0;
+	if ((r = sys_vmx_state_get(guest, &hdr.vh_state)) < 0)
+		goto out;
+	// Clear the dirty bits for the next checkpoint, noting the pages
+	// written since the last one.  Without them every save is full.
+	memset(dirty, 0, sizeof(dirty));
+	r = sys_vmx_mem_scan(guest, dirty, &ms);
+	if (r < 0 && (incremental || r != -E_NOT_SUPP))
+		goto out;
+	scanned = r == 0;
+	hdr.vh_scan_tsc = scanned ? e->env_vmxinfo.mem_scan_tsc : 0;
+
+	// The header goes first, but is written again once the records
+	// are counted.
+	if ((r = seek(fd, start)) < 0 ||
+	    (r = save_write(fd, &hdr, sizeof(hdr))) < 0)
+		goto out;
+	for (gpa = 0; gpa < hdr.vh_state.ss_phys_sz; gpa += PGSIZE) {
+		i = gpa / PGSIZE;
+		if (incremental && !(dirty[i / 8] & (1 << (i % 8))))
+			continue;
+		// Pages the guest never touched aren't backed.
+		if (sys_guest_page_map(guest, (void *) gpa, VMSAVE_VA, PTE_P|PTE_U) < 0)
+			continue;
+		rec = gpa;
+		for (j = 0; j < PGSIZE / sizeof(uint64_t); j++)
+			if (((uint64_t *) VMSAVE_VA)[j])
+				break;
+		if (j == PGSIZE / sizeof(uint64_t)) {
+			rec |= VMSAVE_PAGE_ZERO;
+			if (!incremental)
+				continue;
+		}
+		if ((r = save_write(fd, &rec, sizeof(rec))) < 0 ||
+		    (!(rec & VMSAVE_PAGE_ZERO) &&
+		     (r = save_write(fd, VMSAVE_VA, PGSIZE)) < 0))
+			goto out;
+		hdr.vh_npages++;
+	}
+	if ((r = save_disk(fd, d, &hdr)) < 0 ||
+	    (r = seek(fd, start)) < 0 ||
+	    (r = save_write(fd, &hdr, sizeof(hdr))) < 0)
+		goto out;
+	cprintf("Saved checkpoint %u of the guest to %s: %u pages, %u sectors%s\n",
+		hdr.vh_seq, path, hdr.vh_npages, hdr.vh_nsects,
+		scanned ? "" : " (no dirty tracking, saves are all full)");
+out:
+	sys_page_unmap(0, VMSAVE_VA);
+	close(fd);
+	return r;
+}
+
+
+// Carry out a "vmmanager save" request for guest, with its disk in d,
+// if there is one and the guest is paused (see inc/vmsave.h).
+static void
+save_poll(envid_t guest, struct Vdisk *d)
+{
+	static struct VmSaveReq req;
+	const volatile struct Env *e = &envs[ENVX(guest)];
+	char path[50];
+	int fd;
+
+	if (!e->env_vmxinfo.state_saved)
+		return;
+	snprintf(path, sizeof(path), "/vmm/save%d.req", e->env_vmxinfo.vdisk);
+	if ((fd = open(path, O_RDWR)) < 0)
+		return;
+	if (readn(fd, &req, sizeof(req)) == sizeof(req) &&
+	    req.sr_result == VMSAVE_PENDING) {
+		req.sr_path[MAXPATHLEN - 1] = 0;
+		req.sr_result = vm_save(guest, d, req.sr_path,
+					req.sr_incremental);
+		if (seek(fd, 0) >= 0)
+			save_write(fd, &req, sizeof(req));
+	}
+	close(fd);
+}
+
+// Serve the guest's paravirtual block ring (see inc/vblk.h) from disk
+// d, until the guest goes away.
+static void
+vblk_serve(envid_t guest, struct Vdisk *d)
+{
+	struct VblkRing *ring = (struct VblkRing *) VBLK_RING_VA;
+	const volatile struct Env *e = &envs[ENVX(guest)];
+	uint32_t gpa, avail;
+	int r;
+
+	// The guest's file server announces its ring when it starts, which
+	// wakes us (see vmcall_vblksetup).  A restored guest's was
+	// announced before it was saved.  Meanwhile the guest may be saved,
+	// or go away.
+	while (!(gpa = e->env_vmxinfo.vblk_ring)) {
+		if (e->env_id != guest || e->env_status == ENV_FREE)
+			return;
+		sys_futex_wait((const uint32_t *) &e->env_vmxinfo.vblk_ring, 0,
+			       VBLK_POLL_MSEC);
+		save_poll(guest, d);
+	}
+	if ((r = sys_guest_page_map(guest, (void *) (uint64_t) gpa, ring,
+				    PTE_P|PTE_U|PTE_W)) < 0) {
+		cprintf("vblk: mapping ring at %08x: %e\n", gpa, r);
+		return;
+	}
+
+	while (e->env_id == guest && e->env_status != ENV_FREE) {
+		avail = ring->vb_avail;
+		if (ring->vb_used == avail) {
+			sys_futex_wait(&ring->vb_avail, avail, VBLK_POLL_MSEC);
+			save_poll(guest, d);
+			continue;
+		}
+		// Complete the whole batch, then wake the guest once.
+		while (ring->vb_used != avail) {
+			struct VblkReq *req = &ring->vb_req[ring->vb_used % VBLK_RING_SIZE];
+			req->vr_status = vblk_do(guest, d, req);
+			ring->vb_used++;
+		}
+		sys_futex_wake(&ring->vb_used, 1);
+	}
+
+	sys_page_unmap(0, ring);
+}
+
+// Make a new guest from the checkpoints in the file at path (see
+// inc/vmsave.h), with its disk in d.  The guest isn't runnable yet.
+//
+// Return the guest's envid, or <0 on error.
+static envid_t
+restore_guest(const char *path, struct Vdisk *d)
+{
+	// Where in the file the latest copy of each page is, or 0.
+	static off_t page_pos[GUEST_MEM_SZ / PGSIZE];
+	static struct VmSaveHdr hdr;
+	char sect[VBLK_SECTSIZE];
+	envid_t guest = 0;
+	uint64_t gpa, pa, i;
+	uint32_t j, secno;
+	off_t pos = 0;
+	int fd, r;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return fd;
+	for (j = 0; ; j++) {
+		// At the end of the file, hdr is still the latest
+		// checkpoint's.
+		if ((r = seek(fd, pos)) < 0 ||
+		    (r = readn(fd, &hdr, sizeof(hdr))) == 0)
+			break;
+		if (r != sizeof(hdr) || hdr.vh_magic != VMSAVE_MAGIC ||
+		    hdr.vh_seq != j ||
+		    hdr.vh_state.ss_phys_sz > GUEST_MEM_SZ) {
+			r = r < 0 ? r : -E_INVAL;
+			goto out;
+		}
+		pos += sizeof(hdr);
+		if (j == 0) {
+			if ((r = sys_env_mkguest(hdr.vh_state.ss_phys_sz,
+						 hdr.vh_state.ss_tf.tf_rip,
+						 hdr.vh_state.ss_prefault)) < 0)
+				goto out;
+			guest = r;
+			if ((r = vdisk_open(d, envs[ENVX(guest)].env_vmxinfo.vdisk)) < 0)
+				goto out;
+		}
+		// Note where each page is; they are mapped at the end, once
+		// it is known which copy is the latest.
+		for (i = 0; i < hdr.vh_npages; i++) {
+			if ((r = readn(fd, &gpa, sizeof(gpa))) != sizeof(gpa)) {
+				r = r < 0 ? r : -E_INVAL;
+				goto out;
+			}
+			pa = gpa & ~(uint64_t) VMSAVE_PAGE_ZERO;
+			if (PGOFF(pa) || pa >= hdr.vh_state.ss_phys_sz) {
+				r = -E_INVAL;
+				goto out;
+			}
+			pos += sizeof(gpa);
+			if (gpa & VMSAVE_PAGE_ZERO)
+				page_pos[pa / PGSIZE] = 0;
+			else {
+				page_pos[pa / PGSIZE] = pos;
+				pos += PGSIZE;
+				if ((r = seek(fd, pos)) < 0)
+					goto out;
+			}
+		}
+		for (i = 0; i < hdr.vh_nsects; i++) {
+			if ((r = readn(fd, &secno, sizeof(secno))) != sizeof(secno) ||
+			    (r = readn(fd, sect, sizeof(sect))) != sizeof(sect)) {
+				r = r < 0 ? r : -E_INVAL;
+				goto out;
+			}
+			pos += sizeof(secno) + sizeof(sect);
+			if ((r = vdisk_write(d, secno, 1, sect)) < 0)
+				goto out;
+		}
+	}
+	if (r < 0 || !guest) {
+		r = r < 0 ? r : -E_INVAL;
+		goto out;
+	}
+
+	for (i = 0; i < hdr.vh_state.ss_phys_sz / PGSIZE; i++)
+		if (page_pos[i] &&
+		    (r = map_in_guest(guest, i * PGSIZE, PGSIZE, fd, PGSIZE,
+				      page_pos[i])) < 0)
+			goto out;
+	if ((r = sys_vmx_state_set(guest, &hdr.vh_state)) < 0)
+		goto out;
+	close(fd);
+	return guest;
+
+out:
+	close(fd);
+	if (guest)
+		sys_env_destroy(guest);
+	return r;
+}
+#endif
+
+void
+umain(int argc, char **argv) {
+	int ret;
+	envid_t guest;
+	int vmdisk_number;
+	int prefault = VMX_PREFAULT_NONE;
+	int ncpu = 1, i;
+
+#ifndef VMM_GUEST
+	// vmm restore file: carry on with a guest saved by vmmanager.
+	if (argc > 2 && strcmp(argv[1], "restore") == 0) {
+		if ((guest = restore_guest(argv[2], &vdisk)) < 0) {
+			cprintf("Error restoring a guest from %s: %e\n", argv[2], guest);
+			exit();
+		}
+		cprintf("Restored a guest from %s, with its disk at /vmm/fs%d.img\n",
+			argv[2], envs[ENVX(guest)].env_vmxinfo.vdisk);
+		sys_env_set_status(guest, ENV_RUNNABLE);
+		vblk_serve(guest, &vdisk);
+		wait(guest);
+		return;
+	}
+#endif
+	// vmm [none|eager|background] [ncpu]: when to back guest RAM, and
+	// how many vCPUs the guest gets.
+	if (argc > 1) {
+		if (strcmp(argv[1], "eager") == 0)
+			prefault = VMX_PREFAULT_EAGER;
+		else if (strcmp(argv[1], "background") == 0)
+			prefault = VMX_PREFAULT_BACKGROUND;
+		else if (strcmp(argv[1], "none") != 0) {
+			cprintf("usage: vmm [none|eager|background] [ncpu]\n");
+			exit();
+		}
+	}
+	if (argc > 2 && (ncpu = strtol(argv[2], 0, 0)) < 1) {
+		cprintf("usage: vmm [none|eager|background] [ncpu]\n");
 		exit();
 	}
+#ifndef VMM_GUEST
+	// Clone a guest this vmm loaded before if there is one, rather
+	// than reading the kernel in again.
+	envid_t snap = find_snapshot(prefault);
+
+	if (snap && (ret = sys_vmx_clone(snap)) >= 0) {
+		guest = ret;
+		cprintf("Cloned guest %x from snapshot %x\n", guest, snap);
+	} else {
+		if ((guest = make_guest(prefault)) < 0)
+			exit();
+		// Only a guest with one vCPU can be snapshotted.
+		if ((ret = sys_vmx_snapshot(guest)) < 0)
+			cprintf("Not keeping a snapshot of the guest: %e\n", ret);
+		else
+			cprintf("Keeping snapshot %x of guest %x\n", ret, guest);
+	}
+#else
+	if ((guest = make_guest(prefault)) < 0)
+		exit();
+#endif
+
+	// The other vCPUs wait for the guest's boot vCPU to start them.
+	for (i = 1; i < ncpu; i++)
+		if ((ret = sys_env_mkvcpu(guest)) < 0) {
+			cprintf("Error adding vCPU %d to the guest: %e\n", i, ret);
+			exit();
+		}
+
 #ifndef VMM_GUEST	
-	sys_vmx_incr_vmdisk_number();	//increase the vmdisk number
-	//create a new guest disk image
-	
-	vmdisk_number = sys_vmx_get_vmdisk_number();
-	snprintf(filename_buffer, 50, "/vmm/fs%d.img", vmdisk_number);
+	//create a new guest disk, an overlay on the clean image, under
+	//the number the kernel gave the guest
+	vmdisk_number = envs[ENVX(guest)].env_vmxinfo.vdisk;
 	
 	cprintf("Creating a new virtual HDD at /vmm/fs%d.img\n", vmdisk_number);
-        r = copy("vmm/clean-fs.img", filename_buffer);
-        
-        if (r < 0) {
-        	cprintf("Create new virtual HDD failed: %e\n", r);
-        	exit();
-        }
-        
-        cprintf("Create VHD finished\n");
+	if ((ret = vdisk_open(&vdisk, vmdisk_number)) < 0) {
+		cprintf("Create new virtual HDD failed: %e\n", ret);
+		exit();
+	}
 #endif
 	// Mark the guest as runnable.
 	sys_env_set_status(guest, ENV_RUNNABLE);
+#ifndef VMM_GUEST
+	// Act as the guest's block device for as long as it lives.
+	vblk_serve(guest, &vdisk);
+#endif
 	wait(guest);
 }
 
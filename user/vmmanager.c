@@ -1,11 +1,230 @@
 #line 2 "../user/vmmanager.c"
 #ifndef VMM_GUEST
 #include <inc/lib.h>
+#include <inc/vblk.h>
+#include <inc/vmsave.h>
+
+static const char *exit_names[VMX_EXIT_NREASONS] = {
+	[0x00] = "exception/nmi",
+	[0x01] = "external int",
+	[0x02] = "triple fault",
+	[0x07] = "interrupt window",
+	[0x0A] = "cpuid",
+	[0x0C] = "hlt",
+	[0x12] = "vmcall",
+	[0x1C] = "mov cr",
+	[0x1E] = "i/o instruction",
+	[0x1F] = "rdmsr",
+	[0x20] = "wrmsr",
+	[0x21] = "entry fail guest",
+	[0x30] = "ept violation",
+	[0x31] = "ept misconfig",
+	[0x34] = "preempt timer",
+};
+
+static const char *vmcall_names[VMX_VMCALL_NCODES] = {
+	[0x1] = "mbmap",
+	[0x2] = "ipcsend",
+	[0x3] = "ipcrecv",
+	[0x4] = "lapiceoi",
+	[0x5] = "backtohost",
+	[0x6] = "getdiskimgnum",
+	[0x7] = "alloc_cpu",
+	[0x8] = "guest_yield",
+	[0x9] = "cpunum",
+	[0xa] = "vblksetup",
+	[0xb] = "vblkkick",
+	[0xc] = "balloon_target",
+	[0xd] = "balloon_inflate",
+	[0xe] = "balloon_deflate",
+	[0xf] = "vconssetup",
+	[0x10] = "vconskick",
+	[0x11] = "version",
+	[0x12] = "batch",
+};
+
+// Return an upper bound on the cycles taken by the fraction pct of
+// the exits in xs, from its histogram.
+static uint64_t
+hist_pct(const struct VmxExitStat *xs, int pct)
+{
+	uint64_t seen = 0;
+	int b;
+
+	for (b = 0; b < VMX_HIST_BUCKETS - 1; b++) {
+		seen += xs->xs_hist[b];
+		if (seen * 100 >= xs->xs_count * pct)
+			break;
+	}
+	return 1ULL << (VMX_HIST_MIN_SHIFT + b);
+}
+
+static void
+print_stats(const char *what, const char **names, const struct VmxExitStat *xs,
+	    int n, uint64_t total)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!xs[i].xs_count)
+			continue;
+		printf("  %-8s %2x %-16s %8llu %10llu %3llu%% %8llu %8llu %8llu %10llu\n",
+		       what, i, names[i] ? names[i] : "?", xs[i].xs_count,
+		       xs[i].xs_cycles / 1000, xs[i].xs_cycles * 100 / total,
+		       xs[i].xs_cycles / xs[i].xs_count,
+		       hist_pct(&xs[i], 50), hist_pct(&xs[i], 99),
+		       xs[i].xs_blocked / 1000);
+	}
+}
+
+// Print where each guest's VM exits go: per exit reason, and per vmcall
+// code, how many there were, how long they took to handle, and how long
+// the guest was blocked after them.
+static void
+vm_stats(void)
+{
+	static struct VmxStats vs;
+	uint64_t total;
+	int i, j, r;
+
+	for (i = 0; i < NENV; i++) {
+		if (envs[i].env_type != ENV_TYPE_GUEST ||
+		    envs[i].env_status == ENV_FREE)
+			continue;
+		if ((r = sys_vmx_exit_stats(envs[i].env_id, &vs)) < 0)
+			continue;
+		total = 0;
+		for (j = 0; j < VMX_EXIT_NREASONS; j++)
+			total += vs.vs_exit[j].xs_cycles;
+		printf("[%08x] %llu Mcycles in exits\n", envs[i].env_id,
+		       total / 1000000);
+		// Same-page merging and the balloon are counted for the
+		// guest as a whole.
+		if (envs[i].env_vmxinfo.vcpu_id == 0)
+			printf("  %u pages shared, %u merged in all, %u ballooned (target %u)\n",
+			       envs[i].env_vmxinfo.ksm_shared,
+			       envs[i].env_vmxinfo.ksm_merged,
+			       envs[i].env_vmxinfo.balloon,
+			       envs[i].env_vmxinfo.balloon_target);
+		if (!total)
+			continue;
+		printf("  %-8s %2s %-16s %8s %10s %4s %8s %8s %8s %10s\n", "", "#",
+		       "name", "count", "kcycles", "time", "avg", "p50<=", "p99<=",
+		       "kblocked");
+		print_stats("exit", exit_names, vs.vs_exit, VMX_EXIT_NREASONS, total);
+		print_stats("vmcall", vmcall_names, vs.vs_vmcall, VMX_VMCALL_NCODES, total);
+	}
+}
+
+// The guest sys_vmx_list_vms lists as VM number n, or 0.
+static envid_t
+vm_find(int n)
+{
+	int i;
+
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_type == ENV_TYPE_GUEST &&
+		    envs[i].env_status != ENV_FREE &&
+		    envs[i].env_vmxinfo.vcpu_id == 0 &&
+		    !envs[i].env_vmxinfo.snapshot && --n == 0)
+			return envs[i].env_id;
+	return 0;
+}
+
+// Have the vmm of paused VM number n save it to the file at path (see
+// inc/vmsave.h): all of it, or, if incremental, only what changed since
+// the last checkpoint in the file.  Only the vmm, the guest's parent,
+// may read the guest, so wait for it to pick up the request.
+static int
+vm_save(int n, const char *path, bool incremental)
+{
+	static struct VmSaveReq req;
+	const volatile struct Env *e;
+	char reqpath[50];
+	envid_t guest;
+	unsigned until;
+	int fd, got, r;
+
+	if (!(guest = vm_find(n)))
+		return -E_BAD_ENV;
+	e = &envs[ENVX(guest)];
+	if (!e->env_vmxinfo.state_saved)
+		return -E_INVAL;
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	req.sr_result = VMSAVE_PENDING;
+	req.sr_incremental = incremental;
+	strcpy(req.sr_path, path);
+	snprintf(reqpath, sizeof(reqpath), "/vmm/save%d.req",
+		 e->env_vmxinfo.vdisk);
+	if ((fd = open(reqpath, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		return fd;
+	r = write(fd, &req, sizeof(req));
+	close(fd);
+	if (r != sizeof(req)) {
+		remove(reqpath);
+		return r < 0 ? r : -E_NO_DISK;
+	}
+
+	// Unless the guest is resumed or goes away first.
+	r = -E_INVAL;
+	while (e->env_id == guest && e->env_vmxinfo.state_saved) {
+		for (until = sys_time_msec() + 100; sys_time_msec() < until; )
+			sys_yield();
+		if ((fd = open(reqpath, O_RDONLY)) < 0) {
+			r = fd;
+			break;
+		}
+		got = readn(fd, &req, sizeof(req));
+		close(fd);
+		if (got != sizeof(req)) {
+			r = got < 0 ? got : -E_INVAL;
+			break;
+		}
+		if (req.sr_result != VMSAVE_PENDING) {
+			r = req.sr_result;
+			break;
+		}
+	}
+	remove(reqpath);
+	return r;
+}
 
 void
 umain(int argc, char **argv)
 {
 	char *buf;
+	bool incremental;
+	int r;
+
+	// vmmanager stats: show where the guests' exits go and quit.
+	if (argc > 1 && strcmp(argv[1], "stats") == 0) {
+		vm_stats();
+		return;
+	}
+	// vmmanager save [-i] vm file: save a paused VM, incrementally
+	// with -i.
+	if (argc > 1 && strcmp(argv[1], "save") == 0) {
+		incremental = argc > 2 && strcmp(argv[2], "-i") == 0;
+		if (argc != 4 + incremental) {
+			printf("usage: vmmanager save [-i] vm file\n");
+			return;
+		}
+		if ((r = vm_save(strtol(argv[2 + incremental], 0, 0),
+				 argv[3 + incremental], incremental)) < 0)
+			printf("Error saving the VM: %e\n", r);
+		return;
+	}
+	// vmmanager restore file: start a vmm to carry on with a saved VM.
+	if (argc > 1 && strcmp(argv[1], "restore") == 0) {
+		if (argc != 3) {
+			printf("usage: vmmanager restore file\n");
+			return;
+		}
+		if ((r = spawnl("/bin/vmm", "vmm", "restore", argv[2], (char *) 0)) < 0)
+			printf("Error starting vmm: %e\n", r);
+		return;
+	}
 	sys_vmx_list_vms();
 	buf = readline("Please select a VM to resume: ");
 	while (!(strlen(buf) == 1
@@ -5,6 +5,9 @@
 #include <inc/error.h>
 #include <inc/memlayout.h>
 #include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <inc/trap.h>
 #include <inc/string.h>
 
 // Return the physical address of an ept entry
@@ -31,8 +34,86 @@ static inline int epte_present(epte_t epte)
     return (epte & __EPTE_FULL) > 0;
 }
 
+// Return true if an ept entry above the last level maps a large page
+// (2MB at level 1, 1GB at level 2) rather than pointing to a table
+static inline int epte_large(epte_t epte)
+{
+    return (epte & __EPTE_SZ) != 0;
+}
+
+// Is CPU c running a vCPU of the guest whose EPT is rooted at eptrt?
+static int ept_cpu_in_guest(int c, epte_t* eptrt)
+{
+    return c != cpunum() && cpus[c].cpu_in_guest &&
+        cpus[c].cpu_env && cpus[c].cpu_env->env_pml4e == eptrt;
+}
+
+// Present entries under eptrt changed: have the guest using it flush
+// its cached guest-physical translations before it next runs (on its
+// own CPU, where they are).  New mappings need no flush, since
+// not-present entries are never cached.
+//
+// vCPUs running on other CPUs meanwhile use the old entries, so kick
+// them out of the guest and wait until they are out; only then may the
+// caller reuse the pages those entries pointed to.  They can't enter
+// again before we give up the kernel lock.
+static void ept_invalidate(epte_t* eptrt)
+{
+    int i;
+
+    for (i = 0; i < NENV; ++i) {
+        if (envs[i].env_type == ENV_TYPE_GUEST && envs[i].env_pml4e == eptrt) {
+            envs[i].env_vmxinfo.ept_stale = true;
+            memset(envs[i].env_vmxinfo.gtlb, 0,
+                   sizeof(envs[i].env_vmxinfo.gtlb));
+        }
+    }
+    for (i = 0; i < ncpu; ++i) {
+        if (ept_cpu_in_guest(i, eptrt)) {
+            lapic_ipi_cpu(cpus[i].cpu_id, IRQ_OFFSET + IRQ_KICK);
+        }
+    }
+    for (i = 0; i < ncpu; ++i) {
+        while (ept_cpu_in_guest(i, eptrt)) {
+            asm volatile("pause");
+        }
+    }
+}
+
+// Replace the large page entry *epte at the given level with a table of
+// next-level entries mapping the same memory with the same flags, so
+// that part of its range can be remapped.  The host pages behind a large
+// mapping are reference counted one by one, so no counts change here.
+static int ept_split_large(epte_t *epte, int level)
+{
+    struct PageInfo *page;
+    epte_t *dir, flags;
+    physaddr_t pa;
+    int i;
+
+    page = page_alloc(0);
+    if (!page) {
+        return -E_NO_MEM;
+    }
+    page->pp_ref++;
+
+    pa = epte_addr(*epte);
+    flags = epte_flags(*epte);
+    if (level == 1) {
+        flags &= ~__EPTE_SZ;
+    }
+    dir = (epte_t*) page2kva(page);
+    for (i = 0; i < NPTENTRIES; ++i) {
+        dir[i] = (pa + i * EPT_LEVEL_SIZE(level - 1)) | flags;
+    }
+    *epte = epte_addr(page2pa(page)) | __EPTE_FULL;
+    return 0;
+}
+
 // Find the final ept entry for a given guest physical address,
 // creating any missing intermediate extended page tables if create is non-zero.
+// A large page mapping on the way is split into 4K entries if create is
+// non-zero, and treated as a missing table otherwise (see ept_lookup_leaf).
 //
 // If epte_out is non-NULL, store the found epte_t* at this address.
 //
@@ -80,6 +161,15 @@ static int ept_lookup_gpa(epte_t* eptrt, void *gpa,
             // both to obtain the address for the new entry, then set the permissions 
             // on it
             dir[idx] = epte_addr(page2pa(page)) | __EPTE_FULL;
+        } else if (epte_large(dir[idx])) {
+            int r;
+
+            if (!create) {
+                return -E_NO_ENT;
+            }
+            if ((r = ept_split_large(&dir[idx], i)) < 0) {
+                return r;
+            }
         }
         // update dir to the virtual address of the next epte
         // we need to use a virtual address so we can actually 
@@ -95,6 +185,28 @@ static int ept_lookup_gpa(epte_t* eptrt, void *gpa,
     return 0;
 }
 
+// Find the ept entry that maps gpa, which may be a 4K entry or a large
+// page entry.  Stores the entry in *epte_out and returns its level
+// (0 for 4K, 1 for 2MB, 2 for 1GB), or -E_NO_ENT if gpa is unmapped.
+static int ept_lookup_leaf(epte_t* eptrt, void *gpa, epte_t **epte_out) {
+    int i;
+    epte_t* dir = eptrt;
+
+    for (i = EPT_LEVELS - 1; i > 0; i--) {
+        int idx = ADDR_TO_IDX(gpa, i);
+
+        if (!epte_present(dir[idx])) {
+            return -E_NO_ENT;
+        }
+        if (epte_large(dir[idx])) {
+            break;
+        }
+        dir = (epte_t*) epte_page_vaddr(dir[idx]);
+    }
+    *epte_out = &dir[ADDR_TO_IDX(gpa, i)];
+    return epte_present(**epte_out) ? i : -E_NO_ENT;
+}
+
 int alloc_intermediate_ept_page(epte_t* parent, uint64_t index, int create) {
     struct PageInfo* page = NULL;
     epte_t new_epte;
@@ -113,25 +225,68 @@ int alloc_intermediate_ept_page(epte_t* parent, uint64_t index, int create) {
 
 void ept_gpa2hva(epte_t* eptrt, void *gpa, void **hva) {
     epte_t* pte;
-    int ret = ept_lookup_gpa(eptrt, gpa, 0, &pte);
-    if(ret < 0) {
+    int level = ept_lookup_leaf(eptrt, gpa, &pte);
+    if(level < 0) {
         *hva = NULL;
     } else {
-        if(!epte_present(*pte)) {
-           *hva = NULL;
-        } else {
-           *hva = KADDR(epte_addr(*pte));
-        }
+        // Within a large page, return the 4K page holding gpa.
+        uint64_t off = (uint64_t) gpa & (EPT_LEVEL_SIZE(level) - 1);
+        *hva = KADDR(epte_addr(*pte) + ROUNDDOWN(off, PGSIZE));
     }
 }
 
+// Mark the page at gpa accessed and written, for a write the host makes
+// to it itself, which the processor doesn't see (see ept_ad_harvest).
+void ept_mark_dirty(epte_t* eptrt, void *gpa) {
+    epte_t* epte;
+
+    if (ept_lookup_leaf(eptrt, gpa, &epte) >= 0) {
+        *epte |= __EPTE_A | __EPTE_D;
+    }
+}
+
+// Like ept_gpa2hva, through vCPU ginfo's software TLB, which saves the
+// walk for pages hypercalls use over and over.  If write, the page is
+// made writable first (see ept_cow_break) and marked written.  Return
+// NULL if gpa isn't mapped, or can't be written.
+void *ept_gpa2hva_cached(epte_t* eptrt, struct VmxGuestInfo *ginfo,
+        uint64_t gpa, bool write)
+{
+    struct VmxGtlbEntry *te = &ginfo->gtlb[PGNUM(gpa) % VMX_GTLB_SIZE];
+    uint64_t tag = ROUNDDOWN(gpa, PGSIZE) | VMX_GTLB_VALID;
+    void *hva;
+
+    if ((te->gt_tag & ~VMX_GTLB_WRITE) == tag &&
+        (!write || (te->gt_tag & VMX_GTLB_WRITE))) {
+        return te->gt_hva;
+    }
+    if (write && ept_cow_break(eptrt, (void *) gpa) <= 0) {
+        return NULL;
+    }
+    ept_gpa2hva(eptrt, (void *) gpa, &hva);
+    if (hva && write) {
+        ept_mark_dirty(eptrt, (void *) gpa);
+    }
+    if (hva) {
+        te->gt_tag = tag | (write ? VMX_GTLB_WRITE : 0);
+        te->gt_hva = hva;
+    }
+    return hva;
+}
+
 static void free_ept_level(epte_t* eptrt, int level) {
     epte_t* dir = eptrt;
     int i;
 
     for(i=0; i<NPTENTRIES; ++i) {
         if(level != 0) {
-            if(epte_present(dir[i])) {
+            if(epte_present(dir[i]) && epte_large(dir[i])) {
+                // Large page, free each guest physical page behind it.
+                struct PageInfo *pp = pa2page(epte_addr(dir[i]));
+                size_t j;
+                for(j=0; j < EPT_LEVEL_SIZE(level) / PGSIZE; ++j)
+                    page_decref(pp + j);
+            } else if(epte_present(dir[i])) {
                 physaddr_t pa = epte_addr(dir[i]);
                 free_ept_level((epte_t*) KADDR(pa), level-1);
                 // free the table.
@@ -148,11 +303,34 @@ static void free_ept_level(epte_t* eptrt, int level) {
     return;
 }
 
+static int count_ept_level(epte_t* eptrt, int level) {
+    epte_t* dir = eptrt;
+    int i, n = 0;
+
+    for(i=0; i<NPTENTRIES; ++i) {
+        if(!epte_present(dir[i]))
+            continue;
+        if(level != 0 && epte_large(dir[i]))
+            n += EPT_LEVEL_SIZE(level) / PGSIZE;
+        else if(level != 0)
+            n += count_ept_level((epte_t*) epte_page_vaddr(dir[i]), level-1);
+        else
+            n++;
+    }
+    return n;
+}
+
+// Return the number of guest physical pages currently backed by host memory.
+int ept_resident_pages(epte_t* eptrt) {
+    return count_ept_level(eptrt, EPT_LEVELS - 1);
+}
+
 // Free the EPT table entries and the EPT tables.
 // NOTE: Does not deallocate EPT PML4 page.
+// Whatever the guest left cached is flushed before the next guest using
+// the same EPT root page or VPID first runs.
 void free_guest_mem(epte_t* eptrt) {
     free_ept_level(eptrt, EPT_LEVELS - 1);
-    tlbflush();
 }
 
 // Add Page pp to a guest's EPT at guest physical address gpa
@@ -179,15 +357,15 @@ int ept_page_insert(epte_t* eptrt, struct PageInfo* pp, void* gpa, int perm) {
 		return -E_NO_MEM;
 	}
 
+    // Success so increment, before a remap of the same page can free it
+    pp->pp_ref++;
     if(epte_present(*pte))
 	{
 		page_decref(pa2page(epte_addr(*pte)));
+		ept_invalidate(eptrt);
 	}
 
     *pte = epte_addr((uint64_t)page2pa(pp)) | perm | __EPTE_FULL; 
-	// Success so increment
-    pp->pp_ref++;
-    tlb_invalidate(eptrt, gpa);
 	
     return 0;
 }
@@ -204,7 +382,7 @@ int ept_page_insert(epte_t* eptrt, struct PageInfo* pp, void* gpa, int perm) {
 // Hint: use ept_lookup_gpa to create the intermediate
 //       ept levels, and return the final epte_t pointer.
 //       You should set the type to EPTE_TYPE_WB and set __EPTE_IPAT flag.
-int ept_map_hva2gpa(epte_t* eptrt, void* hva, void* gpa, int perm,
+int ept_map_hva2gpa(epte_t* eptrt, void* hva, void* gpa, uint64_t perm,
         int overwrite) {
     epte_t* pte;
     // look up the page table entry for gpa and store it in pte
@@ -213,9 +391,13 @@ int ept_map_hva2gpa(epte_t* eptrt, void* hva, void* gpa, int perm,
         return ret;
     }
 
-    // if there's already an entry for gpa and overwrite is false, return error
-    if (epte_present(*pte) && !overwrite) {
-        return -E_INVAL;
+    // if there's already an entry for gpa and overwrite is false, return error.
+    // otherwise the old translation may be cached, and must be flushed.
+    if (epte_present(*pte)) {
+        if (!overwrite) {
+            return -E_INVAL;
+        }
+        ept_invalidate(eptrt);
     }
 
     // first have to convert hva to a physical address, since we actually want to map 
@@ -227,28 +409,443 @@ int ept_map_hva2gpa(epte_t* eptrt, void* hva, void* gpa, int perm,
     // structure related to caching. not relevant to us, but still needs to be set.
     *pte = epte_addr( PADDR( hva ) ) | perm | __EPTE_TYPE( EPTE_TYPE_WB ) 
         | __EPTE_IPAT;
-    // invalidate tlb entry for gpa, since we've changed the mapping
-    tlb_invalidate(eptrt, gpa);
     return 0;
 }
 
-int ept_alloc_static(epte_t *eptrt, struct VmxGuestInfo *ginfo) {
-    physaddr_t i;
+// Map the 2MB-aligned host memory at hva to the 2MB-aligned guest
+// physical address gpa with a single large page entry, with permissions
+// perm.  eptrt is a pointer to the extended page table root.
+//
+// Return 0 on success.
+//
+// Error values:
+//    -E_INVAL if any part of the 2MB range is already mapped
+//    -E_NO_MEM if allocation of intermediate page table entries fails
+int ept_map_hva2gpa_2m(epte_t* eptrt, void* hva, void* gpa, int perm) {
+    int i;
+    epte_t* dir = eptrt;
+
+    for (i = EPT_LEVELS - 1; i > 1; i--) {
+        int idx = ADDR_TO_IDX(gpa, i);
 
-    for(i=0x0; i < 0xA0000; i+=PGSIZE) {
-        struct PageInfo *p = page_alloc(0);
-        p->pp_ref += 1;
-        int r = ept_map_hva2gpa(eptrt, page2kva(p), (void *)i, __EPTE_FULL, 0);
+        if (!epte_present(dir[idx])) {
+            struct PageInfo* page = page_alloc(ALLOC_ZERO);
+            if (!page) {
+                return -E_NO_MEM;
+            }
+            page->pp_ref++;
+            dir[idx] = epte_addr(page2pa(page)) | __EPTE_FULL;
+        } else if (epte_large(dir[idx])) {
+            return -E_INVAL;
+        }
+        dir = (epte_t*) epte_page_vaddr(dir[idx]);
     }
 
-    for(i=0x100000; i < ginfo->phys_sz; i+=PGSIZE) {
-        struct PageInfo *p = page_alloc(0);
-        p->pp_ref += 1;
-        int r = ept_map_hva2gpa(eptrt, page2kva(p), (void *)i, __EPTE_FULL, 0);
+    dir = &dir[ADDR_TO_IDX(gpa, 1)];
+    if (epte_present(*dir)) {
+        return -E_INVAL;
     }
+    *dir = epte_addr( PADDR( hva ) ) | perm | __EPTE_TYPE( EPTE_TYPE_WB )
+        | __EPTE_IPAT | __EPTE_SZ;
     return 0;
 }
 
+// Is the 2MB of guest memory around gpa mapped through a 4K table?  Then
+// some of it is mapped already, or was and has been given back (see
+// ept_page_remove), so a large page won't fit.
+static int ept_has_table(epte_t* eptrt, uint64_t gpa) {
+    epte_t* dir = eptrt;
+    int i;
+
+    for (i = EPT_LEVELS - 1; i > 0; i--) {
+        epte_t e = dir[ADDR_TO_IDX(gpa, i)];
+
+        if (!epte_present(e) || epte_large(e)) {
+            return 0;
+        }
+        dir = (epte_t*) epte_page_vaddr(e);
+    }
+    return 1;
+}
+
+// Back the guest physical page at gpa with fresh host memory, using a
+// 2MB large page if the whole 2MB region around gpa is ordinary guest
+// RAM and none of it is mapped yet (the guest kernel image and IPC pages
+// are mapped 4K at a time), and a 4K page otherwise.  The memory is
+// zeroed, since it may have belonged to another environment, or to this
+// guest before it gave it back (see ept_page_remove).
+//
+// Return the number of 4K pages backed, or
+//    -E_INVAL if gpa isn't guest RAM
+//    -E_NO_MEM if we're out of memory
+int ept_alloc_gpa(epte_t* eptrt, struct VmxGuestInfo *ginfo, uint64_t gpa) {
+    uint64_t gpa_2m = ROUNDDOWN(gpa, EPT_LEVEL_SIZE(1));
+    struct PageInfo *p;
+    size_t i;
+    int r;
+
+    if (!(gpa < 0xA0000 || (gpa >= 0x100000 && gpa < ginfo->phys_sz))) {
+        return -E_INVAL;
+    }
+
+    if (gpa_2m >= 0x100000 && gpa_2m + EPT_LEVEL_SIZE(1) <= ginfo->phys_sz
+        && !ept_has_table(eptrt, gpa_2m)
+        && (p = page_alloc_npages(NPTENTRIES, ALLOC_ZERO))) {
+        for (i = 0; i < NPTENTRIES; i++) {
+            p[i].pp_ref += 1;
+        }
+        r = ept_map_hva2gpa_2m(eptrt, page2kva(p), (void*) gpa_2m, __EPTE_FULL);
+        if (r >= 0) {
+            return NPTENTRIES;
+        }
+        for (i = 0; i < NPTENTRIES; i++) {
+            page_decref(&p[i]);
+        }
+    }
+
+    p = page_alloc(ALLOC_ZERO);
+    if (!p) {
+        return -E_NO_MEM;
+    }
+    p->pp_ref += 1;
+    r = ept_map_hva2gpa(eptrt, page2kva(p), (void*) ROUNDDOWN(gpa, PGSIZE),
+            __EPTE_FULL, 0);
+    if (r < 0) {
+        page_decref(p);
+        return r;
+    }
+    return 1;
+}
+
+// Back guest RAM that isn't mapped yet, starting at ginfo->prefault_next,
+// until at least max_pages pages have been backed or the end of guest
+// memory is reached.  The cursor is advanced, so repeated calls pick up
+// where the last one stopped; it is at phys_sz once everything is backed.
+//
+// Return the number of pages backed, or -E_NO_MEM if we ran out of memory.
+int ept_prefault(epte_t* eptrt, struct VmxGuestInfo *ginfo, int max_pages) {
+    int n = 0, r;
+    void *hva;
+
+    while (ginfo->prefault_next < ginfo->phys_sz && n < max_pages) {
+        uint64_t gpa = ginfo->prefault_next;
+
+        if (gpa >= 0xA0000 && gpa < 0x100000) {
+            // The VGA/BIOS hole is never ordinary RAM.
+            ginfo->prefault_next = 0x100000;
+            continue;
+        }
+        ept_gpa2hva(eptrt, (void*) gpa, &hva);
+        if (hva == NULL) {
+            if ((r = ept_alloc_gpa(eptrt, ginfo, gpa)) < 0) {
+                return r;
+            }
+            n += r;
+        }
+        ginfo->prefault_next += PGSIZE;
+    }
+    return n;
+}
+
+// Share the leaf entry *src of the given level, which maps guest RAM,
+// with *dst (see ept_snapshot).
+static int ept_share_leaf(epte_t *src, epte_t *dst, int level)
+{
+    struct PageInfo *pp = pa2page(epte_addr(*src)), *np;
+    size_t i;
+
+    if (level == 0 && (*src & __EPTE_WRITE) && pp->pp_ref > 1) {
+        // Mapped by a host environment too: the copy gets its own.
+        if (!(np = page_alloc(0))) {
+            return -E_NO_MEM;
+        }
+        np->pp_ref++;
+        memcpy(page2kva(np), page2kva(pp), PGSIZE);
+        *dst = epte_addr(page2pa(np)) | epte_flags(*src);
+        return 0;
+    }
+    if (*src & __EPTE_WRITE) {
+        *src = (*src & ~__EPTE_WRITE) | __EPTE_COW;
+    }
+    *dst = *src;
+    for (i = 0; i < EPT_LEVEL_SIZE(level) / PGSIZE; ++i) {
+        pp[i].pp_ref++;
+    }
+    return 0;
+}
+
+// Is any page behind the writable large page entry epte at the given
+// level mapped anywhere else?
+static int ept_large_shared(epte_t epte, int level)
+{
+    struct PageInfo *pp = pa2page(epte_addr(epte));
+    size_t i;
+
+    if (!(epte & __EPTE_WRITE)) {
+        return 0;
+    }
+    for (i = 0; i < EPT_LEVEL_SIZE(level) / PGSIZE; ++i) {
+        if (pp[i].pp_ref > 1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int ept_snapshot_level(epte_t* src, epte_t* dst, int level, uint64_t gpa)
+{
+    struct PageInfo *page;
+    int i, r;
+
+    for (i = 0; i < NPTENTRIES; ++i) {
+        uint64_t a = gpa + i * EPT_LEVEL_SIZE(level);
+
+        if (!epte_present(src[i]) ||
+            (level == 0 && a >= 0xA0000 && a < 0x100000)) {
+            continue;
+        }
+        if (level > 0 && epte_large(src[i]) && ept_large_shared(src[i], level)) {
+            if ((r = ept_split_large(&src[i], level)) < 0) {
+                return r;
+            }
+        }
+        if (level == 0 || epte_large(src[i])) {
+            if ((r = ept_share_leaf(&src[i], &dst[i], level)) < 0) {
+                return r;
+            }
+            continue;
+        }
+        page = page_alloc(ALLOC_ZERO);
+        if (!page) {
+            return -E_NO_MEM;
+        }
+        page->pp_ref++;
+        dst[i] = epte_addr(page2pa(page)) | __EPTE_FULL;
+        r = ept_snapshot_level((epte_t*) epte_page_vaddr(src[i]),
+                (epte_t*) page2kva(page), level - 1, a);
+        if (r < 0) {
+            return r;
+        }
+    }
+    return 0;
+}
+
+// Give the empty EPT dstrt the guest memory mapped by srcrt, shared
+// copy-on-write: writable entries lose __EPTE_WRITE in both and get
+// __EPTE_COW, and the first write through either copies the page (see
+// ept_cow_break).  Pages that host environments map too, like block
+// rings, are copied right away instead, so that the source guest keeps
+// sharing them.  The VGA/BIOS hole is left for the new guest to fault in.
+//
+// Return 0 on success, or -E_NO_MEM; then dstrt maps some of the memory,
+// and should be freed with free_guest_mem.
+int ept_snapshot(epte_t* srcrt, epte_t* dstrt)
+{
+    int r = ept_snapshot_level(srcrt, dstrt, EPT_LEVELS - 1, 0);
+
+    ept_invalidate(srcrt);
+    return r;
+}
+
+// Count a page of the guest with EPT eptrt (un)merged, on its first vCPU.
+static void ept_ksm_account(epte_t* eptrt, int merged)
+{
+    int i;
+
+    for (i = 0; i < NENV; ++i) {
+        struct VmxGuestInfo *ginfo = &envs[i].env_vmxinfo;
+
+        if (envs[i].env_type == ENV_TYPE_GUEST && envs[i].env_pml4e == eptrt &&
+            ginfo->vcpu_id == 0) {
+            if (merged) {
+                ginfo->ksm_shared++;
+                ginfo->ksm_merged++;
+            } else {
+                ginfo->ksm_shared--;
+            }
+        }
+    }
+}
+
+// Find the 4K page behind gpa, if it can be merged: it is mapped
+// writable and by nothing else.
+//
+// Return 0 and store the page in *pp_store on success, -E_NO_ENT if gpa
+// is unmapped, or -E_INVAL if the page can't be merged.
+int ept_ksm_page(epte_t* eptrt, void *gpa, struct PageInfo **pp_store)
+{
+    struct PageInfo *pp;
+    epte_t *epte;
+    int level;
+
+    if ((level = ept_lookup_leaf(eptrt, gpa, &epte)) < 0) {
+        return level;
+    }
+    if (!(*epte & __EPTE_WRITE)) {
+        return -E_INVAL;
+    }
+    pp = pa2page(epte_addr(*epte) +
+            ROUNDDOWN((uint64_t) gpa & (EPT_LEVEL_SIZE(level) - 1), PGSIZE));
+    if (pp->pp_ref != 1) {
+        return -E_INVAL;
+    }
+    *pp_store = pp;
+    return 0;
+}
+
+// Map merged page kp read-only and copy-on-write at gpa, in place of
+// old, which must still be mergeable there (see ept_ksm_page).  kp may
+// be old itself, which turns it into a merged page.  A large page is
+// split first.  The old, writable translation is flushed on every CPU
+// before this returns (see ept_invalidate), so no vCPU writes old
+// after it is merged.
+//
+// Return 0 on success, -E_INVAL if gpa no longer maps old, or -E_NO_MEM.
+int ept_ksm_merge(epte_t* eptrt, void *gpa, struct PageInfo *old,
+        struct PageInfo *kp)
+{
+    struct PageInfo *pp;
+    epte_t *epte;
+    int r;
+
+    if (ept_ksm_page(eptrt, gpa, &pp) < 0 || pp != old) {
+        return -E_INVAL;
+    }
+    if ((r = ept_lookup_gpa(eptrt, gpa, 1, &epte)) < 0) {
+        return r;
+    }
+    kp->pp_ref++;
+    page_decref(old);
+    *epte = epte_addr(page2pa(kp)) | (epte_flags(*epte) & ~__EPTE_WRITE)
+        | __EPTE_COW | __EPTE_KSM;
+    ept_invalidate(eptrt);
+    ept_ksm_account(eptrt, 1);
+    return 0;
+}
+
+// Unmap the page at gpa and drop the guest's reference to it, splitting
+// a large page first.  The guest gets a fresh page if it touches gpa
+// again.
+//
+// Return 1 if a page was unmapped, 0 if gpa wasn't mapped, or -E_NO_MEM.
+int ept_page_remove(epte_t* eptrt, void *gpa)
+{
+    epte_t *epte;
+    int r;
+
+    if (ept_lookup_leaf(eptrt, gpa, &epte) < 0) {
+        return 0;
+    }
+    if ((r = ept_lookup_gpa(eptrt, gpa, 1, &epte)) < 0) {
+        return r;
+    }
+    if (*epte & __EPTE_KSM) {
+        ept_ksm_account(eptrt, 0);
+    }
+    page_decref(pa2page(epte_addr(*epte)));
+    *epte = 0;
+    ept_invalidate(eptrt);
+    return 1;
+}
+
+static void ept_ad_level(epte_t* dir, int level, uint64_t gpa,
+        uint8_t *dirty, uint64_t npages, struct VmxMemScan *ms)
+{
+    struct PageInfo *pp;
+    uint64_t a, j, n;
+    int i;
+
+    for (i = 0; i < NPTENTRIES; ++i) {
+        a = gpa + i * EPT_LEVEL_SIZE(level);
+        if (!epte_present(dir[i]) ||
+            (level == 0 && a >= 0xA0000 && a < 0x100000)) {
+            continue;
+        }
+        if (level > 0 && !epte_large(dir[i])) {
+            ept_ad_level((epte_t*) epte_page_vaddr(dir[i]), level - 1, a,
+                    dirty, npages, ms);
+            continue;
+        }
+        n = EPT_LEVEL_SIZE(level) / PGSIZE;
+        pp = pa2page(epte_addr(dir[i]));
+        ms->ms_resident += n;
+        if (dir[i] & __EPTE_A) {
+            ms->ms_accessed += n;
+        }
+        for (j = 0; j < n; ++j) {
+            if (!(dir[i] & __EPTE_D) &&
+                !((dir[i] & __EPTE_WRITE) && pp[j].pp_ref > 1)) {
+                continue;
+            }
+            ms->ms_dirty++;
+            if (dirty && a / PGSIZE + j < npages) {
+                dirty[(a / PGSIZE + j) / 8] |= 1 << ((a / PGSIZE + j) % 8);
+            }
+        }
+        dir[i] &= ~(__EPTE_A | __EPTE_D);
+    }
+}
+
+// Count the guest pages that are backed, and were accessed and written
+// since the last harvest, in *ms, and set the bit for each written page
+// below page npages in bitmap dirty, if it isn't NULL.  The accessed
+// and dirty bits are then cleared, which also empties the vCPUs'
+// software TLBs, so the host's next write through one marks the page
+// again (see ept_mark_dirty).  Writable pages that host environments
+// keep mapped, like the block ring, always count as written, since the
+// host's writes to them aren't seen.  The VGA/BIOS hole isn't guest RAM
+// and isn't counted.
+void ept_ad_harvest(epte_t* eptrt, uint8_t *dirty, uint64_t npages,
+        struct VmxMemScan *ms)
+{
+    ms->ms_resident = ms->ms_accessed = ms->ms_dirty = 0;
+    ept_ad_level(eptrt, EPT_LEVELS - 1, 0, dirty, npages, ms);
+    ept_invalidate(eptrt);
+}
+
+// Make gpa writable if it is in a copy-on-write page, by copying the
+// page unless nothing else maps it any more.  A large page is split
+// first, so only 4K is copied.
+//
+// Return 1 if gpa is now in a writable page, 0 if it is unmapped or
+// mapped read-only for good, or -E_NO_MEM.
+int ept_cow_break(epte_t* eptrt, void *gpa)
+{
+    struct PageInfo *pp, *np;
+    epte_t *epte;
+    int r;
+
+    if (ept_lookup_leaf(eptrt, gpa, &epte) < 0) {
+        return 0;
+    }
+    if (*epte & __EPTE_WRITE) {
+        return 1;
+    }
+    if (!(*epte & __EPTE_COW)) {
+        return 0;
+    }
+    if ((r = ept_lookup_gpa(eptrt, gpa, 1, &epte)) < 0) {
+        return r;
+    }
+    pp = pa2page(epte_addr(*epte));
+    if (pp->pp_ref > 1) {
+        if (!(np = page_alloc(0))) {
+            return -E_NO_MEM;
+        }
+        np->pp_ref++;
+        memcpy(page2kva(np), page2kva(pp), PGSIZE);
+        page_decref(pp);
+        pp = np;
+    }
+    if (*epte & __EPTE_KSM) {
+        ept_ksm_account(eptrt, 0);
+    }
+    *epte = epte_addr(page2pa(pp))
+        | (epte_flags(*epte) & ~(__EPTE_COW | __EPTE_KSM)) | __EPTE_WRITE;
+    ept_invalidate(eptrt);
+    return 1;
+}
+
 #ifdef TEST_EPT_MAP
 #include <kern/env.h>
 #include <kern/syscall.h>
@@ -283,7 +880,7 @@ int test_ept_map(void)
 
     /*env_destroy(dstenv);*/
 
-    if ((r = env_guest_alloc(&dstenv, srcenv->env_id)) < 0)
+    if ((r = env_guest_alloc(&dstenv, srcenv->env_id, NULL)) < 0)
         panic("Failed to allocate guest env (%d)\n", r);
     dstenv->env_vmxinfo.phys_sz = (uint64_t)UTEMP + PGSIZE;
 
@@ -9,11 +9,25 @@
 
 typedef uint64_t epte_t;
 
-int ept_map_hva2gpa( epte_t* eptrt, void* hva, void* gpa, int perm, int overwrite );
-int ept_alloc_static(epte_t *eptrt, struct VmxGuestInfo *ginfo);
+int ept_map_hva2gpa( epte_t* eptrt, void* hva, void* gpa, uint64_t perm, int overwrite );
+int ept_map_hva2gpa_2m(epte_t* eptrt, void* hva, void* gpa, int perm);
+int ept_alloc_gpa(epte_t* eptrt, struct VmxGuestInfo *ginfo, uint64_t gpa);
+int ept_prefault(epte_t* eptrt, struct VmxGuestInfo *ginfo, int max_pages);
 void free_guest_mem(epte_t* eptrt);
+int ept_resident_pages(epte_t* eptrt);
 void ept_gpa2hva(epte_t* eptrt, void *gpa, void **hva);
+void ept_mark_dirty(epte_t* eptrt, void *gpa);
+void *ept_gpa2hva_cached(epte_t* eptrt, struct VmxGuestInfo *ginfo,
+        uint64_t gpa, bool write);
 int ept_page_insert(epte_t* eptrt, struct PageInfo* pp, void* gpa, int perm);
+int ept_snapshot(epte_t* srcrt, epte_t* dstrt);
+int ept_cow_break(epte_t* eptrt, void *gpa);
+int ept_page_remove(epte_t* eptrt, void *gpa);
+void ept_ad_harvest(epte_t* eptrt, uint8_t *dirty, uint64_t npages,
+        struct VmxMemScan *ms);
+int ept_ksm_page(epte_t* eptrt, void *gpa, struct PageInfo **pp_store);
+int ept_ksm_merge(epte_t* eptrt, void *gpa, struct PageInfo *old,
+        struct PageInfo *kp);
 int alloc_intermediate_ept_page(epte_t* parent, uint64_t index, int create);
 
 #define EPT_LEVELS 4
@@ -22,11 +36,19 @@ int alloc_intermediate_ept_page(epte_t* parent, uint64_t index, int create);
 #define VMX_EPT_FAULT_WRITE	0x02
 #define VMX_EPT_FAULT_INS	0x04
 
+// EPTP flag: the processor sets accessed and dirty bits in EPT entries.
+#define VMX_EPTP_AD		0x40
 
-#define EPTE_ADDR	(~(PGSIZE - 1))
-#define EPTE_FLAGS	(PGSIZE - 1)
+
+// Bits 12-51 hold the address; the rest are flags, including software
+// bits such as __EPTE_COW.
+#define EPTE_ADDR	0x000FFFFFFFFFF000ULL
+#define EPTE_FLAGS	(~EPTE_ADDR)
 
 #define ADDR_TO_IDX(pa, n) \
     ((((uint64_t) (pa)) >> (12 + 9 * (n))) & ((1 << 9) - 1))
 
+// Bytes mapped by one entry at level n (4K, 2MB, 1GB, ...)
+#define EPT_LEVEL_SIZE(n)	((uint64_t) PGSIZE << (9 * (n)))
+
 #endif
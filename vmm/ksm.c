@@ -0,0 +1,222 @@
+// Same-page merging for guests.
+//
+// Idle CPUs scan guest memory a chunk at a time, hashing each private
+// guest page.  A page with the contents of a merged page is mapped to
+// it instead, read-only and copy-on-write (see ept_ksm_merge), and its
+// own page freed; the first write through such a mapping copies the
+// page again (see ept_cow_break).  Merged pages are kept in the stable
+// table, which holds a reference to each.
+//
+// Pages seen during the current pass go into the unstable table.  When
+// a later page matches one there, that page becomes a merged page and
+// the later one is merged into it.  Unstable pages are still writable,
+// so both are compared again first, and the table is emptied after
+// each pass.
+//
+// A guest is only scanned while none of its vCPUs is running, since a
+// running vCPU could write a page between comparing it and remapping
+// it.
+
+#include <vmm/ksm.h>
+#include <vmm/vmx.h>
+#include <vmm/ept.h>
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+
+#define KSM_NBUCKETS	1024
+// Entries in each table.
+#define KSM_NPAGES	2048
+// Pages scanned per idle timer tick.
+#define KSM_SCAN_CHUNK	64
+// Mappings of one merged page at most, so pp_ref can't overflow.
+#define KSM_MAX_SHARING	256
+
+struct KsmPage {
+	uint64_t kp_hash;
+	struct PageInfo *kp_page;
+	// For unstable pages, the guest and address the page was seen at.
+	envid_t kp_env;
+	uint64_t kp_gpa;
+	struct KsmPage *kp_next;
+};
+
+struct KsmTable {
+	struct KsmPage *kt_bucket[KSM_NBUCKETS];
+	struct KsmPage *kt_free;
+	int kt_count;
+	struct KsmPage kt_pages[KSM_NPAGES];
+};
+
+static struct KsmTable stable, unstable;
+static bool ksm_ready;
+
+// Where the scan is: guest envs[ksm_env], guest-physical ksm_gpa.
+static int ksm_env;
+static uint64_t ksm_gpa;
+
+static void
+ksm_table_clear(struct KsmTable *t) {
+	int i;
+
+	memset(t->kt_bucket, 0, sizeof(t->kt_bucket));
+	t->kt_free = NULL;
+	for (i = KSM_NPAGES - 1; i >= 0; i--) {
+		t->kt_pages[i].kp_next = t->kt_free;
+		t->kt_free = &t->kt_pages[i];
+	}
+	t->kt_count = 0;
+}
+
+// Add an entry for hash to t, or return NULL if t is full.
+static struct KsmPage *
+ksm_table_add(struct KsmTable *t, uint64_t hash) {
+	struct KsmPage **b = &t->kt_bucket[hash % KSM_NBUCKETS];
+	struct KsmPage *kp;
+
+	if (!(kp = t->kt_free))
+		return NULL;
+	t->kt_free = kp->kp_next;
+	kp->kp_hash = hash;
+	kp->kp_next = *b;
+	*b = kp;
+	t->kt_count++;
+	return kp;
+}
+
+// Remove *kpp, an entry in one of t's buckets, from t.
+static void
+ksm_table_del(struct KsmTable *t, struct KsmPage **kpp) {
+	struct KsmPage *kp = *kpp;
+
+	*kpp = kp->kp_next;
+	kp->kp_next = t->kt_free;
+	t->kt_free = kp;
+	t->kt_count--;
+}
+
+static uint64_t
+ksm_hash(const uint64_t *p) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < PGSIZE / sizeof(uint64_t); i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+// Can guest e be scanned now?  Each guest is scanned once, through its
+// first vCPU.
+static bool
+ksm_guest_ok(struct Env *e) {
+	return e->env_type == ENV_TYPE_GUEST &&
+		(e->env_status == ENV_RUNNABLE ||
+		 e->env_status == ENV_NOT_RUNNABLE) &&
+		e->env_vmxinfo.vcpu_id == 0 && !e->env_vmxinfo.snapshot &&
+		!vmx_vcpus_running(e);
+}
+
+// Try to merge page pp, at gpa in guest e, with an equal page.
+static void
+ksm_scan_page(struct Env *e, uint64_t gpa, struct PageInfo *pp) {
+	uint64_t hash = ksm_hash(page2kva(pp));
+	struct KsmPage **kpp, *kp, *sp;
+	struct Env *o;
+
+	for (kp = stable.kt_bucket[hash % KSM_NBUCKETS]; kp; kp = kp->kp_next)
+		if (kp->kp_hash == hash &&
+		    kp->kp_page->pp_ref <= KSM_MAX_SHARING &&
+		    memcmp(page2kva(kp->kp_page), page2kva(pp), PGSIZE) == 0) {
+			ept_ksm_merge(e->env_pml4e, (void *) gpa, pp, kp->kp_page);
+			return;
+		}
+
+	for (kpp = &unstable.kt_bucket[hash % KSM_NBUCKETS]; (kp = *kpp);
+	     kpp = &kp->kp_next) {
+		if (kp->kp_hash != hash || kp->kp_page == pp)
+			continue;
+		o = &envs[ENVX(kp->kp_env)];
+		if (o->env_id != kp->kp_env || !ksm_guest_ok(o) ||
+		    memcmp(page2kva(kp->kp_page), page2kva(pp), PGSIZE) != 0)
+			continue;
+		if (!stable.kt_free)
+			return;
+		if (ept_ksm_merge(o->env_pml4e, (void *) kp->kp_gpa,
+				  kp->kp_page, kp->kp_page) < 0)
+			continue;
+		sp = ksm_table_add(&stable, hash);
+		sp->kp_page = kp->kp_page;
+		sp->kp_page->pp_ref++;
+		ksm_table_del(&unstable, kpp);
+		ept_ksm_merge(e->env_pml4e, (void *) gpa, pp, sp->kp_page);
+		return;
+	}
+
+	if ((kp = ksm_table_add(&unstable, hash))) {
+		kp->kp_page = pp;
+		kp->kp_env = e->env_id;
+		kp->kp_gpa = gpa;
+	}
+}
+
+// A pass over all guests is done: forget the unstable pages, and let go
+// of merged pages nothing maps any more.
+static void
+ksm_pass_end(void) {
+	struct KsmPage **kpp;
+	int i;
+
+	ksm_table_clear(&unstable);
+	for (i = 0; i < KSM_NBUCKETS; i++)
+		for (kpp = &stable.kt_bucket[i]; *kpp; )
+			if ((*kpp)->kp_page->pp_ref == 1) {
+				page_decref((*kpp)->kp_page);
+				ksm_table_del(&stable, kpp);
+			} else
+				kpp = &(*kpp)->kp_next;
+}
+
+// Called by an idle CPU: scan the next chunk of guest memory.
+void
+ksm_scan_idle(void) {
+	struct PageInfo *pp;
+	struct Env *e;
+	int n = 0;
+
+	if (!ksm_ready) {
+		ksm_table_clear(&stable);
+		ksm_table_clear(&unstable);
+		ksm_ready = true;
+	}
+	while (n < KSM_SCAN_CHUNK) {
+		e = &envs[ksm_env];
+		if (!ksm_guest_ok(e) || ksm_gpa >= e->env_vmxinfo.phys_sz) {
+			ksm_gpa = 0;
+			if (++ksm_env == NENV) {
+				ksm_env = 0;
+				ksm_pass_end();
+				return;
+			}
+			continue;
+		}
+		for (; n < KSM_SCAN_CHUNK && ksm_gpa < e->env_vmxinfo.phys_sz;
+		     ksm_gpa += PGSIZE) {
+			// The VGA/BIOS hole is never ordinary RAM.
+			if (ksm_gpa >= 0xA0000 && ksm_gpa < 0x100000)
+				continue;
+			if (ept_ksm_page(e->env_pml4e, (void *) ksm_gpa, &pp) < 0)
+				continue;
+			ksm_scan_page(e, ksm_gpa, pp);
+			n++;
+		}
+	}
+}
+
+// How many merged pages there are.
+int
+ksm_pages(void) {
+	return stable.kt_count;
+}
@@ -0,0 +1,7 @@
+#ifndef JOS_VMM_KSM_H
+#define JOS_VMM_KSM_H
+
+void ksm_scan_idle(void);
+int ksm_pages(void);
+
+#endif
@@ -0,0 +1,116 @@
+// Host side of the paravirtual console (see inc/vcons.h).
+//
+// Guest output is copied to the host's console when the guest kicks.
+// Input from the keyboard and serial port goes to one guest at a time,
+// the one that last set up its console or was resumed, while it is
+// live; a guest paused with ESC gives the host its console back.  The
+// host reads the devices itself, so the guest never touches them.
+
+#include <vmm/vcons.h>
+#include <vmm/vmx.h>
+#include <vmm/ept.h>
+
+#include <inc/vcons.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+#include <kern/console.h>
+
+// First vCPU of the guest that gets console input, or 0.
+static envid_t vcons_guest;
+
+// Return the host address of guest e's console ring, or NULL if it has
+// none.  A copy-on-write ring (as in a clone) is copied first, since
+// the host writes it.
+static struct VconsRing *
+vcons_ring(struct Env *e) {
+	uint64_t gpa = vmx_vcpu_leader(e)->env_vmxinfo.vcons_ring;
+
+	if (!gpa)
+		return NULL;
+	return ept_gpa2hva_cached(e->env_pml4e, &e->env_vmxinfo, gpa, true);
+}
+
+// Move the host console's pending input into ring r, as much as fits.
+static void
+vcons_fill(struct VconsRing *r) {
+	int c;
+
+	while (r->vc_in_prod - r->vc_in_cons < VCONS_IN_SIZE &&
+	       (c = cons_getc()) != 0) {
+		r->vc_in[r->vc_in_prod % VCONS_IN_SIZE] = c;
+		r->vc_in_prod++;
+	}
+}
+
+// Make gpa, a page of guest e's memory, its console ring, and give it
+// the console's input.
+//
+// Returns 0 on success, -E_INVAL if gpa isn't a page of guest RAM.
+int
+vcons_setup(struct Env *e, uint64_t gpa) {
+	void *hva;
+
+	ept_gpa2hva(e->env_pml4e, (void *) gpa, &hva);
+	if (PGOFF(gpa) || hva == NULL)
+		return -E_INVAL;
+	vmx_vcpu_leader(e)->env_vmxinfo.vcons_ring = gpa;
+	vcons_focus(e);
+	return 0;
+}
+
+// Copy guest e's console output to the host's console, and pass it any
+// input waiting for it.
+//
+// Returns 0 on success, -E_INVAL if e has no console ring.
+int
+vcons_kick(struct Env *e) {
+	struct VconsRing *r;
+	uint32_t prod;
+
+	if (!(r = vcons_ring(e)))
+		return -E_INVAL;
+	// The guest may have overrun what we hadn't copied yet.
+	prod = r->vc_out_prod;
+	if (prod - r->vc_out_cons > VCONS_OUT_SIZE)
+		r->vc_out_cons = prod - VCONS_OUT_SIZE;
+	while (r->vc_out_cons != prod) {
+		cputchar(r->vc_out[r->vc_out_cons % VCONS_OUT_SIZE]);
+		r->vc_out_cons++;
+	}
+	if (vmx_vcpu_leader(e)->env_id == vcons_guest)
+		vcons_fill(r);
+	return 0;
+}
+
+// Give guest e the console's input, if it has a console ring.
+void
+vcons_focus(struct Env *e) {
+	struct Env *l = vmx_vcpu_leader(e);
+
+	if (l->env_vmxinfo.vcons_ring)
+		vcons_guest = l->env_id;
+}
+
+// A keyboard or serial interrupt, with that vector, came in.  If a live
+// guest has the console, move the input into its ring and raise the
+// interrupt in its first vCPU.
+//
+// Returns false if the host should handle the input itself.
+bool
+vcons_input(int vector) {
+	struct Env *e = &envs[ENVX(vcons_guest)];
+	struct VconsRing *r;
+
+	if (!vcons_guest || e->env_id != vcons_guest ||
+	    e->env_type != ENV_TYPE_GUEST)
+		return false;
+	// Paused, or not started yet.
+	if (e->env_status != ENV_RUNNABLE && e->env_status != ENV_RUNNING &&
+	    !(e->env_status == ENV_NOT_RUNNABLE && e->env_vmxinfo.halted))
+		return false;
+	if (!(r = vcons_ring(e)))
+		return false;
+	vcons_fill(r);
+	vmx_vcpu_extint(e, vector);
+	return true;
+}
@@ -0,0 +1,12 @@
+#ifndef JOS_VMM_VCONS_H
+#define JOS_VMM_VCONS_H
+
+#include <inc/types.h>
+#include <kern/env.h>
+
+int vcons_setup(struct Env *e, uint64_t gpa);
+int vcons_kick(struct Env *e);
+void vcons_focus(struct Env *e);
+bool vcons_input(int vector);
+
+#endif
@@ -0,0 +1,255 @@
+// Emulated devices for guests.
+//
+// Each device claims a range of I/O ports, or of guest-physical
+// addresses outside RAM, in one of the tables below.  A port range is
+// passed through to the hardware (its I/O bitmap bits stay clear, so
+// the guest's accesses don't exit), ignored (accesses exit, writes are
+// dropped and reads return all ones) or emulated by the device's
+// handler.  Ports no device claims are passed through.  An MMIO range
+// gets the EPT violations and misconfigurations at its addresses.
+//
+// Exits are dispatched through vdev_port, indexed by port, so adding a
+// device adds a table entry rather than a comparison on the exit path.
+// Device registers live in the guest's struct VmxVdevState, kept by
+// its first vCPU.
+
+#include <vmm/vdev.h>
+#include <vmm/vmx.h>
+#include <vmm/ept.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <kern/env.h>
+#include <kern/console.h>
+#include <kern/kclock.h>
+#include <kern/picirq.h>
+
+// Legacy ISA ports, the only ones the tables may claim.
+#define VDEV_NPORTS	0x400
+
+enum {
+	VDEV_PASSTHROUGH,
+	VDEV_IGNORE,
+	VDEV_EMULATE,
+};
+
+struct VdevPorts {
+	const char *name;
+	uint16_t base;
+	uint16_t count;
+	int policy;
+	// For VDEV_EMULATE: carry out an access of size bytes to port,
+	// writing *val or reading into it.  ginfo is the guest's first
+	// vCPU's.  Return false to shut the guest down.
+	bool (*io)(struct VmxGuestInfo *ginfo, uint16_t port, int size,
+		   bool in, uint32_t *val);
+};
+
+struct VdevMmio {
+	const char *name;
+	uint64_t base;
+	uint64_t len;
+	// Handle an EPT violation (with its exit qualification) or, if
+	// qual is 0, a misconfiguration at gpa.  Return false to shut the
+	// guest down.
+	bool (*fault)(epte_t *eptrt, struct VmxGuestInfo *ginfo, uint64_t gpa,
+		      uint64_t qual);
+};
+
+static bool vdev_cmos(struct VmxGuestInfo *ginfo, uint16_t port, int size,
+		      bool in, uint32_t *val);
+static bool vdev_pic(struct VmxGuestInfo *ginfo, uint16_t port, int size,
+		     bool in, uint32_t *val);
+static bool vdev_cga(epte_t *eptrt, struct VmxGuestInfo *ginfo, uint64_t gpa,
+		     uint64_t qual);
+
+static const struct VdevPorts vdev_ports[] = {
+	// The guest initializes the 8259s, but the host's belong to the
+	// host; device interrupts reach the guest as ExtINTs anyway.
+	{ "pic1",	IO_PIC1,	2,	VDEV_EMULATE,	vdev_pic },
+	{ "pic2",	IO_PIC2,	2,	VDEV_EMULATE,	vdev_pic },
+	// The guest keeps time with its emulated APIC, not the PIT.
+	{ "pit",	0x40,		4,	VDEV_IGNORE },
+	// The guest's memory size, from the NVRAM.
+	{ "cmos",	IO_RTC,		2,	VDEV_EMULATE,	vdev_cmos },
+	// Ctrl-Alt-Del in the guest mustn't reset the machine.
+	{ "sysctl",	0x92,		1,	VDEV_IGNORE },
+	// The IMCR, which the MP tables may ask the guest to program.
+	{ "imcr",	0x22,		2,	VDEV_IGNORE },
+	// The guest's console until it sets up its paravirtual one (see
+	// vmm/vcons.c): its input arrives on the host's keyboard and
+	// serial port, and ESC there pauses it.
+	{ "kbd",	0x60,		1,	VDEV_PASSTHROUGH },
+	{ "kbdctl",	0x64,		1,	VDEV_PASSTHROUGH },
+	{ "com1",	0x3F8,		8,	VDEV_PASSTHROUGH },
+	{ "lpt1",	0x378,		3,	VDEV_PASSTHROUGH },
+	{ "crtc",	0x3D4,		2,	VDEV_PASSTHROUGH },
+};
+#define NVDEV_PORTS (sizeof(vdev_ports) / sizeof(vdev_ports[0]))
+
+static const struct VdevMmio vdev_mmios[] = {
+	{ "cga",	CGA_BUF,	PGSIZE,	vdev_cga },
+};
+#define NVDEV_MMIOS (sizeof(vdev_mmios) / sizeof(vdev_mmios[0]))
+
+// Index in vdev_ports, plus one, of the device claiming each port, or 0.
+static uint8_t vdev_port[VDEV_NPORTS];
+static bool vdev_ready;
+
+static void
+vdev_init(void) {
+	int i, p;
+
+	static_assert(NVDEV_PORTS < 256);
+	for (i = 0; i < NVDEV_PORTS; i++)
+		for (p = vdev_ports[i].base;
+		     p < vdev_ports[i].base + vdev_ports[i].count; p++) {
+			assert(p < VDEV_NPORTS && !vdev_port[p]);
+			vdev_port[p] = i + 1;
+		}
+	vdev_ready = true;
+}
+
+// Make the guest's accesses to ignored and emulated ports exit.
+void
+vdev_io_bitmap(struct VmxGuestInfo *ginfo) {
+	int i, p;
+
+	if (!vdev_ready)
+		vdev_init();
+	for (i = 0; i < NVDEV_PORTS; i++) {
+		if (vdev_ports[i].policy == VDEV_PASSTHROUGH)
+			continue;
+		for (p = vdev_ports[i].base;
+		     p < vdev_ports[i].base + vdev_ports[i].count; p++)
+			ginfo->io_bmap_a[p / 64] |= 1ULL << (p % 64);
+	}
+}
+
+// Carry out the I/O instruction the guest exited on.  The caller steps
+// past it.
+bool
+vdev_io(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
+	uint64_t qual = vmcs_cache_read(ginfo, VMCS_CACHE_EXIT_QUALIFICATION);
+	uint16_t port = (qual >> 16) & 0xFFFF;
+	int size = (qual & 7) + 1;
+	bool in = BIT(qual, 3);
+	uint32_t mask = size == 4 ? ~0U : (1U << (size * 8)) - 1;
+	uint32_t val = tf->tf_regs.reg_rax & mask;
+	const struct VdevPorts *dev;
+
+	// String instructions would need their memory operands decoded.
+	if (port >= VDEV_NPORTS || !vdev_port[port] || BIT(qual, 4)) {
+		cprintf("vmm: unhandled I/O port %x (qualification %x)\n",
+			port, qual);
+		return false;
+	}
+	dev = &vdev_ports[vdev_port[port] - 1];
+	if (dev->policy == VDEV_IGNORE)
+		val = mask;
+	else if (!dev->io(&vmx_vcpu_leader(curenv)->env_vmxinfo, port, size,
+			  in, &val))
+		return false;
+	// IN only replaces the low size bytes of RAX, or all of EAX.
+	if (in && size == 4)
+		tf->tf_regs.reg_rax = val;
+	else if (in)
+		tf->tf_regs.reg_rax = (tf->tf_regs.reg_rax & ~(uint64_t) mask) |
+			(val & mask);
+	return true;
+}
+
+// Handle an EPT violation or misconfiguration outside guest RAM.
+bool
+vdev_mmio(epte_t *eptrt, struct VmxGuestInfo *ginfo, uint64_t gpa,
+	  uint64_t qual) {
+	int i;
+
+	for (i = 0; i < NVDEV_MMIOS; i++)
+		if (gpa >= vdev_mmios[i].base &&
+		    gpa < vdev_mmios[i].base + vdev_mmios[i].len)
+			return vdev_mmios[i].fault(eptrt, ginfo, gpa, qual);
+	cprintf("vmm: no device at gpa %x\n", gpa);
+	return false;
+}
+
+// The CMOS: just the NVRAM bytes giving the memory size.
+static bool
+vdev_cmos(struct VmxGuestInfo *ginfo, uint16_t port, int size, bool in,
+	  uint32_t *val) {
+	struct VmxVdevState *st = &ginfo->vdev;
+	uint64_t extkb = ginfo->phys_sz / 1024 - 1024;
+
+	if (port == IO_RTC) {
+		if (!in)
+			st->cmos_index = *val & 0x7F;
+		else
+			*val = st->cmos_index;
+		return true;
+	}
+	// Writes, like the warm reset code an AP boot sets, are dropped.
+	if (!in)
+		return true;
+	switch (st->cmos_index) {
+	case NVRAM_BASELO:
+		*val = 640 & 0xFF;
+		return true;
+	case NVRAM_BASEHI:
+		*val = (640 >> 8) & 0xFF;
+		return true;
+	case NVRAM_EXTLO:
+		*val = extkb & 0xFF;
+		return true;
+	case NVRAM_EXTHI:
+		*val = (extkb >> 8) & 0xFF;
+		return true;
+	}
+	cprintf("vmm: unemulated CMOS register %x\n", st->cmos_index);
+	return false;
+}
+
+// An 8259 that goes through initialization and keeps its interrupt
+// mask, but never raises an interrupt.
+static bool
+vdev_pic(struct VmxGuestInfo *ginfo, uint16_t port, int size, bool in,
+	 uint32_t *val) {
+	struct VmxVdevState *st = &ginfo->vdev;
+	int pic = (port & ~1) == IO_PIC2;
+
+	if (in) {
+		// The IRR and ISR are always empty.
+		*val = (port & 1) ? st->pic_imr[pic] : 0;
+		return true;
+	}
+	if (!(port & 1)) {
+		// ICW1 starts initialization: ICW2, ICW3 and, if asked
+		// for, ICW4 follow.  OCW2 and OCW3 are no-ops here.
+		if (*val & 0x10) {
+			st->pic_icw[pic] = (*val & 1) ? 3 : 2;
+			st->pic_imr[pic] = 0;
+		}
+	} else if (st->pic_icw[pic])
+		st->pic_icw[pic]--;
+	else
+		st->pic_imr[pic] = *val;
+	return true;
+}
+
+// The CGA text buffer: the guest writes the host's, so its output
+// shows on the screen.
+static bool
+vdev_cga(epte_t *eptrt, struct VmxGuestInfo *ginfo, uint64_t gpa,
+	 uint64_t qual) {
+	int r;
+
+	r = ept_map_hva2gpa(eptrt, (void *) (KERNBASE + CGA_BUF),
+			    (void *) CGA_BUF, __EPTE_FULL, 0);
+	if (r < 0) {
+		cprintf("vmm: mapping the CGA buffer: %e\n", r);
+		return false;
+	}
+	return true;
+}
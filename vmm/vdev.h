@@ -0,0 +1,14 @@
+#ifndef JOS_VMM_VDEV_H
+#define JOS_VMM_VDEV_H
+
+#include <inc/types.h>
+#include <inc/trap.h>
+#include <inc/vmx.h>
+#include <vmm/ept.h>
+
+void vdev_io_bitmap(struct VmxGuestInfo *ginfo);
+bool vdev_io(struct Trapframe *tf, struct VmxGuestInfo *ginfo);
+bool vdev_mmio(epte_t *eptrt, struct VmxGuestInfo *ginfo, uint64_t gpa,
+	       uint64_t qual);
+
+#endif
@@ -0,0 +1,345 @@
+// Emulated local APIC for guests.
+//
+// Each guest has a page of APIC registers laid out like the real APIC's
+// MMIO page, which the guest reads and writes through the x2APIC MSRs.
+// Its timer counts down in TSC cycles and is checked before every VM
+// entry and on the host's ticks.  Interrupts it raises are injected when
+// the guest can take them; where the processor has virtual-interrupt
+// delivery, the register page doubles as the virtual-APIC page, the
+// processor delivers them itself and EOIs don't exit at all.
+//
+// Host device interrupts that arrive while a guest runs come from the
+// 8259 in virtual-wire mode, so they are passed on as ExtINTs: they
+// bypass the APIC's priorities and need no EOI.
+
+#include <vmm/vlapic.h>
+#include <vmm/vmx.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+
+#define REG(ginfo, off)	((ginfo)->vlapic[(off) / 4])
+
+// Highest bit set in the 256-bit vector made of words[0], words[stride],
+// ..., words[7 * stride], or -1.
+static int
+highest_bit(uint32_t *words, int stride)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		if (words[i * stride])
+			return i * 32 + 31 - __builtin_clz(words[i * stride]);
+	return -1;
+}
+
+// Highest vector in the ISR, TMR or IRR.
+static int
+vlapic_highest(struct VmxGuestInfo *ginfo, int base)
+{
+	return highest_bit(&REG(ginfo, base), 4);
+}
+
+// Other vCPUs raise interrupts here while the processor may be updating
+// the page for this one, so bits are changed atomically.
+static void
+vlapic_bit(struct VmxGuestInfo *ginfo, int base, int vector, bool set)
+{
+	uint32_t *word = &REG(ginfo, base + 0x10 * (vector / 32));
+
+	if (set)
+		__sync_fetch_and_or(word, 1U << (vector % 32));
+	else
+		__sync_fetch_and_and(word, ~(1U << (vector % 32)));
+}
+
+// Processor priority: the task priority, or the class of the interrupt
+// being serviced if that's higher.
+static uint32_t
+vlapic_ppr(struct VmxGuestInfo *ginfo)
+{
+	uint32_t tpr = REG(ginfo, VLAPIC_TPR) & 0xff;
+	int isrv = vlapic_highest(ginfo, VLAPIC_ISR);
+
+	if (isrv < 0 || (tpr & 0xf0) >= (isrv & 0xf0))
+		return tpr;
+	return isrv & 0xf0;
+}
+
+// The highest requested interrupt, if its priority class beats the
+// processor priority; else -1.
+static int
+vlapic_deliverable(struct VmxGuestInfo *ginfo)
+{
+	int irrv = vlapic_highest(ginfo, VLAPIC_IRR);
+
+	if (irrv < 0 || (irrv & 0xf0) <= (vlapic_ppr(ginfo) & 0xf0))
+		return -1;
+	return irrv;
+}
+
+// TSC cycles per timer count, from the divide configuration register.
+static uint64_t
+vlapic_timer_div(struct VmxGuestInfo *ginfo)
+{
+	uint32_t tdcr = REG(ginfo, VLAPIC_TDCR);
+	uint32_t shift = (tdcr & 0x3) | ((tdcr & 0x8) >> 1);
+
+	return shift == 7 ? 1 : 2 << shift;
+}
+
+// (Re)start the timer from its initial count; a count of 0 stops it.
+static void
+vlapic_timer_arm(struct VmxGuestInfo *ginfo)
+{
+	uint64_t count = REG(ginfo, VLAPIC_TICR);
+
+	ginfo->vlapic_deadline =
+		count ? read_tsc() + count * vlapic_timer_div(ginfo) : 0;
+}
+
+// Send an IPI.  Fixed interrupts, INITs and STARTUPs are delivered,
+// by vmx_vcpu_ipi, to the vCPUs of this guest they are meant for.
+static void
+vlapic_ipi(struct VmxGuestInfo *ginfo, uint64_t icr)
+{
+	switch (icr & VLAPIC_ICR_DELMODE) {
+	case VLAPIC_ICR_INIT:
+		// An INIT de-assert only synchronizes arbitration IDs.
+		if (!(icr & VLAPIC_ICR_ASSERT))
+			return;
+		/* fall through */
+	case VLAPIC_ICR_FIXED:
+	case VLAPIC_ICR_STARTUP:
+		vmx_vcpu_ipi(ginfo, icr);
+	}
+}
+
+// Reset the guest's APIC to its power-up state, with APIC ID id.
+void
+vlapic_init(struct VmxGuestInfo *ginfo, uint32_t id)
+{
+	int off;
+
+	memset(ginfo->vlapic, 0, PGSIZE);
+	memset(ginfo->vlapic_extint, 0, sizeof(ginfo->vlapic_extint));
+	ginfo->vlapic_deadline = 0;
+
+	REG(ginfo, VLAPIC_ID) = id;
+	REG(ginfo, VLAPIC_VER) = 0x00050014;	// 6 LVT entries
+	REG(ginfo, VLAPIC_LDR) = ((id >> 4) << 16) | (1 << (id & 0xf));
+	REG(ginfo, VLAPIC_SVR) = 0xff;
+	REG(ginfo, VLAPIC_LVT_CMCI) = VLAPIC_LVT_MASKED;
+	for (off = VLAPIC_LVT_TIMER; off <= VLAPIC_LVT_ERROR; off += 0x10)
+		REG(ginfo, off) = VLAPIC_LVT_MASKED;
+}
+
+// Emulate RDMSR of an x2APIC register.  Returns false if msr isn't one.
+bool
+vlapic_rdmsr(struct VmxGuestInfo *ginfo, uint32_t msr, uint64_t *val)
+{
+	uint32_t off = (msr - VLAPIC_MSR_BASE) << 4;
+	uint64_t now;
+
+	if (msr < VLAPIC_MSR_BASE || msr >= VLAPIC_MSR_END)
+		return false;
+	switch (off) {
+	case VLAPIC_PPR:
+		*val = vlapic_ppr(ginfo);
+		return true;
+	case VLAPIC_TCCR:
+		now = read_tsc();
+		*val = 0;
+		if (ginfo->vlapic_deadline > now)
+			*val = (ginfo->vlapic_deadline - now) /
+				vlapic_timer_div(ginfo);
+		return true;
+	case VLAPIC_ICR:
+		*val = REG(ginfo, VLAPIC_ICR) |
+			(uint64_t) REG(ginfo, VLAPIC_ICRHI) << 32;
+		return true;
+	case VLAPIC_ID:
+	case VLAPIC_VER:
+	case VLAPIC_TPR:
+	case VLAPIC_LDR:
+	case VLAPIC_SVR:
+	case VLAPIC_ESR:
+	case VLAPIC_LVT_CMCI:
+	case VLAPIC_LVT_TIMER:
+	case VLAPIC_LVT_THERMAL:
+	case VLAPIC_LVT_PMC:
+	case VLAPIC_LVT_LINT0:
+	case VLAPIC_LVT_LINT1:
+	case VLAPIC_LVT_ERROR:
+	case VLAPIC_TICR:
+	case VLAPIC_TDCR:
+		*val = REG(ginfo, off);
+		return true;
+	}
+	// The ISR, TMR and IRR.
+	if (off >= VLAPIC_ISR && off < VLAPIC_ESR) {
+		*val = REG(ginfo, off);
+		return true;
+	}
+	return false;
+}
+
+// Emulate WRMSR of an x2APIC register.  Returns false if msr isn't one
+// that can be written.
+bool
+vlapic_wrmsr(struct VmxGuestInfo *ginfo, uint32_t msr, uint64_t val)
+{
+	uint32_t off = (msr - VLAPIC_MSR_BASE) << 4;
+
+	if (msr < VLAPIC_MSR_BASE || msr >= VLAPIC_MSR_END)
+		return false;
+	switch (off) {
+	case VLAPIC_TPR:
+		REG(ginfo, off) = val & 0xff;
+		return true;
+	case VLAPIC_EOI:
+		vlapic_eoi(ginfo);
+		return true;
+	case VLAPIC_SVR:
+		REG(ginfo, off) = val & 0x11ff;
+		return true;
+	case VLAPIC_ESR:
+		REG(ginfo, off) = 0;
+		return true;
+	case VLAPIC_ICR:
+		REG(ginfo, VLAPIC_ICR) = val;
+		REG(ginfo, VLAPIC_ICRHI) = val >> 32;
+		vlapic_ipi(ginfo, val);
+		return true;
+	case VLAPIC_LVT_CMCI:
+	case VLAPIC_LVT_TIMER:
+	case VLAPIC_LVT_THERMAL:
+	case VLAPIC_LVT_PMC:
+	case VLAPIC_LVT_LINT0:
+	case VLAPIC_LVT_LINT1:
+	case VLAPIC_LVT_ERROR:
+		REG(ginfo, off) = val;
+		return true;
+	case VLAPIC_TICR:
+		REG(ginfo, off) = val;
+		vlapic_timer_arm(ginfo);
+		return true;
+	case VLAPIC_TDCR:
+		REG(ginfo, off) = val & 0xb;
+		return true;
+	case VLAPIC_SELF_IPI:
+		vlapic_set_irr(ginfo, val & 0xff);
+		return true;
+	}
+	return false;
+}
+
+// Raise a fixed interrupt on the guest's APIC.
+void
+vlapic_set_irr(struct VmxGuestInfo *ginfo, int vector)
+{
+	// Vectors 0-15 are reserved.
+	if (vector >= 16)
+		vlapic_bit(ginfo, VLAPIC_IRR, vector, true);
+}
+
+// Pass on a host device interrupt, which the guest sees as an ExtINT.
+void
+vlapic_extint(struct VmxGuestInfo *ginfo, int vector)
+{
+	ginfo->vlapic_extint[vector / 32] |= 1U << (vector % 32);
+}
+
+// End the interrupt being serviced.
+void
+vlapic_eoi(struct VmxGuestInfo *ginfo)
+{
+	int isrv = vlapic_highest(ginfo, VLAPIC_ISR);
+
+	if (isrv >= 0)
+		vlapic_bit(ginfo, VLAPIC_ISR, isrv, false);
+}
+
+// Fire the guest's timer if it is due.
+void
+vlapic_timer(struct VmxGuestInfo *ginfo)
+{
+	uint32_t lvt = REG(ginfo, VLAPIC_LVT_TIMER);
+	uint64_t now, period;
+
+	if (!ginfo->vlapic_deadline)
+		return;
+	now = read_tsc();
+	if (now < ginfo->vlapic_deadline)
+		return;
+	if (!(lvt & VLAPIC_LVT_MASKED))
+		vlapic_set_irr(ginfo, lvt & 0xff);
+	if (!(lvt & VLAPIC_TIMER_PERIODIC)) {
+		ginfo->vlapic_deadline = 0;
+		return;
+	}
+	period = REG(ginfo, VLAPIC_TICR) * vlapic_timer_div(ginfo);
+	ginfo->vlapic_deadline += period;
+	// Ticks missed while the guest was descheduled are dropped.
+	if (ginfo->vlapic_deadline <= now)
+		ginfo->vlapic_deadline = now + period;
+}
+
+// Does the guest have an interrupt to take?
+bool
+vlapic_pending(struct VmxGuestInfo *ginfo)
+{
+	return highest_bit(ginfo->vlapic_extint, 1) >= 0 ||
+		vlapic_deliverable(ginfo) >= 0;
+}
+
+// Called before each VM entry, with the guest's VMCS current: inject
+// the next pending interrupt if the guest can take it now, and if any
+// remain, exit as soon as it can take another (handle_interrupt_window).
+void
+vlapic_inject(struct VmxGuestInfo *ginfo)
+{
+	uint32_t ctls;
+	int vector, isrv;
+	bool extint;
+
+	vlapic_timer(ginfo);
+	if (ginfo->vlapic_apicv) {
+		// The processor delivers the APIC's interrupts itself;
+		// tell it which are requested and in service.
+		vector = vlapic_highest(ginfo, VLAPIC_IRR);
+		isrv = vlapic_highest(ginfo, VLAPIC_ISR);
+		vmcs_write16(VMCS_16BIT_GUEST_INTERRUPT_STATUS,
+			     (isrv < 0 ? 0 : isrv) << 8 | (vector < 0 ? 0 : vector));
+	}
+
+	vector = highest_bit(ginfo->vlapic_extint, 1);
+	extint = vector >= 0;
+	if (!extint && !ginfo->vlapic_apicv)
+		vector = vlapic_deliverable(ginfo);
+	if (vector >= 0 &&
+	    (vmcs_cache_read(ginfo, VMCS_CACHE_GUEST_RFLAGS) & FL_IF) &&
+	    !(vmcs_cache_read(ginfo, VMCS_CACHE_GUEST_INTR_STATE) &
+	      (VMCS_INTERRUPTIBILITY_STI | VMCS_INTERRUPTIBILITY_MOVSS)) &&
+	    !(vmcs_cache_read(ginfo, VMCS_CACHE_ENTRY_INTR_INFO) & VMCS_INTR_INFO_VALID)) {
+		vmcs_cache_write(ginfo, VMCS_CACHE_ENTRY_INTR_INFO,
+				 VMCS_INTR_INFO_VALID | VMCS_INTR_TYPE_EXT_INT | vector);
+		if (extint)
+			ginfo->vlapic_extint[vector / 32] &= ~(1U << (vector % 32));
+		else {
+			vlapic_bit(ginfo, VLAPIC_IRR, vector, false);
+			vlapic_bit(ginfo, VLAPIC_ISR, vector, true);
+		}
+		vector = highest_bit(ginfo->vlapic_extint, 1);
+		if (vector < 0 && !ginfo->vlapic_apicv)
+			vector = vlapic_deliverable(ginfo);
+	}
+
+	ctls = vmcs_cache_read(ginfo, VMCS_CACHE_PROC_CTLS);
+	if (vector >= 0)
+		ctls |= VMCS_PROC_BASED_VMEXEC_CTL_INTRWINEXIT;
+	else
+		ctls &= ~VMCS_PROC_BASED_VMEXEC_CTL_INTRWINEXIT;
+	vmcs_cache_write(ginfo, VMCS_CACHE_PROC_CTLS, ctls);
+}
@@ -0,0 +1,59 @@
+#ifndef JOS_VMM_VLAPIC_H
+#define JOS_VMM_VLAPIC_H
+
+#include <inc/types.h>
+#include <inc/vmx.h>
+
+// The emulated local APIC is reached through the x2APIC MSRs: register
+// offset off of the APIC's MMIO page is MSR VLAPIC_MSR_BASE + off / 16.
+#define VLAPIC_MSR_BASE		0x800
+#define VLAPIC_MSR_END		0x900
+
+// Register offsets, as in the APIC's MMIO page.
+#define VLAPIC_ID		0x020
+#define VLAPIC_VER		0x030
+#define VLAPIC_TPR		0x080
+#define VLAPIC_PPR		0x0A0
+#define VLAPIC_EOI		0x0B0
+#define VLAPIC_LDR		0x0D0
+#define VLAPIC_SVR		0x0F0
+#define VLAPIC_ISR		0x100
+#define VLAPIC_TMR		0x180
+#define VLAPIC_IRR		0x200
+#define VLAPIC_ESR		0x280
+#define VLAPIC_LVT_CMCI		0x2F0
+#define VLAPIC_ICR		0x300
+#define VLAPIC_ICRHI		0x310
+#define VLAPIC_LVT_TIMER	0x320
+#define VLAPIC_LVT_THERMAL	0x330
+#define VLAPIC_LVT_PMC		0x340
+#define VLAPIC_LVT_LINT0	0x350
+#define VLAPIC_LVT_LINT1	0x360
+#define VLAPIC_LVT_ERROR	0x370
+#define VLAPIC_TICR		0x380
+#define VLAPIC_TCCR		0x390
+#define VLAPIC_TDCR		0x3E0
+#define VLAPIC_SELF_IPI		0x3F0
+
+#define VLAPIC_LVT_MASKED	0x00010000
+#define VLAPIC_TIMER_PERIODIC	0x00020000
+#define VLAPIC_ICR_SELF		0x00040000	// Destination shorthands
+#define VLAPIC_ICR_ALL		0x00080000
+#define VLAPIC_ICR_OTHERS	0x000C0000
+#define VLAPIC_ICR_DELMODE	0x00000700
+#define VLAPIC_ICR_FIXED	0x00000000	// Delivery modes
+#define VLAPIC_ICR_INIT		0x00000500
+#define VLAPIC_ICR_STARTUP	0x00000600
+#define VLAPIC_ICR_ASSERT	0x00004000
+
+void vlapic_init(struct VmxGuestInfo *ginfo, uint32_t id);
+bool vlapic_rdmsr(struct VmxGuestInfo *ginfo, uint32_t msr, uint64_t *val);
+bool vlapic_wrmsr(struct VmxGuestInfo *ginfo, uint32_t msr, uint64_t val);
+void vlapic_set_irr(struct VmxGuestInfo *ginfo, int vector);
+void vlapic_extint(struct VmxGuestInfo *ginfo, int vector);
+void vlapic_eoi(struct VmxGuestInfo *ginfo);
+void vlapic_timer(struct VmxGuestInfo *ginfo);
+bool vlapic_pending(struct VmxGuestInfo *ginfo);
+void vlapic_inject(struct VmxGuestInfo *ginfo);
+
+#endif
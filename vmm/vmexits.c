@@ -14,6 +14,13 @@
 #include <kern/syscall.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/futex.h>
+#include <kern/sched.h>
+#include <inc/vblk.h>
+#include <kern/trap.h>
+#include <vmm/vlapic.h>
+#include <vmm/vdev.h>
+#include <vmm/vcons.h>
 
 static int vmdisk_number = 0;	//this number assign to the vm
 int 
@@ -21,15 +28,23 @@ vmx_get_vmdisk_number() {
 	return vmdisk_number;
 }
 
-void
+int
 vmx_incr_vmdisk_number() {
-	vmdisk_number++;
+	return ++vmdisk_number;
 }
+// Step the guest past the instruction that caused this exit.
+static void
+skip_instruction(struct VmxGuestInfo *ginfo) {
+	vmcs_cache_write(ginfo, VMCS_CACHE_GUEST_RIP,
+			 vmcs_cache_read(ginfo, VMCS_CACHE_GUEST_RIP) +
+			 vmcs_cache_read(ginfo, VMCS_CACHE_EXIT_INSTR_LEN));
+}
+
 bool
 find_msr_in_region(uint32_t msr_idx, uintptr_t *area, int area_sz, struct vmx_msr_entry **msr_entry) {
 	struct vmx_msr_entry *entry = (struct vmx_msr_entry *)area;
 	int i;
-	for(i=0; i<area_sz; ++i) {
+	for(i=0; i<area_sz; ++i, ++entry) {
 		if(entry->msr_index == msr_idx) {
 			*msr_entry = entry;
 			return true;
@@ -38,81 +53,119 @@ find_msr_in_region(uint32_t msr_idx, uintptr_t *area, int area_sz, struct vmx_ms
 	return false;
 }
 
+// The guest can take interrupts again; the next one is injected by
+// vlapic_inject on the way back in.
 bool
-handle_interrupt_window(struct Trapframe *tf, struct VmxGuestInfo *ginfo, uint32_t host_vector) {
-	uint64_t rflags;
+handle_interrupt_window(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
 	uint32_t procbased_ctls_or;
 
-	procbased_ctls_or = vmcs_read32( VMCS_32BIT_CONTROL_PROCESSOR_BASED_VMEXEC_CONTROLS );
+	procbased_ctls_or = vmcs_cache_read( ginfo, VMCS_CACHE_PROC_CTLS );
 
         //disable the interrupt window exiting
         procbased_ctls_or &= ~(VMCS_PROC_BASED_VMEXEC_CTL_INTRWINEXIT); 
 
-        vmcs_write32( VMCS_32BIT_CONTROL_PROCESSOR_BASED_VMEXEC_CONTROLS, 
-		      procbased_ctls_or);
-        //write back the host_vector, which can insert a virtual interrupt
-	vmcs_write32( VMCS_32BIT_CONTROL_VMENTRY_INTERRUPTION_INFO , host_vector);
+        vmcs_cache_write( ginfo, VMCS_CACHE_PROC_CTLS, procbased_ctls_or );
 	return true;
 }
+
+// A host interrupt arrived while the guest ran.  The host's timer tick
+// is the host's own business: the guest has its emulated APIC's timer.
+// Device interrupts are passed on to the guest, except that console
+// input goes to the guest with the paravirtual console, if any.
 bool
 handle_interrupts(struct Trapframe *tf, struct VmxGuestInfo *ginfo, uint32_t host_vector) {
-	uint64_t rflags;
-	uint32_t procbased_ctls_or;
-	rflags = vmcs_read64(VMCS_GUEST_RFLAGS);
-
-	if ( !(rflags & (0x1 << 9)) ) {	//we have to wait the interrupt window open
-		//get the interrupt info
+	int vector = host_vector & 0xff;
 
-		procbased_ctls_or = vmcs_read32( VMCS_32BIT_CONTROL_PROCESSOR_BASED_VMEXEC_CONTROLS);
+	if (vector == IRQ_OFFSET + IRQ_TIMER) {
+		timer_intr();
+		return true;
+	}
+	// Sent only to get us out of the guest (see ept_invalidate).
+	if (vector == IRQ_OFFSET + IRQ_KICK) {
+		lapic_eoi();
+		return true;
+	}
+	if ((vector == IRQ_OFFSET + IRQ_KBD ||
+	     vector == IRQ_OFFSET + IRQ_SERIAL) && vcons_input(vector))
+		return true;
+	vlapic_extint(ginfo, vector);
+	return true;
+}
 
-		//disable the interrupt window exiting
-		procbased_ctls_or |= VMCS_PROC_BASED_VMEXEC_CTL_INTRWINEXIT; 
+// Emulate HLT.  A guest halted with interrupts disabled could never be
+// woken, so that still shuts it down; the guest monitor's "exit" relies
+// on it.  Otherwise poll for a pending interrupt for the guest's
+// halt-polling window, and if none comes, block the guest until its
+// emulated APIC has one, which is checked on the host's timer ticks
+// (see vmx_halt_wakeup).
+bool
+handle_hlt(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
+	uint64_t intr_state, start, now;
 
-		vmcs_write32( VMCS_32BIT_CONTROL_PROCESSOR_BASED_VMEXEC_CONTROLS, 
-			      procbased_ctls_or);
+	if (!(vmcs_cache_read(ginfo, VMCS_CACHE_GUEST_RFLAGS) & FL_IF)) {
+		cprintf("\nHLT in guest, exiting guest.\n");
+		env_destroy(curenv);
+		return true;
 	}
-	else {	//revector the host vector to the guest vector
+	skip_instruction(ginfo);
+	// An idle loop's "sti; hlt" leaves the guest in the STI shadow,
+	// which would block the interrupt that wakes it.
+	intr_state = vmcs_cache_read(ginfo, VMCS_CACHE_GUEST_INTR_STATE);
+	vmcs_cache_write(ginfo, VMCS_CACHE_GUEST_INTR_STATE,
+			 intr_state & ~(VMCS_INTERRUPTIBILITY_STI |
+					VMCS_INTERRUPTIBILITY_MOVSS));
+
+	// Host interrupts are disabled here, so one that is pending shows
+	// up in the local APIC; resuming the guest takes it at once.
+	start = now = read_tsc();
+	do {
+		vlapic_timer(ginfo);
+		if (vlapic_pending(ginfo) || lapic_intr_pending())
+			return true;
+		asm volatile("pause");
+		now = read_tsc();
+	} while (now - start < ginfo->halt_poll);
 
-		vmcs_write32( VMCS_32BIT_CONTROL_VMENTRY_INTERRUPTION_INFO , host_vector);
-	}
+	ginfo->halted = true;
+	ginfo->halt_tsc = start;
+	curenv->env_status = ENV_NOT_RUNNABLE;
 	return true;
 }
 
+// Emulate RDMSR of a shadowed MSR (see msr_setup), from the guest's copy
+// in the MSR store area, or of an x2APIC register.  Other MSRs kill the
+// guest.
 bool
 handle_rdmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
 	uint64_t msr = tf->tf_regs.reg_rcx;
-	if(msr == EFER_MSR) {
-		// TODO: setup msr_bitmap to ignore EFER_MSR
-		uint64_t val;
-		struct vmx_msr_entry *entry;
-		bool r = find_msr_in_region(msr, ginfo->msr_guest_area, ginfo->msr_count, &entry);
-		assert(r);
-		val = entry->msr_value;
+	struct vmx_msr_entry *entry;
+	uint64_t val;
 
-		tf->tf_regs.reg_rdx = val << 32;
-		tf->tf_regs.reg_rax = val & 0xFFFFFFFF;
+	if(find_msr_in_region(msr, ginfo->msr_guest_area, ginfo->msr_count, &entry))
+		val = entry->msr_value;
+	else if(!vlapic_rdmsr(ginfo, msr, &val))
+		return false;
 
-		tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
-		return true;
-	}
+	tf->tf_regs.reg_rdx = val >> 32;
+	tf->tf_regs.reg_rax = val & 0xFFFFFFFF;
 
-	return false;
+	skip_instruction(ginfo);
+	return true;
 }
 
+// Emulate WRMSR of a shadowed MSR into the guest's copy, which is
+// loaded on the next VM entry, or of an x2APIC register.
 bool 
 handle_wrmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
 	uint64_t msr = tf->tf_regs.reg_rcx;
-	if(msr == EFER_MSR) {
+	struct vmx_msr_entry *entry;
+	if(find_msr_in_region(msr, ginfo->msr_guest_area, ginfo->msr_count, &entry)) {
 
 		uint64_t cur_val, new_val;
-		struct vmx_msr_entry *entry;
-		bool r = 
-			find_msr_in_region(msr, ginfo->msr_guest_area, ginfo->msr_count, &entry);
-		assert(r);
 		cur_val = entry->msr_value;
 
 		new_val = (tf->tf_regs.reg_rdx << 32)|tf->tf_regs.reg_rax;
-		if(BIT(cur_val, EFER_LME) == 0 && BIT(new_val, EFER_LME) == 1) {
+		if(msr == EFER_MSR && BIT(cur_val, EFER_LME) == 0 && BIT(new_val, EFER_LME) == 1) {
 			// Long mode enable.
 			uint32_t entry_ctls = vmcs_read32( VMCS_32BIT_CONTROL_VMENTRY_CONTROLS );
 			//entry_ctls |= VMCS_VMENTRY_x64_GUEST;
@@ -122,7 +175,12 @@ handle_wrmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
 		}
 
 		entry->msr_value = new_val;
-		tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
+		skip_instruction(ginfo);
+		return true;
+	}
+	if(vlapic_wrmsr(ginfo, msr, (tf->tf_regs.reg_rdx << 32) |
+			(tf->tf_regs.reg_rax & 0xFFFFFFFF))) {
+		skip_instruction(ginfo);
 		return true;
 	}
 
@@ -131,73 +189,42 @@ handle_wrmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
 
 bool
 handle_eptviolation(uint64_t *eptrt, struct VmxGuestInfo *ginfo) {
-	uint64_t gpa = vmcs_read64(VMCS_64BIT_GUEST_PHYSICAL_ADDR);
+	uint64_t gpa = vmcs_cache_read(ginfo, VMCS_CACHE_GUEST_PHYS_ADDR);
+	uint64_t qual = vmcs_cache_read(ginfo, VMCS_CACHE_EXIT_QUALIFICATION);
 	int r;
+
+	// A write to memory shared copy-on-write with a snapshot, or one
+	// through a translation that was stale.
+	if ((qual & VMX_EPT_FAULT_WRITE) &&
+	    (r = ept_cow_break(eptrt, (void *) gpa)) != 0) {
+		if (r < 0) {
+			cprintf("vmm: handle_eptviolation: Failed to copy gpa %x: %e\n", gpa, r);
+			return false;
+		}
+		return true;
+	}
 	if(gpa < 0xA0000 || (gpa >= 0x100000 && gpa < ginfo->phys_sz)) 
 	{
-		// Allocate a new page to the guest.
-		struct PageInfo *p = page_alloc(0);
-		if(!p) {
-			cprintf("vmm: handle_eptviolation: Failed to allocate a page for guest---out of memory.\n");
+		// Allocate new memory to the guest, a whole 2MB page if we can.
+		r = ept_alloc_gpa(eptrt, ginfo, gpa);
+		if(r < 0) {
+			cprintf("vmm: handle_eptviolation: Failed to back gpa %x: %e\n", gpa, r);
 			return false;
 		}
-		p->pp_ref += 1;
-		r = ept_map_hva2gpa(eptrt, 
-				    page2kva(p), (void *)ROUNDDOWN(gpa, PGSIZE), __EPTE_FULL, 0);
-		assert(r >= 0);
-		/* cprintf("EPT violation for gpa:%x mapped KVA:%x\n", gpa, page2kva(p)); */
-		return true;
-	} else if (gpa >= CGA_BUF && gpa < CGA_BUF + PGSIZE) {
-		// FIXME: This give direct access to VGA MMIO region.
-		r = ept_map_hva2gpa(eptrt, 
-				    (void *)(KERNBASE + CGA_BUF), (void *)CGA_BUF, __EPTE_FULL, 0);
-		assert(r >= 0);
+		/* cprintf("EPT violation for gpa:%x backed %d pages\n", gpa, r); */
 		return true;
 	}
-	cprintf("vmm: handle_eptviolation: Case 2, gpa %x\n", gpa);
-	return false;
+	// Anything else is a device's (see vmm/vdev.c).
+	return vdev_mmio(eptrt, ginfo, gpa, qual);
 }
 
+// The ports' devices are in vmm/vdev.c.
 bool
 handle_ioinstr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
-	static int port_iortc;
-
-	uint64_t qualification = vmcs_read64(VMCS_VMEXIT_QUALIFICATION);
-	int port_number = (qualification >> 16) & 0xFFFF;
-	bool is_in = BIT(qualification, 3);
-	bool handled = false;
-
-	// handle reading physical memory from the CMOS.
-	if(port_number == IO_RTC) {
-		if(!is_in) {
-			port_iortc = tf->tf_regs.reg_rax;
-			handled = true;
-		}
-	} else if (port_number == IO_RTC + 1) {
-		if(is_in) {
-			if(port_iortc == NVRAM_BASELO) {
-				tf->tf_regs.reg_rax = 640 & 0xFF;
-				handled = true;
-			} else if (port_iortc == NVRAM_BASEHI) {
-				tf->tf_regs.reg_rax = (640 >> 8) & 0xFF;
-				handled = true;
-			} else if (port_iortc == NVRAM_EXTLO) {
-				tf->tf_regs.reg_rax = ((ginfo->phys_sz / 1024) - 1024) & 0xFF;
-				handled = true;
-			} else if (port_iortc == NVRAM_EXTHI) {
-				tf->tf_regs.reg_rax = (((ginfo->phys_sz / 1024) - 1024) >> 8) & 0xFF;
-				handled = true;
-			}
-		}
-
-	} 
-	if(handled) {
-		tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
-		return true;
-	} else {
-		cprintf("%x %x\n", qualification, port_iortc);
+	if (!vdev_io(tf, ginfo))
 		return false;
-	}
+	skip_instruction(ginfo);
+	return true;
 }
 
 // Emulate a cpuid instruction.
@@ -228,6 +255,12 @@ handle_cpuid(struct Trapframe *tf, struct VmxGuestInfo *ginfo)
 	if (info) {
 		ecx &= ~0x20U;
 	}
+	// The guest's local APIC is the emulated one, reached as an x2APIC.
+	if (info == 1)
+		ecx |= 1U << 21;
+	// Without the RDTSCP control, RDTSCP would raise #UD.
+	if (info == 0x80000001 && !vmx_rdtscp())
+		edx &= ~(1U << 27);
 
 	// then store the output in the trapframe
 	tf->tf_regs.reg_rax = eax;
@@ -236,219 +269,456 @@ handle_cpuid(struct Trapframe *tf, struct VmxGuestInfo *ginfo)
 	tf->tf_regs.reg_rdx = edx;
 
 	// update the instruction pointer
-    tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
+    skip_instruction(ginfo);
 	return true;
 }
 
-// Handle vmcall traps from the guest.
-// We currently support 3 traps: read the virtual e820 map, 
-//   and use host-level IPC (send andrecv).
-//
-// Return true if the exit is handled properly, false if the VM should be terminated.
-//
-// Finally, you need to increment the program counter in the trap frame.
-// 
-// Hint: The TA's solution does not hard-code the length of the cpuid instruction.//
+// Hypercalls: a guest's VMCALL, with the code in rax and arguments in
+// rbx, rcx, rdx and rsi.  Each code has a handler in the table below,
+// which returns one of these.
+enum {
+	VMCALL_DONE,		// Step the guest past the VMCALL
+	VMCALL_STEPPED,		// The handler already did
+	VMCALL_FAIL,		// Shut the guest down
+};
+
+struct Hypercall {
+	int (*hc_fn)(struct Trapframe *tf, struct VmxGuestInfo *ginfo,
+		     epte_t *eptrt);
+	// May be made from a VMX_VMCALL_BATCH: the handler neither
+	// blocks nor steps the guest, and only returns rax.
+	bool hc_batch;
+};
+
+// The host's file server, which guests' IPC goes to.  It is looked up
+// again only if it exits.
+static envid_t vmcall_fs_env;
+
+static envid_t
+vmcall_fs(void) {
+	struct Env *e = &envs[ENVX(vmcall_fs_env)];
+	int i;
 
-bool
-handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt)
+	if (vmcall_fs_env && e->env_id == vmcall_fs_env &&
+	    e->env_type == ENV_TYPE_FS && e->env_status != ENV_FREE)
+		return vmcall_fs_env;
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_type == ENV_TYPE_FS &&
+		    envs[i].env_status != ENV_FREE)
+			return vmcall_fs_env = envs[i].env_id;
+	return 0;
+}
+
+static int
+vmcall_mbmap(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
 {
-	bool handled = false;
 	multiboot_info_t mbinfo;
-	int perm, r, i;
-	void *gpa_pg, *hva_pg;
-	envid_t to_env;
-	uint32_t val;
+	int r;
 	// phys address of the multiboot map in the guest.
 	uint64_t multiboot_map_addr = 0x6000;
-	switch(tf->tf_regs.reg_rax) {
-	case VMX_VMCALL_MBMAP:
-        /* Hint: */
-		// Craft a multiboot (e820) memory map for the guest.
-		//
-		// Create three  memory mapping segments: 640k of low mem, the I/O hole (unusable), and 
-		//   high memory (phys_size - 1024k).
-		//
-		// Once the map is ready, find the kernel virtual address of the guest page (if present),
-		//   or allocate one and map it at the multiboot_map_addr (0x6000).
-		// Copy the mbinfo and memory_map_t (segment descriptions) into the guest page, and return
-		//   a pointer to this region in rbx (as a guest physical address).
-		/* Your code here */
-
-		// -- LAB 3 --
-		
-		// this involves creating a "fake" memory map, stored in the mbinfo struct, to give to the guest
-		// first wipe the mbinfo struct to make sure there is no garbage data there
-		memset(&mbinfo, 0, sizeof(mbinfo));
-		// we are creating a memroy map, so set the flags appropriately
-		mbinfo.flags |= MB_FLAG_MMAP;
-		// we are going to create 3 memory mapping segments
-		mbinfo.mmap_length = 3 * sizeof(memory_map_t);
-		// set the address of the location to copy the mapping segments. they will come just after 
-		// the mbinfo struct
-		mbinfo.mmap_addr = multiboot_map_addr + sizeof(mbinfo);
-
-		// now create and fill in the memory_map_t's for the three mapping segments
-		// in memory_map_t, base_addr_low/base_addr_high and length_low/length_high are used to 
-		// store 64-bit values in 32-bit variables. *_low should store the lower 32 bits and *_high
-		// should store the upper 32 bits. 
-		memory_map_t lomap, iohole, himap;
-
-		// base addresses of each segment (from assignment document):
-		// - low memory: 0
-		// - IO hole: 640k (right after low memory)
-		// - high memory: 1024k (right after the IO hole)
-
-		// set up low mem
-		memset(&lomap, 0, sizeof(lomap));
-		lomap.length_low = 640 * 1024; // 640k
-		lomap.size = sizeof(memory_map_t);
-		lomap.type = MB_TYPE_USABLE;
-
-		// set up io hole
-		memset(&iohole, 0, sizeof(iohole));
-		iohole.base_addr_low = 640 * 1024;
-		iohole.length_low = (1024 * 1024) - (640 * 1024); // 1024k - 640k from the low memory
-		iohole.size = sizeof(memory_map_t); 
-		iohole.type = MB_TYPE_RESERVED; // unusable
-
-		// set up high mem
-		memset(&himap, 0, sizeof(himap));
-		himap.size = sizeof(memory_map_t); 
-		himap.type = MB_TYPE_USABLE;
-		himap.base_addr_low = 1024 * 1024; // 1024k
-		uint64_t himap_addr = gInfo->phys_sz - (1024 * 1024); // get the offset for this region
-		// then make sure to handle both the lower and upper 32 bits
-		himap.length_low = (uint32_t) himap_addr;
-		himap.length_high = (uint32_t) (himap_addr >> 32);
-
-		// copy the maps to guest memory. we first have to look up the host kernel virtual address
-		// corresponding to multiboot_map_addr (which is a physical address in the guest.)
-		// and allocate the page there if it doesn't exist yet
-		void* hva = NULL;
-		ept_gpa2hva(eptrt, (void*)multiboot_map_addr, &hva);
-		// if the hva doesn't exist, allocate and map it
-		if (!hva) {
-			struct PageInfo* p = page_alloc(0);
-			p->pp_ref += 1;
-			hva = page2kva(p); // get the kernel virtual address for the page we just allocated
-			// map the hva to multiboot_map_addr in the guest
-			r = ept_map_hva2gpa(eptrt, hva, (void*)multiboot_map_addr, __EPTE_FULL, 0); 
-			if (r < 0) {
-				return r; 
-			}
-		}
 
-		// then, copy the mapping structures into that page
-		memcpy(hva, &mbinfo, sizeof(mbinfo));
-		hva += sizeof(mbinfo);
-		memcpy(hva, &lomap, sizeof(memory_map_t));
-		hva += sizeof(memory_map_t);
-		memcpy(hva, &iohole, sizeof(memory_map_t));
-		hva += sizeof(memory_map_t);
-		memcpy(hva, &himap, sizeof(memory_map_t));
-
-		// set rbx to the multiboot region
-		tf->tf_regs.reg_rbx = multiboot_map_addr;
-
-		// and indicate that we've handled the exit
-		handled = true;
-		break;
+	/* Hint: */
+	// Craft a multiboot (e820) memory map for the guest.
+	//
+	// Create three  memory mapping segments: 640k of low mem, the I/O hole (unusable), and 
+	//   high memory (phys_size - 1024k).
+	//
+	// Once the map is ready, find the kernel virtual address of the guest page (if present),
+	//   or allocate one and map it at the multiboot_map_addr (0x6000).
+	// Copy the mbinfo and memory_map_t (segment descriptions) into the guest page, and return
+	//   a pointer to this region in rbx (as a guest physical address).
+	/* Your code here */
+
+	// -- LAB 3 --
 	
-	case VMX_VMCALL_IPCSEND:
-	{
-        /* Hint: */
-		// Issue the sys_ipc_send call to the host.
-		// 
-		// If the requested environment is the HOST FS, this call should
-		//  do this translation.
-		//
-		// The input should be a guest physical address; you will need to convert
-		//  this to a host virtual address for the IPC to work properly.
-        //  Then you should call sys_ipc_try_send()
-		/* Your code here */
-		uint64_t gpa;
-		void* hva = NULL;
-		gpa = tf->tf_regs.reg_rdx;
-		val = tf->tf_regs.reg_rcx;
-		perm = tf->tf_regs.reg_rsi;
-		int destVal = tf->tf_regs.reg_rbx;
-
-		// Check destination
-		if(destVal != ENV_TYPE_FS)
-		{
-			handled = true;
-			tf->tf_regs.reg_rax = -E_INVAL;
-			break;
+	// this involves creating a "fake" memory map, stored in the mbinfo struct, to give to the guest
+	// first wipe the mbinfo struct to make sure there is no garbage data there
+	memset(&mbinfo, 0, sizeof(mbinfo));
+	// we are creating a memroy map, so set the flags appropriately
+	mbinfo.flags |= MB_FLAG_MMAP;
+	// we are going to create 3 memory mapping segments
+	mbinfo.mmap_length = 3 * sizeof(memory_map_t);
+	// set the address of the location to copy the mapping segments. they will come just after 
+	// the mbinfo struct
+	mbinfo.mmap_addr = multiboot_map_addr + sizeof(mbinfo);
+
+	// now create and fill in the memory_map_t's for the three mapping segments
+	// in memory_map_t, base_addr_low/base_addr_high and length_low/length_high are used to 
+	// store 64-bit values in 32-bit variables. *_low should store the lower 32 bits and *_high
+	// should store the upper 32 bits. 
+	memory_map_t lomap, iohole, himap;
+
+	// base addresses of each segment (from assignment document):
+	// - low memory: 0
+	// - IO hole: 640k (right after low memory)
+	// - high memory: 1024k (right after the IO hole)
+
+	// set up low mem
+	memset(&lomap, 0, sizeof(lomap));
+	lomap.length_low = 640 * 1024; // 640k
+	lomap.size = sizeof(memory_map_t);
+	lomap.type = MB_TYPE_USABLE;
+
+	// set up io hole
+	memset(&iohole, 0, sizeof(iohole));
+	iohole.base_addr_low = 640 * 1024;
+	iohole.length_low = (1024 * 1024) - (640 * 1024); // 1024k - 640k from the low memory
+	iohole.size = sizeof(memory_map_t); 
+	iohole.type = MB_TYPE_RESERVED; // unusable
+
+	// set up high mem
+	memset(&himap, 0, sizeof(himap));
+	himap.size = sizeof(memory_map_t); 
+	himap.type = MB_TYPE_USABLE;
+	himap.base_addr_low = 1024 * 1024; // 1024k
+	uint64_t himap_addr = gInfo->phys_sz - (1024 * 1024); // get the offset for this region
+	// then make sure to handle both the lower and upper 32 bits
+	himap.length_low = (uint32_t) himap_addr;
+	himap.length_high = (uint32_t) (himap_addr >> 32);
+
+	// copy the maps to guest memory. we first have to look up the host kernel virtual address
+	// corresponding to multiboot_map_addr (which is a physical address in the guest.)
+	// and allocate the page there if it doesn't exist yet
+	void* hva = NULL;
+	// The page may be shared copy-on-write with a snapshot.
+	if (ept_cow_break(eptrt, (void*)multiboot_map_addr) < 0)
+		return VMCALL_FAIL;
+	ept_gpa2hva(eptrt, (void*)multiboot_map_addr, &hva);
+	// if the hva doesn't exist, allocate and map it
+	if (!hva) {
+		struct PageInfo* p = page_alloc(0);
+		p->pp_ref += 1;
+		hva = page2kva(p); // get the kernel virtual address for the page we just allocated
+		// map the hva to multiboot_map_addr in the guest
+		r = ept_map_hva2gpa(eptrt, hva, (void*)multiboot_map_addr, __EPTE_FULL, 0); 
+		if (r < 0) {
+			return VMCALL_FAIL;
 		}
+	}
 
-		// Figure out envid
-		bool foundEnv = false;
-		for (i = 0; i < NENV; i++)
-		{
-			if (envs[i].env_type == ENV_TYPE_FS)
-			{
-				to_env = (uint64_t)( envs[i].env_id);
-				foundEnv = true;
-				break;
-			}
-			// todo handle case where we didn't find file system gracefullly
-		}
-		if(!foundEnv)
-		{
-			handled = true;
-			tf->tf_regs.reg_rax = -E_INVAL;
-			break;
-		}
+	// then, copy the mapping structures into that page
+	memcpy(hva, &mbinfo, sizeof(mbinfo));
+	hva += sizeof(mbinfo);
+	memcpy(hva, &lomap, sizeof(memory_map_t));
+	hva += sizeof(memory_map_t);
+	memcpy(hva, &iohole, sizeof(memory_map_t));
+	hva += sizeof(memory_map_t);
+	memcpy(hva, &himap, sizeof(memory_map_t));
+
+	// set rbx to the multiboot region
+	tf->tf_regs.reg_rbx = multiboot_map_addr;
+	return VMCALL_DONE;
+}
+
+static int
+vmcall_ipcsend(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
+{
+	/* Hint: */
+	// Issue the sys_ipc_send call to the host.
+	// 
+	// If the requested environment is the HOST FS, this call should
+	//  do this translation.
+	//
+	// The input should be a guest physical address; you will need to convert
+	//  this to a host virtual address for the IPC to work properly.
+	//  Then you should call sys_ipc_try_send()
+	/* Your code here */
+	uint64_t gpa = tf->tf_regs.reg_rdx;
+	uint32_t val = tf->tf_regs.reg_rcx;
+	int perm = tf->tf_regs.reg_rsi;
+	envid_t to_env;
+	void *hva;
+
+	// Check destination, and figure out its envid.
+	if (tf->tf_regs.reg_rbx != ENV_TYPE_FS || !(to_env = vmcall_fs())) {
+		tf->tf_regs.reg_rax = -E_INVAL;
+		return VMCALL_DONE;
+	}
+	// The FS may write the page; it mustn't see a shared one.
+	if (!(hva = ept_gpa2hva_cached(eptrt, gInfo, gpa, perm & PTE_W))) {
+		tf->tf_regs.reg_rax = -E_INVAL;
+		return VMCALL_DONE;
+	}
+	tf->tf_regs.reg_rax = syscall(SYS_ipc_try_send, (uint64_t)to_env, (uint64_t)val, (uint64_t)hva, (uint64_t)perm, 0);
+	return VMCALL_DONE;
+}
+
+static int
+vmcall_ipcrecv(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
+{
+	// Issue the sys_ipc_recv call for the guest.
+	// NB: because recv can call schedule, clobbering the VMCS, 
+	// you should go ahead and increment rip before this call.
+	skip_instruction(gInfo);
+	vmx_exit_done(gInfo, true);
+	tf->tf_regs.reg_rax = syscall(SYS_ipc_recv, (uint64_t)tf->tf_regs.reg_rbx,0,0,0,0);
+	return VMCALL_STEPPED;
+}
+
+static int
+vmcall_lapiceoi(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
+{
+	vlapic_eoi(gInfo);
+	return VMCALL_DONE;
+}
 
-		ept_gpa2hva(eptrt, (void*)gpa, &hva);
-		if(hva == NULL)
-		{
-			handled = true;
-			tf->tf_regs.reg_rax = -E_INVAL;
+static int
+vmcall_backtohost(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
+{
+	cprintf("Now back to the host, VM halt in the background, run vmmanager to resume the VM.\n");
+	curenv->env_status = ENV_NOT_RUNNABLE;	//mark the guest not runable
+	// Keep its state, so it can be snapshotted while paused.
+	skip_instruction(gInfo);
+	if (vmx_state_save(curenv) < 0)
+		cprintf("Not enough memory to save the VM's state.\n");
+	ENV_CREATE(user_sh, ENV_TYPE_USER);	//create a new host shell
+	return VMCALL_STEPPED;
+}
+
+static int
+vmcall_getdiskimgnum(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
+{
+	//the number given to the guest
+	tf->tf_regs.reg_rax = vmx_vcpu_leader(curenv)->env_vmxinfo.vdisk;
+	return VMCALL_DONE;
+}
+
+static int
+vmcall_cpunum(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
+{
+	// How many vCPUs the guest has, for its mp_init.
+	tf->tf_regs.reg_rax = vmx_vcpu_count(curenv);
+	return VMCALL_DONE;
+}
+
+static int
+vmcall_balloon_target(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
+{
+	// How many pages the guest should have given back.
+	tf->tf_regs.reg_rax = vmx_balloon_target(curenv);
+	return VMCALL_DONE;
+}
+
+// The guest gives back the rcx pages whose guest-physical addresses are
+// listed in the page at rbx.  Any it touches again are faulted back in
+// like never-used memory.  Returns in rax how many pages, from the start
+// of the list, the host took; it stops at the first entry that isn't a
+// page of guest RAM, or when it runs out of memory to split a large page.
+static int
+vmcall_balloon_inflate(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
+{
+	struct VmxGuestInfo *lg = &vmx_vcpu_leader(curenv)->env_vmxinfo;
+	uint64_t list_gpa = tf->tf_regs.reg_rbx, gpa;
+	uint64_t *list, n = tf->tf_regs.reg_rcx;
+	int i;
+
+	list = ept_gpa2hva_cached(eptrt, gInfo, list_gpa, false);
+	if (PGOFF(list_gpa) || list == NULL ||
+	    n > PGSIZE / sizeof(uint64_t)) {
+		tf->tf_regs.reg_rax = -E_INVAL;
+		return VMCALL_DONE;
+	}
+	for (i = 0; i < n; i++) {
+		gpa = list[i];
+		if (PGOFF(gpa) || gpa == list_gpa ||
+		    !(gpa < 0xA0000 || (gpa >= 0x100000 && gpa < gInfo->phys_sz)))
 			break;
-		}
-		tf->tf_regs.reg_rax = syscall(SYS_ipc_try_send, (uint64_t)to_env, (uint64_t)val, (uint64_t)hva, (uint64_t)perm, 0);
+		if (ept_page_remove(eptrt, (void *) gpa) < 0)
+			break;
+	}
+	lg->balloon += i;
+	tf->tf_regs.reg_rax = i;
+	return VMCALL_DONE;
+}
+
+// The guest takes back rbx pages it gave.
+static int
+vmcall_balloon_deflate(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
+{
+	struct VmxGuestInfo *lg = &vmx_vcpu_leader(curenv)->env_vmxinfo;
+
+	lg->balloon -= MIN(lg->balloon, tf->tf_regs.reg_rbx);
+	tf->tf_regs.reg_rax = 0;
+	return VMCALL_DONE;
+}
 
-	    handled = true;
-		break;
+// Remember the guest's block ring (rbx, guest-physical), and wake our
+// parent, the backend, if it is waiting for it (see vblk_serve).  The
+// ring can only be set up once.
+static int
+vmcall_vblksetup(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
+{
+	struct VmxGuestInfo *lg = &vmx_vcpu_leader(curenv)->env_vmxinfo;
+	uint64_t gpa = tf->tf_regs.reg_rbx;
+	void *hva_pg;
+
+	ept_gpa2hva(eptrt, (void *) gpa, &hva_pg);
+	if (PGOFF(gpa) || hva_pg == NULL || lg->vblk_ring) {
+		tf->tf_regs.reg_rax = -E_INVAL;
+		return VMCALL_DONE;
 	}
-	case VMX_VMCALL_IPCRECV:
-	{
-		// Issue the sys_ipc_recv call for the guest.
-		// NB: because recv can call schedule, clobbering the VMCS, 
-		// you should go ahead and increment rip before this call.
-		/* Your code here */
-		tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
-		r = syscall(SYS_ipc_recv, (uint64_t)tf->tf_regs.reg_rbx,0,0,0,0);
-		tf->tf_regs.reg_rax = r;
-		handled = true;
-		break;
+	lg->vblk_ring = gpa;
+	futex_wake(PADDR(&lg->vblk_ring), 1);
+	tf->tf_regs.reg_rax = 0;
+	return VMCALL_DONE;
+}
+
+// Wake the backend, then sleep until it has completed requests up to
+// rbx.
+static int
+vmcall_vblkkick(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
+{
+	uint64_t gpa = vmx_vcpu_leader(curenv)->env_vmxinfo.vblk_ring;
+	struct VblkRing *ring;
+
+	if (!gpa || !(ring = ept_gpa2hva_cached(eptrt, gInfo, gpa, false))) {
+		tf->tf_regs.reg_rax = -E_INVAL;
+		return VMCALL_DONE;
 	}
-	case VMX_VMCALL_LAPICEOI:
-		lapic_eoi();
-		handled = true;
-		break;
-	case VMX_VMCALL_BACKTOHOST:
-		cprintf("Now back to the host, VM halt in the background, run vmmanager to resume the VM.\n");
-		curenv->env_status = ENV_NOT_RUNNABLE;	//mark the guest not runable
-		ENV_CREATE(user_sh, ENV_TYPE_USER);	//create a new host shell
-		handled = true;
-		break;	
-	case VMX_VMCALL_GETDISKIMGNUM:	//alloc a number to guest
-		tf->tf_regs.reg_rax = vmdisk_number;
-		handled = true;
-		break;
-         
+	futex_wake(PADDR((void *) &ring->vb_avail), 1);
+	tf->tf_regs.reg_rax = 0;
+	if (ring->vb_used == (uint32_t) tf->tf_regs.reg_rbx)
+		return VMCALL_DONE;
+	// As for IPCRECV, we don't come back here.
+	skip_instruction(gInfo);
+	futex_sleep(curenv, PADDR((void *) &ring->vb_used), 0);
+	vmx_exit_done(gInfo, true);
+	sched_yield();
+}
+
+static int
+vmcall_vconssetup(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
+{
+	// The guest's console ring is at rbx (see vmm/vcons.c).
+	tf->tf_regs.reg_rax = vcons_setup(curenv, tf->tf_regs.reg_rbx);
+	return VMCALL_DONE;
+}
+
+static int
+vmcall_vconskick(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
+{
+	tf->tf_regs.reg_rax = vcons_kick(curenv);
+	return VMCALL_DONE;
+}
+
+static int vmcall_version(struct Trapframe *tf, struct VmxGuestInfo *gInfo,
+			  epte_t *eptrt);
+static int vmcall_batch(struct Trapframe *tf, struct VmxGuestInfo *gInfo,
+			epte_t *eptrt);
+
+static const struct Hypercall hypercalls[VMX_VMCALL_NCODES] = {
+	[VMX_VMCALL_MBMAP]		= { vmcall_mbmap,		false },
+	[VMX_VMCALL_IPCSEND]		= { vmcall_ipcsend,		true },
+	[VMX_VMCALL_IPCRECV]		= { vmcall_ipcrecv,		false },
+	[VMX_VMCALL_LAPICEOI]		= { vmcall_lapiceoi,		true },
+	[VMX_VMCALL_BACKTOHOST]		= { vmcall_backtohost,		false },
+	[VMX_VMCALL_GETDISKIMGNUM]	= { vmcall_getdiskimgnum,	true },
+	[VMX_VMCALL_CPUNUM]		= { vmcall_cpunum,		true },
+	[VMX_VMCALL_VBLKSETUP]		= { vmcall_vblksetup,		false },
+	[VMX_VMCALL_VBLKKICK]		= { vmcall_vblkkick,		false },
+	[VMX_VMCALL_BALLOON_TARGET]	= { vmcall_balloon_target,	true },
+	// Frees guest pages, possibly the batch page itself.
+	[VMX_VMCALL_BALLOON_INFLATE]	= { vmcall_balloon_inflate,	false },
+	[VMX_VMCALL_BALLOON_DEFLATE]	= { vmcall_balloon_deflate,	true },
+	[VMX_VMCALL_VCONSSETUP]		= { vmcall_vconssetup,		false },
+	[VMX_VMCALL_VCONSKICK]		= { vmcall_vconskick,		true },
+	[VMX_VMCALL_VERSION]		= { vmcall_version,		true },
+	[VMX_VMCALL_BATCH]		= { vmcall_batch,		false },
+};
+
+// The hypercall ABI version, and in rbx which codes are implemented.
+static int
+vmcall_version(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
+{
+	uint64_t codes = 0;
+	int i;
+
+	for (i = 0; i < VMX_VMCALL_NCODES; i++)
+		if (hypercalls[i].hc_fn)
+			codes |= 1ULL << i;
+	tf->tf_regs.reg_rax = VMX_VMCALL_ABI;
+	// Batched, rbx isn't returned; the version is enough there.
+	tf->tf_regs.reg_rbx = codes;
+	return VMCALL_DONE;
+}
+
+// Make the hypercalls in the struct VmxBatch on the guest page at rbx,
+// in order, and return how many were made.  Batching stops at the first
+// code that can't be batched.
+//
+// The guest may change the page (from another vCPU) while we work, so
+// each request is copied out before it is checked.  The page is held
+// for the whole batch, so that results never land in a page the guest
+// has since given back.
+static int
+vmcall_batch(struct Trapframe *tf, struct VmxGuestInfo *gInfo, epte_t *eptrt)
+{
+	struct Trapframe btf = *tf;
+	struct VmxBatch *b;
+	struct VmxBatchReq req;
+	struct PageInfo *pp;
+	uint32_t i, n;
+	int r = VMCALL_DONE;
+
+	if (PGOFF(tf->tf_regs.reg_rbx) ||
+	    !(b = ept_gpa2hva_cached(eptrt, gInfo, tf->tf_regs.reg_rbx, true))) {
+		tf->tf_regs.reg_rax = -E_INVAL;
+		return VMCALL_DONE;
+	}
+	pp = pa2page(PADDR(b));
+	pp->pp_ref++;
+	n = MIN(b->hb_count, VMX_BATCH_MAX);
+	for (i = 0; i < n; i++) {
+		req = b->hb_req[i];
+		if (req.br_code >= VMX_VMCALL_NCODES ||
+		    !hypercalls[req.br_code].hc_batch)
+			break;
+		btf.tf_regs.reg_rbx = req.br_args[0];
+		btf.tf_regs.reg_rcx = req.br_args[1];
+		btf.tf_regs.reg_rdx = req.br_args[2];
+		btf.tf_regs.reg_rsi = req.br_args[3];
+		if (hypercalls[req.br_code].hc_fn(&btf, gInfo, eptrt) != VMCALL_DONE) {
+			r = VMCALL_FAIL;
+			break;
+		}
+		b->hb_req[i].br_ret = btf.tf_regs.reg_rax;
 	}
-	if(handled) {
+	page_decref(pp);
+	tf->tf_regs.reg_rax = i;
+	return r;
+}
+
+// Handle vmcall traps from the guest, through the hypercall table.
+// Unknown codes fail with -E_NO_SYS; VMX_VMCALL_VERSION says which
+// there are.
+//
+// Return true if the exit is handled properly, false if the VM should be terminated.
+//
+// Finally, you need to increment the program counter in the trap frame.
+// 
+// Hint: The TA's solution does not hard-code the length of the cpuid instruction.//
+
+bool
+handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt)
+{
+	uint64_t code = tf->tf_regs.reg_rax;
+	int r;
+
+	if (code >= VMX_VMCALL_NCODES || !hypercalls[code].hc_fn) {
+		tf->tf_regs.reg_rax = -E_NO_SYS;
+		r = VMCALL_DONE;
+	} else
+		r = hypercalls[code].hc_fn(tf, gInfo, eptrt);
+	if (r == VMCALL_FAIL)
+		return false;
+	if (r == VMCALL_DONE) {
 		/* Advance the program counter by the length of the vmcall instruction. 
 		 * 
 		 * Hint: The solution does not hard-code the length of the vmcall instruction.
 		 */
 		/* Your code here */
 		// --- LAB 3 --
-		tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
+		skip_instruction(gInfo);
 	}
-	return handled;
-}
\ No newline at end of file
+	return true;
+}
@@ -4,6 +4,10 @@
 #include <vmm/vmx_asm.h>
 #include <vmm/ept.h>
 #include <vmm/vmexits.h>
+#include <vmm/vlapic.h>
+#include <vmm/ksm.h>
+#include <vmm/vdev.h>
+#include <vmm/vcons.h>
 
 #include <inc/x86.h>
 #include <inc/error.h>
@@ -19,30 +23,395 @@
 #include <kern/spinlock.h>
 
 
+// Is e a live vCPU of the same guest as g?  A guest's vCPUs share its
+// EPT, so they have the same env_cr3.
+static bool
+vcpu_sibling(struct Env *e, struct Env *g) {
+	return e->env_type == ENV_TYPE_GUEST && e->env_status != ENV_FREE &&
+		e->env_cr3 == g->env_cr3;
+}
+
+// How many vCPUs guest has.
+int vmx_vcpu_count(struct Env *guest) {
+	int i, n = 0;
+
+	for (i = 0; i < NENV; ++i)
+		if (vcpu_sibling(&envs[i], guest))
+			n++;
+	return n;
+}
+
+// The first vCPU of e's guest, which holds state that belongs to the
+// guest as a whole, like its block ring.
+struct Env *vmx_vcpu_leader(struct Env *e) {
+	int i;
+
+	for (i = 0; i < NENV; ++i)
+		if (vcpu_sibling(&envs[i], e) && envs[i].env_vmxinfo.vcpu_id == 0)
+			return &envs[i];
+	return e;
+}
+
+// Is any vCPU of e's guest, other than e itself, running on a CPU
+// right now?  If not, guest memory can be taken away safely: the others
+// flush stale translations before they next enter (see ept_invalidate).
+bool vmx_vcpus_running(struct Env *e) {
+	int i;
+
+	for (i = 0; i < NENV; ++i)
+		if (&envs[i] != e && vcpu_sibling(&envs[i], e) &&
+		    envs[i].env_status == ENV_RUNNING)
+			return true;
+	return false;
+}
+
+// Free host pages below which guests are asked to give memory back, and
+// above which they may take it again.
+#define VMX_BALLOON_LOW		1024
+#define VMX_BALLOON_HIGH	4096
+
+// How many pages e's guest should have given back, for its balloon
+// driver: the shortfall of free host pages, or the surplus, is split
+// evenly between the guests.  A guest never gives more than half of
+// its memory.
+uint32_t vmx_balloon_target(struct Env *e) {
+	struct VmxGuestInfo *g = &vmx_vcpu_leader(e)->env_vmxinfo;
+	size_t nfree = page_free_count();
+	uint32_t max = g->phys_sz / PGSIZE / 2, n;
+	int i, nguests = 0;
+
+	for (i = 0; i < NENV; ++i)
+		if (envs[i].env_type == ENV_TYPE_GUEST &&
+		    envs[i].env_status != ENV_FREE &&
+		    envs[i].env_vmxinfo.vcpu_id == 0 &&
+		    !envs[i].env_vmxinfo.snapshot)
+			nguests++;
+	if (nfree < VMX_BALLOON_LOW) {
+		n = (VMX_BALLOON_LOW - nfree) / nguests + 1;
+		g->balloon_target = MIN(g->balloon + n, max);
+	} else if (nfree > VMX_BALLOON_HIGH) {
+		n = (nfree - VMX_BALLOON_HIGH) / nguests;
+		g->balloon_target -= MIN(g->balloon_target, n);
+	}
+	return g->balloon_target;
+}
+
+// Choose the CPU that new vCPU e will always run on: the one with the
+// fewest vCPUs, preferring CPUs that e's guest doesn't use yet so that
+// its vCPUs can run at the same time.
+int vmx_vcpu_place(struct Env *e) {
+	int load[NCPU] = { 0 };
+	bool taken[NCPU] = { false };
+	int i, c, best = 0;
+
+	for (i = 0; i < NENV; ++i) {
+		struct Env *g = &envs[i];
+
+		if (g == e || g->env_type != ENV_TYPE_GUEST ||
+		    g->env_status == ENV_FREE || g->env_vmxinfo.snapshot ||
+		    g->env_vmxinfo.vcpunum >= ncpu)
+			continue;
+		load[g->env_vmxinfo.vcpunum]++;
+		if (vcpu_sibling(g, e))
+			taken[g->env_vmxinfo.vcpunum] = true;
+	}
+	for (c = 1; c < ncpu; ++c)
+		if (taken[c] < taken[best] ||
+		    (taken[c] == taken[best] && load[c] < load[best]))
+			best = c;
+	return best;
+}
+
+// Destroy the other vCPUs of e's guest, for env_destroy.  Those running
+// on other CPUs are freed at their next VM exit.
+void vmx_vcpus_destroy(struct Env *e) {
+	int i;
+
+	for (i = 0; i < NENV; ++i) {
+		struct Env *v = &envs[i];
+
+		if (v == e || !vcpu_sibling(v, e) || v->env_status == ENV_DYING)
+			continue;
+		if (v->env_status == ENV_RUNNING)
+			v->env_status = ENV_DYING;
+		else
+			env_free(v);
+	}
+}
+
+// Most vCPUs in a row a CPU runs ahead of its turn through
+// vmx_gang_pick, before the scheduler's own rotation gets a pass.
+#define VMX_GANG_MAX	4
+
+// Co-scheduling: a runnable vCPU of this CPU's whose guest has another
+// vCPU running on another CPU right now, or NULL.  Running such vCPUs
+// first keeps a guest's vCPUs running together, so one doesn't spin on
+// a lock held by a sibling that isn't running.  Every VMX_GANG_MAX
+// picks this returns NULL once, so that the other environments on this
+// CPU (the file server, say) aren't starved by a busy guest.
+struct Env *vmx_gang_pick() {
+	static int streak[NCPU];
+	physaddr_t running[NCPU];
+	int i, c, n = 0;
+
+	if (streak[cpunum()] >= VMX_GANG_MAX) {
+		streak[cpunum()] = 0;
+		return NULL;
+	}
+	for (c = 0; c < ncpu; ++c) {
+		struct Env *r = cpus[c].cpu_env;
+
+		if (c != cpunum() && r && r->env_type == ENV_TYPE_GUEST &&
+		    r->env_status == ENV_RUNNING)
+			running[n++] = r->env_cr3;
+	}
+	for (i = 0; n > 0 && i < NENV; ++i) {
+		struct Env *e = &envs[i];
+
+		if (e->env_type != ENV_TYPE_GUEST ||
+		    e->env_status != ENV_RUNNABLE ||
+		    e->env_vmxinfo.vcpunum != cpunum())
+			continue;
+		for (c = 0; c < n; ++c)
+			if (running[c] == e->env_cr3) {
+				streak[cpunum()]++;
+				return e;
+			}
+	}
+	streak[cpunum()] = 0;
+	return NULL;
+}
+
 void vmx_list_vms() {
 	//findout how many VMs there
-	int i;
-	int vm_count = 0;
+	int i, j, k;
+	int vm_count = 0, shared = 0;
 	for (i = 0; i < NENV; ++i) {
-		if (envs[i].env_type == ENV_TYPE_GUEST) {
+		// List each guest once, by its first vCPU.  Snapshots
+		// never run.
+		if (envs[i].env_type == ENV_TYPE_GUEST &&
+		    envs[i].env_status != ENV_FREE &&
+		    envs[i].env_vmxinfo.vcpu_id == 0 &&
+		    !envs[i].env_vmxinfo.snapshot) {
 			if (vm_count == 0) {
 				cprintf("Running VMs:\n");
 			}
+			uint64_t nexits = 0, cycles = 0;
+			for (k = 0; k < NENV; ++k) {
+				if (!vcpu_sibling(&envs[k], &envs[i]))
+					continue;
+				struct VmxStats *vs = envs[k].env_vmxinfo.stats;
+				for (j = 0; j < VMX_EXIT_NREASONS; ++j) {
+					nexits += vs->vs_exit[j].xs_count;
+					cycles += vs->vs_exit[j].xs_cycles;
+				}
+			}
 			vm_count++;
-			cprintf("%d.[%x]vm%d\n", vm_count, envs[i].env_id, vm_count);
+			cprintf("%d.[%x]vm%d  %d vCPUs, %llu exits, %llu Mcycles in exits, %u pages shared\n",
+				vm_count, envs[i].env_id, vm_count,
+				vmx_vcpu_count(&envs[i]), nexits, cycles / 1000000,
+				envs[i].env_vmxinfo.ksm_shared);
+			shared += envs[i].env_vmxinfo.ksm_shared;
 		}
 	}
+	if (shared)
+		cprintf("%d merged pages back %d guest pages, saving %dKB\n",
+			ksm_pages(), shared, (shared - ksm_pages()) * PGSIZE / 1024);
 }
 
-bool vmx_sel_resume(int num) {
+// Pages an idle CPU backs per background prefault pass, at most; one
+// pass per timer tick it spends idle.
+#define VMX_PREFAULT_CHUNK 64
+
+// The first launched guest that wants background prefaulting and isn't
+// done yet, or NULL.
+static struct Env *
+vmx_prefault_next() {
+	int i;
+
+	for (i = 0; i < NENV; ++i) {
+		struct Env *e = &envs[i];
+
+		if (e->env_type != ENV_TYPE_GUEST || e->env_runs == 0 ||
+		    (e->env_status != ENV_RUNNABLE && e->env_status != ENV_RUNNING &&
+		     e->env_status != ENV_NOT_RUNNABLE) ||
+		    e->env_vmxinfo.prefault != VMX_PREFAULT_BACKGROUND ||
+		    e->env_vmxinfo.prefault_next >= e->env_vmxinfo.phys_sz)
+			continue;
+		return e;
+	}
+	return NULL;
+}
+
+// Called by an idle CPU, about to halt: back another chunk of memory for
+// the guests that want background prefaulting.  The big kernel lock is
+// released after every page, so that a CPU with real work waits for one
+// page at most; the guest is looked up afresh each time, as it may have
+// gone meanwhile.
+void vmx_prefault_idle() {
+	struct Env *e;
+	int n, r;
+
+	// Nothing may run on this CPU while the lock is dropped.
+	curenv = NULL;
+	lcr3(PADDR(boot_pml4e));
+	for (n = 0; n < VMX_PREFAULT_CHUNK; n += r) {
+		if (!(e = vmx_prefault_next()))
+			return;
+		if ((r = ept_prefault(e->env_pml4e, &e->env_vmxinfo, 1)) < 0) {
+			// Out of memory; leave the rest to EPT violations.
+			e->env_vmxinfo.prefault_next = e->env_vmxinfo.phys_sz;
+			return;
+		}
+		// 0 means the guest is fully backed now; count it as a
+		// step all the same, so the pass stays bounded.
+		if (r == 0)
+			r = 1;
+		unlock_kernel();
+		lock_kernel();
+	}
+}
+
+// Resize a guest's halt-polling window after it waited this many cycles
+// for a wakeup: grow it if polling a little longer would have caught
+// the wakeup, shrink it if the guest was really idle.
+static void
+vmx_halt_adjust(struct VmxGuestInfo *ginfo, uint64_t waited) {
+	if (waited <= ginfo->halt_poll)
+		return;
+	if (waited > VMX_HALT_POLL_MAX) {
+		ginfo->halt_poll /= 2;
+		if (ginfo->halt_poll < VMX_HALT_POLL_START)
+			ginfo->halt_poll = 0;
+	} else if (ginfo->halt_poll == 0)
+		ginfo->halt_poll = VMX_HALT_POLL_START;
+	else if (ginfo->halt_poll < VMX_HALT_POLL_MAX)
+		ginfo->halt_poll *= 2;
+}
+
+// Wake halted vCPU e if its emulated APIC now has an interrupt for it.
+static void
+vmx_halt_check(struct Env *e) {
+	vlapic_timer(&e->env_vmxinfo);
+	if (!vlapic_pending(&e->env_vmxinfo))
+		return;
+	e->env_vmxinfo.halted = false;
+	vmx_halt_adjust(&e->env_vmxinfo, read_tsc() - e->env_vmxinfo.halt_tsc);
+	e->env_status = ENV_RUNNABLE;
+}
+
+// Called on every host timer tick: wake the guests halted on this CPU
+// whose emulated APIC now has an interrupt for them.
+void vmx_halt_wakeup() {
+	int i;
+
+	for (i = 0; i < NENV; ++i) {
+		struct Env *e = &envs[i];
+
+		if (e->env_type != ENV_TYPE_GUEST || !e->env_vmxinfo.halted ||
+		    e->env_vmxinfo.vcpunum != cpunum() ||
+		    e->env_status != ENV_NOT_RUNNABLE)
+			continue;
+		vmx_halt_check(e);
+	}
+}
+
+// Deliver an IPI that a vCPU sent from its emulated APIC (see
+// vlapic_ipi) to each vCPU of its guest it is addressed to.  vCPU i has
+// physical APIC ID i; logical destinations aren't supported.  A vCPU
+// running on another CPU sees a fixed interrupt at its next VM exit.
+void vmx_vcpu_ipi(struct VmxGuestInfo *ginfo, uint64_t icr) {
+	struct Env *from = (struct Env *)
+		((char *) ginfo - offsetof(struct Env, env_vmxinfo));
+	uint32_t dest = icr >> 32;
+	int i;
+
+	for (i = 0; i < NENV; ++i) {
+		struct Env *e = &envs[i];
+		struct VmxGuestInfo *g = &e->env_vmxinfo;
+
+		if (!vcpu_sibling(e, from))
+			continue;
+		switch (icr & VLAPIC_ICR_OTHERS) {
+		case 0:
+			if (dest != 0xffffffff && dest != g->vcpu_id)
+				continue;
+			break;
+		case VLAPIC_ICR_SELF:
+			if (e != from)
+				continue;
+			break;
+		case VLAPIC_ICR_OTHERS:
+			if (e == from)
+				continue;
+			break;
+		}
+
+		switch (icr & VLAPIC_ICR_DELMODE) {
+		case VLAPIC_ICR_FIXED:
+			vlapic_set_irr(g, icr & 0xff);
+			if (g->halted && e->env_status == ENV_NOT_RUNNABLE)
+				vmx_halt_check(e);
+			break;
+		case VLAPIC_ICR_INIT:
+			// Started vCPUs can't be reset.
+			if (g->vcpu_state == VMX_VCPU_WAIT_INIT)
+				g->vcpu_state = VMX_VCPU_WAIT_SIPI;
+			break;
+		case VLAPIC_ICR_STARTUP:
+			// Only the first STARTUP after an INIT counts.  The
+			// vCPU starts in real mode at vector:0000.
+			if (g->vcpu_state != VMX_VCPU_WAIT_SIPI)
+				break;
+			g->vcpu_state = VMX_VCPU_STARTED;
+			e->env_tf.tf_rip = (icr & 0xff) << 12;
+			e->env_tf.tf_rsp = 0;
+			e->env_status = ENV_RUNNABLE;
+			break;
+		}
+	}
+}
+
+// Raise ExtINT vector in vCPU e, waking it if it is halted.
+void vmx_vcpu_extint(struct Env *e, int vector) {
+	vlapic_extint(&e->env_vmxinfo, vector);
+	if (e->env_vmxinfo.halted && e->env_status == ENV_NOT_RUNNABLE)
+		vmx_halt_check(e);
+}
+
+// Are any guests blocked in HLT?  They will run again, so the system
+// isn't out of work.
+bool vmx_halted_guests() {
 	int i;
+
+	for (i = 0; i < NENV; ++i)
+		if (envs[i].env_type == ENV_TYPE_GUEST &&
+		    envs[i].env_status == ENV_NOT_RUNNABLE &&
+		    envs[i].env_vmxinfo.halted)
+			return true;
+	return false;
+}
+
+bool vmx_sel_resume(int num) {
+	int i, j;
 	int vm_count = 0;
 	for (i = 0; i < NENV; ++i) {
-		if (envs[i].env_type == ENV_TYPE_GUEST) {
+		if (envs[i].env_type == ENV_TYPE_GUEST &&
+		    envs[i].env_status != ENV_FREE &&
+		    envs[i].env_vmxinfo.vcpu_id == 0 &&
+		    !envs[i].env_vmxinfo.snapshot) {
 			vm_count++;
 			if (vm_count == num) {
 				cprintf("Resume vm.%d\n", num);
-				envs[i].env_status = ENV_RUNNABLE;
+				vcons_focus(&envs[i]);
+				// Halted vCPUs resume at their next timer tick,
+				// vCPUs not yet started when they get a STARTUP.
+				for (j = 0; j < NENV; ++j)
+					if (vcpu_sibling(&envs[j], &envs[i]) &&
+					    envs[j].env_status == ENV_NOT_RUNNABLE &&
+					    envs[j].env_vmxinfo.vcpu_state == VMX_VCPU_STARTED &&
+					    !envs[j].env_vmxinfo.halted)
+						envs[j].env_status = ENV_RUNNABLE;
 				return true;
 			}
 		}
@@ -89,8 +458,35 @@ bool vmx_check_support() {
  *   that secondary VMX controls are enabled, and then that
  *   EPT is available.
  */
+// Whether guests can be given VPIDs, as found by vmx_check_ept: the
+// secondary control exists and single-context INVVPID is available to
+// flush a recycled VPID.
+static bool vpid_support;
+// The narrowest INVEPT this processor offers, as found by vmx_check_ept.
+static uint64_t invept_type = INVEPT_ALL_CONTEXT;
+// Whether the processor can deliver the emulated APIC's interrupts and
+// virtualize its EOIs: it has a TPR shadow, x2APIC virtualization and
+// virtual-interrupt delivery.
+static bool apicv_support;
+// Whether, on top of that, guests can read APIC registers from the
+// register page without exits.
+static bool apicreg_support;
+// The VMX-preemption timer counts down once every 2^preempt_shift TSC
+// cycles, or -1 if there is none.
+static int preempt_shift = -1;
+// Whether the processor can set EPT accessed and dirty bits.
+static bool ept_ad_support;
+// Whether guests can run RDTSCP; without the secondary control it
+// raises #UD.
+static bool rdtscp_support;
+
+// Longest a guest runs before the preemption timer hands its CPU back
+// to the scheduler, in TSC cycles.  Well under a host timer tick, so
+// host servers don't wait a whole tick behind a busy guest.
+#define VMX_TIMESLICE	(1 << 21)
+
 bool vmx_check_ept() {
-	uint64_t msr1, msr2;
+	uint64_t msr1, msr2, cap;
 	bool secondary_vmx, ept_support;
 
 	// first, check that secondary VMX controls are enabled by checking 
@@ -104,12 +500,65 @@ bool vmx_check_ept() {
 		ept_support = (bool)BIT(msr2, 33);
 		if (ept_support) {
 			cprintf("Processor supports EPT\n");
+			cap = read_msr(IA32_VMX_EPT_VPID_CAP);
+			vpid_support = BIT(msr2, 37) && BIT(cap, 32) && BIT(cap, 41);
+			// Changed EPT entries must be flushed with INVEPT
+			// (bit 20), single-context (bit 25) if it can,
+			// all-context (bit 26) otherwise.
+			if (!BIT(cap, 20) || !(BIT(cap, 25) || BIT(cap, 26))) {
+				cprintf("Processor can't flush EPT translations\n");
+				return false;
+			}
+			invept_type = BIT(cap, 25) ? INVEPT_SINGLE_CONTEXT :
+				INVEPT_ALL_CONTEXT;
+			apicv_support = BIT(msr1, 53) && BIT(msr2, 36) &&
+				BIT(msr2, 41);
+			apicreg_support = apicv_support && BIT(msr2, 40);
+			ept_ad_support = BIT(cap, 21);
+			rdtscp_support = BIT(msr2, 35);
+			if (BIT(read_msr(IA32_VMX_PINBASED_CTLS), 38))
+				preempt_shift = read_msr(IA32_VMX_MISC) & 0x1f;
 			return true;
 		}
 	} 
 	return false;
 }
 
+// Do guests' EPT entries get accessed and dirty bits?
+bool vmx_ept_ad() {
+	return ept_ad_support;
+}
+
+// Can guests run RDTSCP?
+bool vmx_rdtscp() {
+	return rdtscp_support;
+}
+
+// VPIDs in use; VPID 0 is the host's.
+static uint8_t vpid_bmap[(NENV + 1 + 7) / 8];
+
+// Allocate a VPID for a new guest.  Returns 0, meaning don't tag the
+// guest's translations, if VPIDs are unsupported or all taken.
+uint16_t vmx_vpid_alloc() {
+	uint16_t vpid;
+
+	if (!vpid_support)
+		return 0;
+	for (vpid = 1; vpid <= NENV; vpid++)
+		if (!(vpid_bmap[vpid / 8] & (1 << (vpid % 8)))) {
+			vpid_bmap[vpid / 8] |= 1 << (vpid % 8);
+			return vpid;
+		}
+	return 0;
+}
+
+// Return vpid to the pool.  Stale entries tagged with it are flushed
+// by the next guest to get it, before its first launch.
+void vmx_vpid_free(uint16_t vpid) {
+	if (vpid)
+		vpid_bmap[vpid / 8] &= ~(1 << (vpid % 8));
+}
+
 /* Checks if curr_val is compatible with fixed0 and fixed1
  * (allowed values read from the MSR). This is to ensure current processor
  * operating mode meets the required fixed bit requirement of VMX.
@@ -337,6 +786,9 @@ vmcs_ctls_init( struct Env* e ) {
 
 	//enable the guest external interrupt exit
 	pinbased_ctls_or |= VMCS_PIN_BASED_VMEXEC_CTL_EXINTEXIT;
+	// Bound how long the guest runs; armed before each entry.
+	if (preempt_shift >= 0)
+		pinbased_ctls_or |= VMCS_PIN_BASED_VMEXEC_CTL_PREEMPT_TIMER;
 	vmcs_write32( VMCS_32BIT_CONTROL_PIN_BASED_EXEC_CONTROLS,
 		      pinbased_ctls_or & pinbased_ctls_and );
 
@@ -350,6 +802,9 @@ vmcs_ctls_init( struct Env* e ) {
 	procbased_ctls_or |= VMCS_PROC_BASED_VMEXEC_CTL_ACTIVESECCTL;
 	procbased_ctls_or |= VMCS_PROC_BASED_VMEXEC_CTL_HLTEXIT;
 	procbased_ctls_or |= VMCS_PROC_BASED_VMEXEC_CTL_USEIOBMP;
+	procbased_ctls_or |= VMCS_PROC_BASED_VMEXEC_CTL_USEMSRBMP;
+	if (e->env_vmxinfo.vlapic_apicv)
+		procbased_ctls_or |= VMCS_PROC_BASED_VMEXEC_CTL_USETPRSHADOW;
 	/* CR3 accesses and invlpg don't need to cause VM Exits when EPT
 	   enabled */
 	procbased_ctls_or &= ~( VMCS_PROC_BASED_VMEXEC_CTL_CR3LOADEXIT |
@@ -367,6 +822,30 @@ vmcs_ctls_init( struct Env* e ) {
 	// Enable EPT.
 	procbased_ctls2_or |= VMCS_SECONDARY_VMEXEC_CTL_ENABLE_EPT;
 	procbased_ctls2_or |= VMCS_SECONDARY_VMEXEC_CTL_UNRESTRICTED_GUEST;
+	// Tag guest translations, so VM entries and exits needn't flush them.
+	if (e->env_vmxinfo.vpid) {
+		procbased_ctls2_or |= VMCS_SECONDARY_VMEXEC_CTL_ENABLE_VPID;
+		vmcs_write16( VMCS_16BIT_CONTROL_VPID, e->env_vmxinfo.vpid );
+	}
+	// RDTSCP and TSC_AUX reach the guest as they are.
+	if (rdtscp_support)
+		procbased_ctls2_or |= VMCS_SECONDARY_VMEXEC_CTL_ENABLE_RDTSCP;
+	// Let the processor deliver the emulated APIC's interrupts from its
+	// register page.  No EOI needs to exit: host interrupts are passed
+	// on as ExtINTs, which aren't EOI'd.
+	if (e->env_vmxinfo.vlapic_apicv) {
+		procbased_ctls2_or |= VMCS_SECONDARY_VMEXEC_CTL_VIRT_X2APIC;
+		procbased_ctls2_or |= VMCS_SECONDARY_VMEXEC_CTL_VIRT_INTR_DELIVERY;
+		if (apicreg_support)
+			procbased_ctls2_or |= VMCS_SECONDARY_VMEXEC_CTL_APIC_REG_VIRT;
+		vmcs_write64( VMCS_64BIT_CONTROL_VIRTUAL_APIC_PAGE_ADDR,
+			      PADDR(e->env_vmxinfo.vlapic) );
+		vmcs_write32( VMCS_32BIT_CONTROL_TPR_THRESHOLD, 0 );
+		vmcs_write64( VMCS_64BIT_CONTROL_EOI_EXIT_BITMAP0, 0 );
+		vmcs_write64( VMCS_64BIT_CONTROL_EOI_EXIT_BITMAP1, 0 );
+		vmcs_write64( VMCS_64BIT_CONTROL_EOI_EXIT_BITMAP2, 0 );
+		vmcs_write64( VMCS_64BIT_CONTROL_EOI_EXIT_BITMAP3, 0 );
+	}
 	vmcs_write32( VMCS_32BIT_CONTROL_SECONDARY_VMEXEC_CONTROLS,
 		      procbased_ctls2_or & procbased_ctls2_and );
 
@@ -403,6 +882,8 @@ vmcs_ctls_init( struct Env* e ) {
 		      entry_ctls_or & entry_ctls_and );
 
 	uint64_t ept_ptr = e->env_cr3 | ( ( EPT_LEVELS - 1 ) << 3 );
+	if (ept_ad_support)
+		ept_ptr |= VMX_EPTP_AD;
 	vmcs_write64( VMCS_64BIT_CONTROL_EPTPTR, ept_ptr );
 
 	vmcs_write32( VMCS_32BIT_CONTROL_EXCEPTION_BITMAP,
@@ -411,6 +892,8 @@ vmcs_ctls_init( struct Env* e ) {
 		      PADDR(e->env_vmxinfo.io_bmap_a));
 	vmcs_write64( VMCS_64BIT_CONTROL_IO_BITMAP_B,
 		      PADDR(e->env_vmxinfo.io_bmap_b));
+	vmcs_write64( VMCS_64BIT_CONTROL_MSR_BITMAPS,
+		      PADDR(e->env_vmxinfo.msr_bmap));
 
 }
 
@@ -430,27 +913,395 @@ void vmcs_dump_cpu() {
 
 }
 
+// The VMCS field behind each cache slot.
+static const uint32_t vmcs_cache_fields[VMCS_CACHE_NFIELDS] = {
+	[VMCS_CACHE_EXIT_REASON]	= VMCS_32BIT_VMEXIT_REASON,
+	[VMCS_CACHE_EXIT_QUALIFICATION]	= VMCS_VMEXIT_QUALIFICATION,
+	[VMCS_CACHE_EXIT_INSTR_LEN]	= VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH,
+	[VMCS_CACHE_EXIT_INTR_INFO]	= VMCS_32BIT_VMEXIT_INTERRUPTION_INFO,
+	[VMCS_CACHE_GUEST_PHYS_ADDR]	= VMCS_64BIT_GUEST_PHYSICAL_ADDR,
+	[VMCS_CACHE_GUEST_RIP]		= VMCS_GUEST_RIP,
+	[VMCS_CACHE_GUEST_RSP]		= VMCS_GUEST_RSP,
+	[VMCS_CACHE_GUEST_RFLAGS]	= VMCS_GUEST_RFLAGS,
+	[VMCS_CACHE_GUEST_INTR_STATE]	= VMCS_32BIT_GUEST_INTERRUPTIBILITY_STATE,
+	[VMCS_CACHE_ENTRY_INTR_INFO]	= VMCS_32BIT_CONTROL_VMENTRY_INTERRUPTION_INFO,
+	[VMCS_CACHE_PROC_CTLS]		= VMCS_32BIT_CONTROL_PROCESSOR_BASED_VMEXEC_CONTROLS,
+};
+
+// Fields a VM exit leaves alone, which stay valid across it.
+#define VMCS_CACHE_PERSISTENT	(1 << VMCS_CACHE_PROC_CTLS)
+
+// Read field f of the guest's VMCS, which must be the current VMCS
+// unless f is already cached.
+uint64_t
+vmcs_cache_read(struct VmxGuestInfo *ginfo, int f) {
+	if (!(ginfo->vmcs_cache_valid & (1 << f))) {
+		ginfo->vmcs_cache[f] = vmcs_read64(vmcs_cache_fields[f]);
+		ginfo->vmcs_cache_valid |= 1 << f;
+	}
+	return ginfo->vmcs_cache[f];
+}
+
+// Set field f of the guest's VMCS.  The VMWRITE happens just before
+// the guest is next entered, and only if the value changed.
+void
+vmcs_cache_write(struct VmxGuestInfo *ginfo, int f, uint64_t val) {
+	if ((ginfo->vmcs_cache_valid & (1 << f)) && ginfo->vmcs_cache[f] == val)
+		return;
+	ginfo->vmcs_cache[f] = val;
+	ginfo->vmcs_cache_valid |= 1 << f;
+	ginfo->vmcs_cache_dirty |= 1 << f;
+}
+
+// Write back changed fields; the guest's VMCS must be current.
+static void
+vmcs_cache_sync(struct VmxGuestInfo *ginfo) {
+	int f;
+
+	for (f = 0; ginfo->vmcs_cache_dirty; f++)
+		if (ginfo->vmcs_cache_dirty & (1 << f)) {
+			vmcs_write64(vmcs_cache_fields[f], ginfo->vmcs_cache[f]);
+			ginfo->vmcs_cache_dirty &= ~(1 << f);
+		}
+}
+
+// The guest just exited: forget everything the exit may have changed.
+static void
+vmcs_cache_exit(struct VmxGuestInfo *ginfo) {
+	static_assert(VMCS_CACHE_NFIELDS <= VMCS_CACHE_SIZE);
+	ginfo->vmcs_cache_valid &= VMCS_CACHE_PERSISTENT;
+}
+
+// Guest state fields that vmx_state_save keeps: everything the guest
+// may have changed that vmcs_guest_init and vmcs_ctls_init don't set up
+// again for a fresh VMCS.
+static const uint32_t vmx_state_fields[] = {
+	VMCS_16BIT_GUEST_ES_SELECTOR, VMCS_16BIT_GUEST_CS_SELECTOR,
+	VMCS_16BIT_GUEST_SS_SELECTOR, VMCS_16BIT_GUEST_DS_SELECTOR,
+	VMCS_16BIT_GUEST_FS_SELECTOR, VMCS_16BIT_GUEST_GS_SELECTOR,
+	VMCS_16BIT_GUEST_LDTR_SELECTOR, VMCS_16BIT_GUEST_TR_SELECTOR,
+	VMCS_32BIT_GUEST_ES_LIMIT, VMCS_32BIT_GUEST_CS_LIMIT,
+	VMCS_32BIT_GUEST_SS_LIMIT, VMCS_32BIT_GUEST_DS_LIMIT,
+	VMCS_32BIT_GUEST_FS_LIMIT, VMCS_32BIT_GUEST_GS_LIMIT,
+	VMCS_32BIT_GUEST_LDTR_LIMIT, VMCS_32BIT_GUEST_TR_LIMIT,
+	VMCS_32BIT_GUEST_GDTR_LIMIT, VMCS_32BIT_GUEST_IDTR_LIMIT,
+	VMCS_32BIT_GUEST_ES_ACCESS_RIGHTS, VMCS_32BIT_GUEST_CS_ACCESS_RIGHTS,
+	VMCS_32BIT_GUEST_SS_ACCESS_RIGHTS, VMCS_32BIT_GUEST_DS_ACCESS_RIGHTS,
+	VMCS_32BIT_GUEST_FS_ACCESS_RIGHTS, VMCS_32BIT_GUEST_GS_ACCESS_RIGHTS,
+	VMCS_32BIT_GUEST_LDTR_ACCESS_RIGHTS, VMCS_32BIT_GUEST_TR_ACCESS_RIGHTS,
+	VMCS_GUEST_ES_BASE, VMCS_GUEST_CS_BASE, VMCS_GUEST_SS_BASE,
+	VMCS_GUEST_DS_BASE, VMCS_GUEST_FS_BASE, VMCS_GUEST_GS_BASE,
+	VMCS_GUEST_LDTR_BASE, VMCS_GUEST_TR_BASE,
+	VMCS_GUEST_GDTR_BASE, VMCS_GUEST_IDTR_BASE,
+	VMCS_GUEST_CR0, VMCS_GUEST_CR3, VMCS_GUEST_CR4, VMCS_GUEST_DR7,
+	VMCS_GUEST_RSP, VMCS_GUEST_RIP, VMCS_GUEST_RFLAGS,
+	VMCS_GUEST_PENDING_DBG_EXCEPTIONS,
+	VMCS_32BIT_GUEST_IA32_SYSENTER_CS_MSR,
+	VMCS_GUEST_IA32_SYSENTER_ESP_MSR, VMCS_GUEST_IA32_SYSENTER_EIP_MSR,
+	VMCS_32BIT_GUEST_INTERRUPTIBILITY_STATE,
+	VMCS_32BIT_GUEST_ACTIVITY_STATE,
+	VMCS_64BIT_GUEST_IA32_DEBUGCTL,
+	// For its IA-32e mode guest bit.
+	VMCS_32BIT_CONTROL_VMENTRY_CONTROLS,
+};
+#define VMX_STATE_NFIELDS (sizeof(vmx_state_fields) / sizeof(vmx_state_fields[0]))
+
+// Allocate the page ginfo's saved state goes in, if it has none yet.
+static int
+vmx_state_page(struct VmxGuestInfo *ginfo) {
+	struct PageInfo *pp;
+
+	static_assert(VMX_STATE_NFIELDS <= VMX_STATE_MAX);
+	static_assert(VMX_STATE_MAX * sizeof(uint64_t) <= PGSIZE);
+	if (ginfo->state)
+		return 0;
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	pp->pp_ref++;
+	ginfo->state = page2kva(pp);
+	return 0;
+}
+
+// Save the state of guest e, whose VMCS must be current, so that it
+// can be cloned (see vmx_guest_clone).  Its general registers are in
+// env_tf already.
+int vmx_state_save(struct Env *e) {
+	struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+	int i, r;
+
+	if ((r = vmx_state_page(ginfo)) < 0)
+		return r;
+	vmcs_cache_sync(ginfo);
+	for (i = 0; i < VMX_STATE_NFIELDS; i++)
+		ginfo->state[i] = vmcs_read64(vmx_state_fields[i]);
+	ginfo->state_saved = true;
+	return 0;
+}
+
+// Load saved state into e's fresh, current VMCS, over what
+// vmcs_guest_init and the first-launch cache writes put there.
+static void
+vmx_state_load(struct Env *e) {
+	struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+	uint64_t val;
+	int i;
+
+	for (i = 0; i < VMX_STATE_NFIELDS; i++) {
+		val = ginfo->state[i];
+		// Of the entry controls only the guest's mode is its own; the
+		// state may have come from user space (see vmx_state_set).
+		if (vmx_state_fields[i] == VMCS_32BIT_CONTROL_VMENTRY_CONTROLS)
+			val = (vmcs_read32(vmx_state_fields[i]) & ~VMCS_VMENTRY_x64_GUEST) |
+				(val & VMCS_VMENTRY_x64_GUEST);
+		vmcs_write64(vmx_state_fields[i], val);
+	}
+	ginfo->vmcs_cache_valid = ginfo->vmcs_cache_dirty = 0;
+}
+
+// Make a new guest that is a copy of guest src, sharing its memory
+// copy-on-write.  src must have one vCPU, and either never have run or
+// have had its state saved since it last ran: it is a snapshot, or a
+// guest paused with VMX_VMCALL_BACKTOHOST.  The new guest is not
+// runnable.
+int vmx_guest_clone(struct Env *src, struct Env **store) {
+	struct VmxGuestInfo *sg = &src->env_vmxinfo, *dg;
+	struct PageInfo *pp;
+	struct Env *e;
+	int r;
+
+	if (vmx_vcpu_count(src) != 1 || (src->env_runs && !sg->state_saved))
+		return -E_INVAL;
+	if ((r = env_guest_alloc(&e, src->env_parent_id, NULL)) < 0)
+		return r;
+	e->env_status = ENV_NOT_RUNNABLE;
+	dg = &e->env_vmxinfo;
+	if (sg->state_saved) {
+		if (!(pp = page_alloc(0))) {
+			env_free(e);
+			return -E_NO_MEM;
+		}
+		pp->pp_ref++;
+		dg->state = page2kva(pp);
+		memcpy(dg->state, sg->state, PGSIZE);
+		dg->state_saved = true;
+	}
+	if ((r = ept_snapshot(src->env_pml4e, e->env_pml4e)) < 0) {
+		env_free(e);
+		return r;
+	}
+
+	e->env_tf = src->env_tf;
+	dg->phys_sz = sg->phys_sz;
+	dg->ksm_shared = sg->ksm_shared;
+	dg->prefault = sg->prefault;
+	dg->prefault_next = sg->prefault_next;
+	memcpy(dg->vlapic, sg->vlapic, PGSIZE);
+	dg->vlapic_deadline = sg->vlapic_deadline;
+	memcpy(dg->vlapic_extint, sg->vlapic_extint, sizeof(dg->vlapic_extint));
+	memcpy(dg->msr_guest_area, sg->msr_guest_area, PGSIZE / 2);
+	dg->vdev = sg->vdev;
+	dg->vcons_ring = sg->vcons_ring;
+	*store = e;
+	return 0;
+}
+
+// Copy the state of guest e, which must have one vCPU and be paused
+// with its state saved, into ss.
+void vmx_state_get(struct Env *e, struct VmxSavedState *ss) {
+	struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+	uint64_t now = read_tsc();
+
+	ss->ss_tf = e->env_tf;
+	ss->ss_phys_sz = ginfo->phys_sz;
+	ss->ss_prefault = ginfo->prefault;
+	ss->ss_vblk_ring = ginfo->vblk_ring;
+	ss->ss_vcons_ring = ginfo->vcons_ring;
+	ss->ss_vdev = ginfo->vdev;
+	ss->ss_nstate = VMX_STATE_NFIELDS;
+	memcpy(ss->ss_state, ginfo->state, VMX_STATE_NFIELDS * sizeof(uint64_t));
+	memcpy(ss->ss_msr_area, ginfo->msr_guest_area, PGSIZE / 2);
+	memcpy(ss->ss_vlapic, ginfo->vlapic, PGSIZE);
+	// The deadline is in this host's TSC; keep what is left of it.
+	ss->ss_vlapic_timer = 0;
+	if (ginfo->vlapic_deadline)
+		ss->ss_vlapic_timer = ginfo->vlapic_deadline > now ?
+			ginfo->vlapic_deadline - now : 1;
+	memcpy(ss->ss_vlapic_extint, ginfo->vlapic_extint,
+	       sizeof(ss->ss_vlapic_extint));
+}
+
+// Is gpa 0 (no ring) or a page of guest RAM, for a ring in ss?
+static bool
+vmx_state_ring_ok(struct VmxGuestInfo *ginfo, uint64_t gpa) {
+	return gpa == 0 || (!PGOFF(gpa) &&
+		(gpa < 0xA0000 || (gpa >= 0x100000 && gpa < ginfo->phys_sz)));
+}
+
+// Give guest e, which must have one vCPU and never have run, the state
+// in ss, as vmx_state_get left it for a guest of the same size.  Like a
+// clone, e picks up from there when it first runs.
+//
+// ss comes from a file, so only what is checked here is taken from it:
+// the MSR area must switch the same MSRs msr_setup does, of which only
+// the values are copied, and the rings and device state must be ones
+// the guest could have set up.
+int vmx_state_set(struct Env *e, const struct VmxSavedState *ss) {
+	struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+	const struct vmx_msr_entry *from;
+	struct vmx_msr_entry *to;
+	int i, r;
+
+	if (ss->ss_nstate != VMX_STATE_NFIELDS || ss->ss_phys_sz != ginfo->phys_sz ||
+	    !vmx_state_ring_ok(ginfo, ss->ss_vblk_ring) ||
+	    !vmx_state_ring_ok(ginfo, ss->ss_vcons_ring) ||
+	    ss->ss_vdev.cmos_index > 0x7F ||
+	    ss->ss_vdev.pic_icw[0] > 3 || ss->ss_vdev.pic_icw[1] > 3)
+		return -E_INVAL;
+	msr_setup(ginfo);
+	from = (const struct vmx_msr_entry *) ss->ss_msr_area;
+	to = (struct vmx_msr_entry *) ginfo->msr_guest_area;
+	for (i = 0; i < ginfo->msr_count; i++)
+		if (from[i].msr_index != to[i].msr_index)
+			return -E_INVAL;
+	if ((r = vmx_state_page(ginfo)) < 0)
+		return r;
+	memcpy(ginfo->state, ss->ss_state, VMX_STATE_NFIELDS * sizeof(uint64_t));
+	ginfo->state_saved = true;
+	e->env_tf.tf_regs = ss->ss_tf.tf_regs;
+	e->env_tf.tf_rip = ss->ss_tf.tf_rip;
+	e->env_tf.tf_rsp = ss->ss_tf.tf_rsp;
+	ginfo->vblk_ring = ss->ss_vblk_ring;
+	ginfo->vcons_ring = ss->ss_vcons_ring;
+	ginfo->vdev = ss->ss_vdev;
+	for (i = 0; i < ginfo->msr_count; i++)
+		to[i].msr_value = from[i].msr_value;
+	memcpy(ginfo->vlapic, ss->ss_vlapic, PGSIZE);
+	ginfo->vlapic_deadline = ss->ss_vlapic_timer ?
+		read_tsc() + ss->ss_vlapic_timer : 0;
+	memcpy(ginfo->vlapic_extint, ss->ss_vlapic_extint,
+	       sizeof(ginfo->vlapic_extint));
+	vcons_focus(e);
+	return 0;
+}
+
+static void
+vmx_stat_add(struct VmxExitStat *xs, uint64_t cycles) {
+	int b = 0;
+
+	xs->xs_count++;
+	xs->xs_cycles += cycles;
+	while (b < VMX_HIST_BUCKETS - 1 && (cycles >> (VMX_HIST_MIN_SHIFT + b)))
+		b++;
+	xs->xs_hist[b]++;
+}
+
+// Charge cycles to the exit ginfo last took, as time spent handling it,
+// or with blocked, as time the guest then spent blocked.
+static void
+vmx_exit_charge(struct VmxGuestInfo *ginfo, uint64_t cycles, bool blocked) {
+	struct VmxExitStat *xs[2] = { NULL, NULL };
+	int i;
+
+	if (ginfo->exit_reason < VMX_EXIT_NREASONS)
+		xs[0] = &ginfo->stats->vs_exit[ginfo->exit_reason];
+	if (ginfo->exit_reason == EXIT_REASON_VMCALL &&
+	    ginfo->exit_vmcall >= 0 && ginfo->exit_vmcall < VMX_VMCALL_NCODES)
+		xs[1] = &ginfo->stats->vs_vmcall[ginfo->exit_vmcall];
+	for (i = 0; i < 2; i++) {
+		if (!xs[i])
+			continue;
+		if (blocked)
+			xs[i]->xs_blocked += cycles;
+		else
+			vmx_stat_add(xs[i], cycles);
+	}
+}
+
+// The handler of the exit being handled is done: charge the exit with
+// the time since it was taken.  If blocked, the guest now waits (in HLT,
+// for IPC, for its block ring), and the time until it runs again is
+// charged separately (see vmx_exit_account).  Handlers that don't
+// return to vmexit call this before they give up the CPU.
+void vmx_exit_done(struct VmxGuestInfo *ginfo, bool blocked) {
+	uint64_t now = read_tsc();
+
+	if (!ginfo->exit_tsc)
+		return;
+	vmx_exit_charge(ginfo, now - ginfo->exit_tsc, false);
+	ginfo->exit_tsc = 0;
+	if (blocked)
+		ginfo->blocked_tsc = now;
+}
+
+// The guest is about to be resumed: charge the exit it is coming back
+// from with the time it was blocked, if it was.
+static void
+vmx_exit_account(struct VmxGuestInfo *ginfo) {
+	vmx_exit_done(ginfo, false);
+	if (!ginfo->blocked_tsc)
+		return;
+	vmx_exit_charge(ginfo, read_tsc() - ginfo->blocked_tsc, true);
+	ginfo->blocked_tsc = 0;
+}
+
+// Charge the time the guest just ran to its timeslice.
+static void
+vmx_slice_charge(struct VmxGuestInfo *ginfo) {
+	uint64_t ran = ginfo->exit_tsc - ginfo->entry_tsc;
+
+	ginfo->slice_left = ran < ginfo->slice_left ? ginfo->slice_left - ran : 0;
+}
+
+// Arm the preemption timer to exit when the guest's timeslice is up
+// (starting a new one if the last is used up), or sooner if its APIC
+// timer fires first.
+static void
+vmx_slice_arm(struct VmxGuestInfo *ginfo) {
+	uint64_t now = read_tsc(), cycles;
+
+	if (ginfo->slice_left == 0)
+		ginfo->slice_left = VMX_TIMESLICE;
+	cycles = ginfo->slice_left;
+	// A deadline already past fires on the next instruction.
+	if (ginfo->vlapic_deadline)
+		cycles = ginfo->vlapic_deadline > now ?
+			 MIN(cycles, ginfo->vlapic_deadline - now) : 0;
+	if (preempt_shift >= 0)
+		vmcs_write32(VMCS_32BIT_GUEST_PREEMPTION_TIMER_VALUE,
+			     MIN(cycles >> preempt_shift, (uint64_t) 0xffffffff));
+}
+
 void vmexit() {
 	int exit_reason = -1;
 	bool exit_handled = false;
-	static uint32_t host_vector;
 	// Get the reason for VMEXIT from the VMCS.
 	// Your code here.
 
+	// Another CPU destroyed this vCPU's guest while it ran.
+	if (curenv->env_status == ENV_DYING)
+		env_destroy(curenv);
+
 	// -- LAB 3 --
 	// check the VMCS for the exit reason
-	exit_reason = vmcs_read32(VMCS_32BIT_VMEXIT_REASON);
+	exit_reason = vmcs_cache_read(&curenv->env_vmxinfo, VMCS_CACHE_EXIT_REASON);
+	curenv->env_stat.es_vmexits++;
+	// Handlers may clobber rax, so note the exit now; it is charged
+	// when the handler is done (see vmx_exit_done).
+	curenv->env_vmxinfo.exit_tsc = read_tsc();
+	vmx_slice_charge(&curenv->env_vmxinfo);
+	curenv->env_vmxinfo.exit_reason = exit_reason & EXIT_REASON_MASK;
+	curenv->env_vmxinfo.exit_vmcall = curenv->env_tf.tf_regs.reg_rax;
 
 	//cprintf( "---VMEXIT Reason: %d---\n", exit_reason );
 	/* vmcs_dump_cpu(); */
 
 	switch(exit_reason & EXIT_REASON_MASK) {
         case EXIT_REASON_EXTERNAL_INT:
-            host_vector = vmcs_read32(VMCS_32BIT_VMEXIT_INTERRUPTION_INFO);
-            exit_handled = handle_interrupts(&curenv->env_tf, &curenv->env_vmxinfo, host_vector);
+            exit_handled = handle_interrupts(&curenv->env_tf, &curenv->env_vmxinfo,
+                    vmcs_cache_read(&curenv->env_vmxinfo, VMCS_CACHE_EXIT_INTR_INFO));
             break;
         case EXIT_REASON_INTERRUPT_WINDOW:
-            exit_handled = handle_interrupt_window(&curenv->env_tf, &curenv->env_vmxinfo, host_vector);
+            exit_handled = handle_interrupt_window(&curenv->env_tf, &curenv->env_vmxinfo);
             break;
         case EXIT_REASON_RDMSR:
             exit_handled = handle_rdmsr(&curenv->env_tf, &curenv->env_vmxinfo);
@@ -461,6 +1312,12 @@ void vmexit() {
         case EXIT_REASON_EPT_VIOLATION:
             exit_handled = handle_eptviolation(curenv->env_pml4e, &curenv->env_vmxinfo);
             break;
+        case EXIT_REASON_EPT_MISCONFIG:
+            // A device may leave misconfigured entries to trap on.
+            exit_handled = vdev_mmio(curenv->env_pml4e, &curenv->env_vmxinfo,
+                                     vmcs_cache_read(&curenv->env_vmxinfo,
+                                                     VMCS_CACHE_GUEST_PHYS_ADDR), 0);
+            break;
         case EXIT_REASON_IO_INSTRUCTION:
             exit_handled = handle_ioinstr(&curenv->env_tf, &curenv->env_vmxinfo);
             break;
@@ -472,8 +1329,11 @@ void vmexit() {
                     curenv->env_pml4e);
             break;
         case EXIT_REASON_HLT:
-            cprintf("\nHLT in guest, exiting guest.\n");
-            env_destroy(curenv);
+            exit_handled = handle_hlt(&curenv->env_tf, &curenv->env_vmxinfo);
+            break;
+        case EXIT_REASON_VMX_PREEMPT_TIMER:
+            // Timeslice over, or the guest's APIC timer is due: either
+            // way, back to the scheduler below.
             exit_handled = true;
             break;
 	}
@@ -483,7 +1343,17 @@ void vmexit() {
 		vmcs_dump_cpu();
 		env_destroy(curenv);
 	}
-
+	vmx_exit_done(&curenv->env_vmxinfo, curenv->env_status == ENV_NOT_RUNNABLE);
+
+	// Fast path: a hypercall that returned at once resumes the guest
+	// for the rest of its timeslice, without a pass of the scheduler.
+	// Not while a host interrupt (a clock tick, or an IPI from another
+	// CPU) waits: interrupts are off here, and the trap path that takes
+	// it does the accounting and wakeups the scheduler relies on.
+	if ((exit_reason & EXIT_REASON_MASK) == EXIT_REASON_VMCALL &&
+	    curenv->env_status == ENV_RUNNING && curenv->env_vmxinfo.slice_left &&
+	    !lapic_intr_pending())
+		env_run(curenv);
 	sched_yield();
 }
 
@@ -498,6 +1368,9 @@ void asm_vmrun(struct Trapframe *tf) {
 	// e (the env we got the trapframe from) and curenv are the same at this point
 	tf->tf_ds = curenv->env_runs;
 	tf->tf_es = 0;
+	// Set before the lock goes, so that ept_invalidate sees we may be
+	// in the guest; a kick sent before we enter makes us exit at once.
+	thiscpu->cpu_in_guest = true;
 	unlock_kernel();
 	asm(
 		"push %%rdx; push %%rbp;"
@@ -620,50 +1493,128 @@ void asm_vmrun(struct Trapframe *tf) {
 		  , "rax", "rbx", "rdi", "rsi"
 		  , "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
 		);
+	thiscpu->cpu_in_guest = false;
+	env_charge(curenv);
 	lock_kernel();
 	if(tf->tf_es) {
 		cprintf("Error during VMLAUNCH/VMRESUME\n");
 	} else {
-		curenv->env_tf.tf_rsp = vmcs_read64(VMCS_GUEST_RSP);
-		curenv->env_tf.tf_rip = vmcs_read64(VMCS_GUEST_RIP);
+		vmcs_cache_exit(&curenv->env_vmxinfo);
 		vmexit();
 	}
 }
 
+// How guest accesses to an MSR are handled.  MSRs not listed here
+// always exit, and the guest is killed if it touches them.
+enum {
+	// RDMSR/WRMSR exit and are emulated on the guest's copy in the
+	// MSR store area (see handle_rdmsr/handle_wrmsr).
+	MSR_SHADOW,
+	// The guest accesses the MSR directly, without exits.
+	MSR_PASSTHROUGH,
+};
+
+static const struct {
+	uint32_t msr;
+	int policy;
+	// Switch the MSR between host and guest values through the MSR
+	// load/store areas.  FS and GS base don't need this, they are
+	// part of the VMCS guest and host state.
+	bool switched;
+} vmx_msrs[] = {
+	// Setting LME has to reach handle_wrmsr.
+	{ EFER_MSR,		MSR_SHADOW,		true },
+	// Fast system calls and TLS.
+	{ STAR_MSR,		MSR_PASSTHROUGH,	true },
+	{ LSTAR_MSR,		MSR_PASSTHROUGH,	true },
+	{ CSTAR_MSR,		MSR_PASSTHROUGH,	true },
+	{ SFMASK_MSR,		MSR_PASSTHROUGH,	true },
+	{ KERNEL_GS_BASE_MSR,	MSR_PASSTHROUGH,	true },
+	{ FS_BASE_MSR,		MSR_PASSTHROUGH,	false },
+	{ GS_BASE_MSR,		MSR_PASSTHROUGH,	false },
+	{ TSC_AUX_MSR,		MSR_PASSTHROUGH,	true },
+};
+#define NVMX_MSRS (sizeof(vmx_msrs) / sizeof(vmx_msrs[0]))
+
+// Return false if this processor doesn't implement msr.
+static bool
+msr_supported(uint32_t msr) {
+	uint32_t eax, edx;
+
+	if (msr != TSC_AUX_MSR)
+		return true;
+	// TSC_AUX exists iff RDTSCP does, and guests only get it if they
+	// can run RDTSCP.
+	if (!rdtscp_support)
+		return false;
+	cpuid(0x80000000, &eax, NULL, NULL, NULL);
+	if (eax < 0x80000001)
+		return false;
+	cpuid(0x80000001, NULL, NULL, NULL, &edx);
+	return BIT(edx, 27);
+}
+
+// Fill in the MSR load/store areas with the MSRs switched on VM entry
+// and exit.  The guest's values are left as they are.
 void
 msr_setup(struct VmxGuestInfo *ginfo) {
 	struct vmx_msr_entry *entry;
-	uint32_t idx[] = { EFER_MSR };
-	int i, count = sizeof(idx) / sizeof(idx[0]);
+	int i, count = 0;
 
-	assert(count <= MAX_MSR_COUNT);
-	ginfo->msr_count = count;
+	for(i=0; i<NVMX_MSRS; ++i) {
+		if(!vmx_msrs[i].switched || !msr_supported(vmx_msrs[i].msr))
+			continue;
+		assert(count < MAX_MSR_COUNT);
 
-	for(i=0; i<count; ++i) {
-		entry = ((struct vmx_msr_entry *)ginfo->msr_host_area) + i;
-		entry->msr_index = idx[i];
-		entry->msr_value = read_msr(idx[i]);
+		entry = ((struct vmx_msr_entry *)ginfo->msr_host_area) + count;
+		entry->msr_index = vmx_msrs[i].msr;
+		entry->msr_value = read_msr(vmx_msrs[i].msr);
 
-		entry = ((struct vmx_msr_entry *)ginfo->msr_guest_area) + i;
-		entry->msr_index = idx[i];
+		entry = ((struct vmx_msr_entry *)ginfo->msr_guest_area) + count;
+		entry->msr_index = vmx_msrs[i].msr;
+		count++;
 	}
+	ginfo->msr_count = count;
+}
+
+// Let the guest read and/or write msr without exits.
+static void
+msr_bitmap_allow(struct VmxGuestInfo *ginfo, uint32_t msr, bool read, bool write) {
+	// The bitmap is four 1KB bitmaps: reads of MSRs 0-0x1fff, reads
+	// of 0xc0000000-0xc0001fff, then writes of the same two ranges.
+	uint8_t *bmap = (uint8_t *) ginfo->msr_bmap;
+	uint32_t bit = msr & 0x1fff;
+
+	if(msr >= 0xc0000000)
+		bmap += 1024;
+	if (read)
+		bmap[bit / 8] &= ~(1 << (bit % 8));
+	if (write)
+		bmap[2048 + bit / 8] &= ~(1 << (bit % 8));
 }
 
 void
 bitmap_setup(struct VmxGuestInfo *ginfo) {
-	unsigned int io_ports[] = { IO_RTC, IO_RTC+1 };
-	int i, count = sizeof(io_ports) / sizeof(io_ports[0]);
-
-	for(i=0; i<count; ++i) {
-		int idx = io_ports[i] / (sizeof(uint64_t) * 8);
-		if(io_ports[i] < 0x7FFF) {
-			ginfo->io_bmap_a[idx] |= ((0x1uL << (io_ports[i] & 0x3F)));
-		} else if (io_ports[i] < 0xFFFF) {
-			ginfo->io_bmap_b[idx] |= ((0x1uL << (io_ports[i] & 0x3F)));
-		} else {
-			assert(false);
-		}
-	}
+	int i;
+
+	// Every MSR access exits unless its policy says otherwise.
+	memset(ginfo->msr_bmap, 0xff, PGSIZE);
+	for(i=0; i<NVMX_MSRS; ++i)
+		if(vmx_msrs[i].policy == MSR_PASSTHROUGH &&
+		   msr_supported(vmx_msrs[i].msr))
+			msr_bitmap_allow(ginfo, vmx_msrs[i].msr, true, true);
+	// With virtual-interrupt delivery the processor handles EOIs.  With
+	// APIC-register virtualization it also answers reads of the APIC
+	// ID, which an SMP guest does on every cpunum().
+	if (ginfo->vlapic_apicv)
+		msr_bitmap_allow(ginfo, VLAPIC_MSR_BASE + VLAPIC_EOI / 16,
+				 false, true);
+	if (ginfo->vlapic_apicv && apicreg_support)
+		msr_bitmap_allow(ginfo, VLAPIC_MSR_BASE + VLAPIC_ID / 16,
+				 true, false);
+
+	// The I/O ports of emulated devices exit.
+	vdev_io_bitmap(ginfo);
 }
 
 /*
@@ -695,13 +1646,30 @@ int vmx_vmrun( struct Env *e ) {
 
 		vmcs_host_init();
 		vmcs_guest_init();
+		e->env_vmxinfo.vlapic_apicv = apicv_support;
 		// Setup IO and exception bitmaps.
 		bitmap_setup(&e->env_vmxinfo);
 		// Setup the msr load/store area
 		msr_setup(&e->env_vmxinfo);
 		vmcs_ctls_init(e);
-
-		/* ept_alloc_static(e->env_pml4e, &e->env_vmxinfo); */
+		e->env_vmxinfo.vmcs_cache_valid = 0;
+		vmcs_cache_write(&e->env_vmxinfo, VMCS_CACHE_GUEST_RSP, e->env_tf.tf_rsp);
+		vmcs_cache_write(&e->env_vmxinfo, VMCS_CACHE_GUEST_RIP, e->env_tf.tf_rip);
+		// A clone picks up where its original was saved.
+		if (e->env_vmxinfo.state_saved)
+			vmx_state_load(e);
+
+		// The VPID and the EPT root page may have belonged to an
+		// earlier guest on this CPU; drop what it left cached.
+		if (e->env_vmxinfo.vpid)
+			invvpid(INVVPID_SINGLE_CONTEXT, e->env_vmxinfo.vpid);
+		e->env_vmxinfo.ept_stale = true;
+
+		// The guest image is in place by now, so prefaulting can't
+		// collide with it.  Anything left over is faulted in lazily.
+		if (e->env_vmxinfo.prefault == VMX_PREFAULT_EAGER)
+			ept_prefault(e->env_pml4e, &e->env_vmxinfo,
+				     e->env_vmxinfo.phys_sz / PGSIZE);
 
 	} else {
 		// Make this VMCS working VMCS.
@@ -711,8 +1679,17 @@ int vmx_vmrun( struct Env *e ) {
 		}
 	}
 
-	vmcs_write64( VMCS_GUEST_RSP, curenv->env_tf.tf_rsp  );
-	vmcs_write64( VMCS_GUEST_RIP, curenv->env_tf.tf_rip );
+	if (e->env_vmxinfo.ept_stale) {
+		invept(invept_type, vmcs_read64(VMCS_64BIT_CONTROL_EPTPTR));
+		e->env_vmxinfo.ept_stale = false;
+	}
+	vmx_exit_account(&e->env_vmxinfo);
+	vlapic_inject(&e->env_vmxinfo);
+	vmx_slice_arm(&e->env_vmxinfo);
+	vmcs_cache_sync(&e->env_vmxinfo);
+	// It is about to change.
+	e->env_vmxinfo.state_saved = false;
+	e->env_vmxinfo.entry_tsc = read_tsc();
     // panic("asm_vmrun is incomplete");
 	asm_vmrun( &e->env_tf );
 	return 0;
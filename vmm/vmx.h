@@ -26,14 +26,59 @@ struct vmx_msr_entry {
     uint64_t msr_value;
 } __attribute__((__packed__));
 
+// VMCS fields cached per guest.  VMREAD and VMWRITE are slow under
+// nested virtualization, so exit handlers read these through the cache,
+// which fills lazily after each exit, and write them back only if they
+// changed, just before the next entry.
+enum {
+	VMCS_CACHE_EXIT_REASON,
+	VMCS_CACHE_EXIT_QUALIFICATION,
+	VMCS_CACHE_EXIT_INSTR_LEN,
+	VMCS_CACHE_EXIT_INTR_INFO,
+	VMCS_CACHE_GUEST_PHYS_ADDR,
+	VMCS_CACHE_GUEST_RIP,
+	VMCS_CACHE_GUEST_RSP,
+	VMCS_CACHE_GUEST_RFLAGS,
+	VMCS_CACHE_GUEST_INTR_STATE,
+	VMCS_CACHE_ENTRY_INTR_INFO,
+	// Controls; these survive VM exits.
+	VMCS_CACHE_PROC_CTLS,
+	VMCS_CACHE_NFIELDS
+};
+
+uint64_t vmcs_cache_read(struct VmxGuestInfo *ginfo, int f);
+void vmcs_cache_write(struct VmxGuestInfo *ginfo, int f, uint64_t val);
+
 bool vmx_check_ept();
+bool vmx_ept_ad();
+bool vmx_rdtscp();
+uint16_t vmx_vpid_alloc();
+void vmx_vpid_free(uint16_t vpid);
 bool vmx_check_support();
 int vmx_get_vmdisk_number();
-void vmx_incr_vmdisk_number();
+int vmx_incr_vmdisk_number();
 int vmx_init_vmxon();
 int vmx_vmrun( struct Env *e );
+void msr_setup(struct VmxGuestInfo *ginfo);
 void vmx_list_vms();
+void vmx_prefault_idle();
+void vmx_halt_wakeup();
+bool vmx_halted_guests();
+int vmx_vcpu_count(struct Env *guest);
+struct Env *vmx_vcpu_leader(struct Env *e);
+bool vmx_vcpus_running(struct Env *e);
+void vmx_exit_done(struct VmxGuestInfo *ginfo, bool blocked);
+uint32_t vmx_balloon_target(struct Env *e);
+int vmx_vcpu_place(struct Env *e);
+void vmx_vcpu_ipi(struct VmxGuestInfo *ginfo, uint64_t icr);
+void vmx_vcpu_extint(struct Env *e, int vector);
+void vmx_vcpus_destroy(struct Env *e);
+struct Env *vmx_gang_pick();
 bool vmx_sel_resume(int num);
+int vmx_state_save(struct Env *e);
+int vmx_guest_clone(struct Env *src, struct Env **store);
+void vmx_state_get(struct Env *e, struct VmxSavedState *ss);
+int vmx_state_set(struct Env *e, const struct VmxSavedState *ss);
 struct PageInfo * vmx_init_vmcs();
 
 /* VMX Capalibility MSRs */
@@ -336,6 +381,7 @@ static __inline uint64_t vmcs_read64(uint32_t field)
 #define VMCS_PIN_BASED_VMEXEC_CTL_EXINTEXIT	0x1
 #define VMCS_PIN_BASED_VMEXEC_CTL_NMIEXIT	0x8
 #define VMCS_PIN_BASED_VMEXEC_CTL_VIRTNMIS	0x20
+#define VMCS_PIN_BASED_VMEXEC_CTL_PREEMPT_TIMER	0x40
 
 #define VMCS_PROC_BASED_VMEXEC_CTL_INTRWINEXIT  0x4
 #define VMCS_PROC_BASED_VMEXEC_CTL_USETSCOFF	0x8
@@ -360,13 +406,26 @@ static __inline uint64_t vmcs_read64(uint32_t field)
 #define VMCS_PROC_BASED_VMEXEC_CTL_ACTIVESECCTL	0x80000000
 
 #define VMCS_SECONDARY_VMEXEC_CTL_ENABLE_EPT          0x2
+#define VMCS_SECONDARY_VMEXEC_CTL_ENABLE_RDTSCP       0x8
+#define VMCS_SECONDARY_VMEXEC_CTL_VIRT_X2APIC         0x10
+#define VMCS_SECONDARY_VMEXEC_CTL_ENABLE_VPID         0x20
 #define VMCS_SECONDARY_VMEXEC_CTL_UNRESTRICTED_GUEST  0x80
+#define VMCS_SECONDARY_VMEXEC_CTL_APIC_REG_VIRT       0x100
+#define VMCS_SECONDARY_VMEXEC_CTL_VIRT_INTR_DELIVERY  0x200
 
 #define VMCS_VMEXIT_HOST_ADDR_SIZE ( 0x1 << 9 )
 #define VMCS_VMEXIT_GUEST_ACK_INTR_ON_EXIT ( 0x1 << 15 )
 
 #define VMCS_VMENTRY_x64_GUEST ( 0x1 << 9 )
 
+// VM-entry/exit interruption information.
+#define VMCS_INTR_INFO_VALID		0x80000000
+#define VMCS_INTR_TYPE_EXT_INT		( 0x0 << 8 )
+
+// Guest interruptibility state.
+#define VMCS_INTERRUPTIBILITY_STI	0x1
+#define VMCS_INTERRUPTIBILITY_MOVSS	0x2
+
 // VMEXIT reasons.
 #define EXIT_REASON_MASK		0xFFFF
 
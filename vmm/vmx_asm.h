@@ -39,6 +39,33 @@ vmptrld( physaddr_t vmcs_region ) {
     return error;
 }
 
+#define INVEPT_SINGLE_CONTEXT	1
+#define INVEPT_ALL_CONTEXT	2
+#define INVVPID_SINGLE_CONTEXT	1
+#define INVVPID_ALL_CONTEXT	2
+
+// Flush cached translations derived from the EPT rooted in eptp.
+static __inline uint8_t
+invept( uint64_t type, uint64_t eptp ) {
+	uint8_t error = 0;
+	struct { uint64_t eptp, reserved; } desc = { eptp, 0 };
+
+    __asm __volatile("clc; invept %1, %2; setna %0"
+            : "=q"( error ) : "m" ( desc ), "r" ( type ) : "cc", "memory");
+    return error;
+}
+
+// Flush cached guest-linear translations tagged with vpid.
+static __inline uint8_t
+invvpid( uint64_t type, uint16_t vpid ) {
+	uint8_t error = 0;
+	struct { uint64_t vpid, gva; } desc = { vpid, 0 };
+
+    __asm __volatile("clc; invvpid %1, %2; setna %0"
+            : "=q"( error ) : "m" ( desc ), "r" ( type ) : "cc", "memory");
+    return error;
+}
+
 static __inline uint8_t
 vmlaunch() {
 	uint8_t error = 0;